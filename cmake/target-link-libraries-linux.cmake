@@ -14,5 +14,6 @@ target_link_libraries(
         bz2
         lzma
         pthread
+        rt
         freeimage
 )
\ No newline at end of file
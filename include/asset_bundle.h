@@ -0,0 +1,68 @@
+#pragma once
+
+#include "base.h"
+
+// A bundle is a single file holding every startup asset, laid out as
+//   Header | IndexEntry[EntryCount] | payloads (each aligned to Alignment)
+// so that it can be memory-mapped once and every payload can be used in place.
+class AssetBundle final
+{
+public:
+   enum class EntryType : uint32_t
+   {
+      Binary = 0,
+      SPIRV,
+      PipelineCache,
+      TextureRGBA8
+   };
+
+   struct Header
+   {
+      std::array<char, 4> Magic;
+      uint32_t Version;
+      uint32_t EntryCount;
+      uint32_t Reserved;
+   };
+
+   struct IndexEntry
+   {
+      std::array<char, 64> Name;
+      EntryType Type;
+      uint32_t Width;
+      uint32_t Height;
+      uint32_t Reserved;
+      uint64_t Offset;
+      uint64_t Size;
+   };
+
+   struct Asset
+   {
+      EntryType Type;
+      uint32_t Width;
+      uint32_t Height;
+      const uint8_t* Data;
+      size_t Size;
+   };
+
+   inline static constexpr std::array<char, 4> Magic = { 'O', 'V', 'K', 'B' };
+   inline static constexpr uint32_t Version = 1;
+   inline static constexpr uint64_t Alignment = 256;
+
+   AssetBundle();
+   ~AssetBundle();
+
+   AssetBundle(const AssetBundle&) = delete;
+   AssetBundle& operator=(const AssetBundle&) = delete;
+
+   [[nodiscard]] bool open(const std::filesystem::path& bundle_path);
+   void close();
+   [[nodiscard]] bool isOpen() const { return MappedData != nullptr; }
+   [[nodiscard]] std::optional<Asset> find(const std::string& name) const;
+   [[nodiscard]] static uint64_t align(uint64_t offset) { return (offset + Alignment - 1) / Alignment * Alignment; }
+
+private:
+   int FileDescriptor;
+   const uint8_t* MappedData;
+   size_t MappedSize;
+   std::unordered_map<std::string, Asset> Assets;
+};
\ No newline at end of file
@@ -41,6 +41,7 @@
 #include <fstream>
 #include <filesystem>
 #include <memory>
+#include <functional>
 #include <chrono>
 
 #include "project_constants.h"
@@ -2,6 +2,16 @@
 
 #include "base.h"
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// The Vulkan instance and device with everything that belongs to them. Several renderers can share one context,
+// each on its own thread: every thread records into command buffers of its own pool, and the queue is only
+// submitted to through submit() or submitAndWait(), which serialize the access to it. Every submission signals the
+// next value of a timeline, so a caller waits for its own work and the work submitted before it, never for the
+// whole queue.
 class CommonVK final
 {
 public:
@@ -12,40 +22,80 @@ public:
       [[nodiscard]] bool isComplete() const { return GraphicsFamily.has_value(); }
    };
 
-   CommonVK() = default;
-   ~CommonVK() = default;
+   // Picks a device explicitly instead of the one with the best score. The first field that is set decides, and the
+   // environment variable OFFSCREEN_VULKAN_DEVICE overrides all of them with an index, a UUID or a name.
+   struct DeviceSelection
+   {
+      // Part of the device name, compared without case, e.g. "llvmpipe" for lavapipe.
+      std::string Name;
+      // VkPhysicalDeviceIDProperties::deviceUUID as 32 hexadecimal digits, dashes are ignored.
+      std::string UUID;
+      // Position in the order of vkEnumeratePhysicalDevices.
+      int Index = -1;
+
+      [[nodiscard]] bool isEmpty() const { return Name.empty() && UUID.empty() && Index < 0; }
+   };
+
+   CommonVK();
+   ~CommonVK();
+
+   CommonVK(const CommonVK&) = delete;
+   CommonVK& operator=(const CommonVK&) = delete;
 
+   // Creates the instance and the device. The selection is only used by the first call.
+   void initialize(const DeviceSelection& selection = DeviceSelection{});
+   [[nodiscard]] bool isInitialized() const { return Device != VK_NULL_HANDLE; }
    [[nodiscard]] static uint32_t getValidationLayerSize() { return static_cast<uint32_t>(ValidationLayers.size()); }
    [[nodiscard]] static const char* const* getValidationLayerNames() { return ValidationLayers.data(); }
-   [[nodiscard]] static VkPhysicalDevice getPhysicalDevice() { return PhysicalDevice; }
-   [[nodiscard]] static VkDevice getDevice() { return Device; }
-   [[nodiscard]] static VkQueue getGraphicsQueue() { return GraphicsQueue; }
-   [[nodiscard]] static VkCommandPool getCommandPool() { return CommandPool; }
+   [[nodiscard]] VkInstance getInstance() const { return Instance; }
+   [[nodiscard]] VkPhysicalDevice getPhysicalDevice() const { return PhysicalDevice; }
+   [[nodiscard]] VkDevice getDevice() const { return Device; }
+   // The pool of the calling thread, which is created on its first call. A command buffer allocated from it may only
+   // be recorded, reset and freed on the same thread.
+   [[nodiscard]] VkCommandPool getCommandPool();
+   // Destroys the pool of the calling thread with the command buffers left in it, for a thread that is about to exit.
+   // None of them may still be pending on the queue.
+   void releaseCommandPool();
+   [[nodiscard]] bool isGraphicsPipelineLibrarySupported() const { return GraphicsPipelineLibrarySupported; }
+   [[nodiscard]] bool isTimelineSemaphoreSupported() const { return TimelineSemaphoreSupported; }
+   // Returns the timeline value the submission signals once it is complete. The values increase with every call.
+   uint64_t submit(const VkSubmitInfo& submit_info);
+   // Blocks until the submission of the value, and every one before it, is complete. 0 is complete from the start.
+   void wait(uint64_t value);
+   [[nodiscard]] bool isComplete(uint64_t value);
+   uint64_t submitAndWait(const VkSubmitInfo& submit_info);
    [[nodiscard]] static QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
    [[nodiscard]] static bool isDeviceSuitable(VkPhysicalDevice device);
+   // Higher is better: the device type first, then the device local memory and the optional features.
+   [[nodiscard]] static int64_t scoreDevice(VkPhysicalDevice device);
+   // Throws if the value is an index too large to be one.
+   [[nodiscard]] static DeviceSelection parseDeviceSelection(const std::string& value);
    [[nodiscard]] static bool hasStencilComponent(VkFormat format)
    {
       return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
    }
-   [[nodiscard]] static VkFormat findSupportedFormat(
+   [[nodiscard]] VkFormat findSupportedFormat(
       const std::vector<VkFormat>& candidates,
       VkImageTiling tiling,
       VkFormatFeatureFlags features
-   );
-   [[nodiscard]] static VkFormat findDepthFormat();
-   [[nodiscard]] static uint32_t findMemoryType(uint32_t type_filter, VkMemoryPropertyFlags properties);
+   ) const;
+   [[nodiscard]] VkFormat findDepthFormat() const;
+   [[nodiscard]] static bool isRectEmpty(const VkRect2D& rect)
+   {
+      return rect.extent.width == 0 || rect.extent.height == 0;
+   }
+   [[nodiscard]] static bool areRectsOverlapping(const VkRect2D& a, const VkRect2D& b);
+   [[nodiscard]] static VkRect2D uniteRects(const VkRect2D& a, const VkRect2D& b);
+   [[nodiscard]] uint32_t findMemoryType(uint32_t type_filter, VkMemoryPropertyFlags properties) const;
    static bool checkValidationLayerSupport();
-   static void pickPhysicalDevice(VkInstance Instance);
-   static void createLogicalDevice();
-   static void createCommandPool();
-   static void createBuffer(
+   void createBuffer(
       VkDeviceSize size,
       VkBufferUsageFlags usage,
       VkMemoryPropertyFlags properties,
       VkBuffer& buffer,
       VkDeviceMemory& buffer_memory
-   );
-   static void createImage(
+   ) const;
+   void createImage(
       uint32_t width,
       uint32_t height,
       VkFormat format,
@@ -54,10 +104,10 @@ public:
       VkMemoryPropertyFlags properties,
       VkImage& image,
       VkDeviceMemory& image_memory
-   );
-   static VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags);
-   static VkCommandBuffer createCommandBuffer(VkCommandBufferLevel level);
-   static void flushCommandBuffer(VkCommandBuffer commandBuffer);
+   ) const;
+   [[nodiscard]] VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags) const;
+   [[nodiscard]] VkCommandBuffer createCommandBuffer(VkCommandBufferLevel level);
+   void flushCommandBuffer(VkCommandBuffer command_buffer);
    static void insertImageMemoryBarrier(
       VkCommandBuffer command_buffer,
       VkImage image,
@@ -74,13 +124,91 @@ private:
    inline static const std::array<const char*, 1> ValidationLayers = {
       "VK_LAYER_KHRONOS_validation"
    };
-   inline static const std::array<const char*, 1> DeviceExtensions = {
-      VK_KHR_SWAPCHAIN_EXTENSION_NAME
-   };
-   inline static VkPhysicalDevice PhysicalDevice = VK_NULL_HANDLE;
-   inline static VkDevice Device{};
-   inline static VkQueue GraphicsQueue{};
-   inline static VkCommandPool CommandPool{};
+   VkInstance Instance;
+   VkPhysicalDevice PhysicalDevice;
+   VkDevice Device;
+   VkQueue GraphicsQueue;
+   bool GraphicsPipelineLibrarySupported;
+   bool TimelineSemaphoreSupported;
+   VkSemaphore Timeline;
+   // The value of the last submission, which only changes while QueueMutex is locked.
+   uint64_t SubmittedValue;
+   // A lower bound of the value the timeline has reached, which saves asking the device.
+   std::atomic<uint64_t> CompletedValue;
+   // Without timeline semaphores, every submission signals a fence of its own instead, from the oldest one on.
+   std::deque<std::pair<uint64_t, VkFence>> PendingFences;
+   std::vector<VkFence> FreeFences;
+   std::mutex FenceMutex;
+   std::once_flag InitializationFlag;
+   std::mutex QueueMutex;
+   std::mutex CommandPoolMutex;
+   std::unordered_map<std::thread::id, VkCommandPool> CommandPools;
 
-   static bool checkDeviceExtensionSupport(VkPhysicalDevice device);
+#ifdef NDEBUG
+   inline static constexpr bool EnableValidationLayers = false;
+#else
+   inline static constexpr bool EnableValidationLayers = true;
+   VkDebugUtilsMessengerEXT DebugMessenger{};
+
+   static void populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& create_info);
+   void setupDebugMessenger();
+   static VkResult createDebugUtilsMessengerEXT(
+      VkInstance instance,
+      const VkDebugUtilsMessengerCreateInfoEXT* create_info,
+      const VkAllocationCallbacks* allocator,
+      VkDebugUtilsMessengerEXT* debug_messenger
+   )
+   {
+       auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(
+         instance,
+         "vkCreateDebugUtilsMessengerEXT"
+      );
+       if (func != nullptr) return func( instance, create_info, allocator, debug_messenger );
+       else return VK_ERROR_EXTENSION_NOT_PRESENT;
+   }
+
+   static void destroyDebugUtilsMessengerEXT(
+      VkInstance instance,
+      VkDebugUtilsMessengerEXT debug_messenger,
+      const VkAllocationCallbacks* allocator
+   )
+   {
+      auto func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(
+         instance,
+         "vkDestroyDebugUtilsMessengerEXT"
+      );
+      if (func != nullptr) func( instance, debug_messenger, allocator);
+   }
+
+   static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
+      VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
+      VkDebugUtilsMessageTypeFlagsEXT message_type,
+      const VkDebugUtilsMessengerCallbackDataEXT* callback_data,
+      void* user_data
+   )
+   {
+      std::cerr << "validation layer: " << callback_data->pMessage << "\n";
+      return VK_FALSE;
+   }
+#endif
+
+   [[nodiscard]] static std::vector<const char*> getRequiredExtensions();
+   void createInstance();
+   void pickPhysicalDevice(const DeviceSelection& selection);
+   void createLogicalDevice();
+   void createTimeline();
+   [[nodiscard]] VkFence acquireFence();
+   void completeValue(uint64_t value);
+   [[nodiscard]] VkCommandPool createCommandPool() const;
+
+   static bool checkDeviceExtensionSupport(VkPhysicalDevice device, std::set<std::string> required_extensions);
+   // Empty for a device older than Vulkan 1.1.
+   [[nodiscard]] static std::string getDeviceUUID(VkPhysicalDevice device);
+   [[nodiscard]] static bool isDeviceSelected(
+      VkPhysicalDevice device,
+      uint32_t index,
+      const DeviceSelection& selection
+   );
+   static bool checkGraphicsPipelineLibrarySupport(VkPhysicalDevice device);
+   static bool checkTimelineSemaphoreSupport(VkPhysicalDevice device);
 };
\ No newline at end of file
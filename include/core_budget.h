@@ -0,0 +1,82 @@
+#pragma once
+
+#include "base.h"
+
+#include <mutex>
+#include <thread>
+#include <sched.h>
+
+// Splits the cores of the process between the stages that would otherwise each start a thread per core: llvmpipe
+// rasterizing for lavapipe, the encoder threads and the renderer threads, which read back, mux and write the output.
+// Pinning restricts every stage to its own cores. The libraries start their threads when the device is created and
+// when an encoder is opened, and a new thread inherits the cores of the thread starting it, so the renderer binds
+// itself to the cores of a stage around these calls.
+class CoreBudget final
+{
+public:
+   enum class Stage { Rasterization = 0, Encoding, IO };
+   inline static constexpr size_t StageCount = 3;
+
+   // Busy and total time of every core of the machine, from /proc/stat.
+   struct Sample
+   {
+      std::vector<uint64_t> BusyTicks;
+      std::vector<uint64_t> TotalTicks;
+      std::chrono::steady_clock::time_point Time;
+      double ProcessSeconds;
+   };
+
+   // Every stage gets at least one core. With fewer cores than stages, all of them share all cores.
+   CoreBudget(std::vector<int> cores, const std::array<float, StageCount>& weights, bool pin_threads);
+
+   // The budget of this process, which OFFSCREEN_VULKAN_CORE_BUDGET sets on the first call. Without it, nullptr
+   // leaves every stage with its own defaults.
+   [[nodiscard]] static std::shared_ptr<const CoreBudget> getProcessBudget();
+   static void setProcessBudget(std::shared_ptr<const CoreBudget> budget);
+   // "auto" or weights like "5:4:1" for rasterization, encoding and IO, followed by ",pin" to pin the threads.
+   // The weights split the cores the process may run on.
+   [[nodiscard]] static std::shared_ptr<CoreBudget> parse(const std::string& value);
+   [[nodiscard]] static std::vector<int> getAllowedCores();
+
+   // The same weights over a disjoint share of the cores, for one of several processes that render side by side.
+   [[nodiscard]] std::shared_ptr<CoreBudget> split(int part_count, int part_index) const;
+   [[nodiscard]] int getThreadCount(Stage stage) const
+   {
+      return static_cast<int>(StageCores[static_cast<size_t>(stage)].size());
+   }
+   [[nodiscard]] const std::vector<int>& getCores(Stage stage) const { return StageCores[static_cast<size_t>(stage)]; }
+   [[nodiscard]] bool isPinning() const { return PinThreads; }
+   // Sets LP_NUM_THREADS unless it is set already. llvmpipe reads it when lavapipe enumerates its device, so this has
+   // to happen before the Vulkan instance is created.
+   void limitRasterizerThreads() const;
+   // Restricts the calling thread, and every thread it starts from now on, to the cores of the stage if pinning.
+   void bindCurrentThread(Stage stage) const;
+   [[nodiscard]] static Sample sample();
+   // Prints how busy the cores of each stage were since the sample. Unless pinned, other stages run there as well.
+   void printUtilization(const Sample& start, std::ostream& stream) const;
+
+   // Binds the calling thread to a stage and restores its previous cores when it goes out of scope.
+   class ScopedBinding final
+   {
+   public:
+      ScopedBinding(const CoreBudget* budget, Stage stage);
+      ~ScopedBinding();
+
+      ScopedBinding(const ScopedBinding&) = delete;
+      ScopedBinding& operator=(const ScopedBinding&) = delete;
+
+   private:
+      bool Bound;
+      cpu_set_t PreviousCores;
+   };
+
+private:
+   inline static std::mutex ProcessBudgetMutex;
+   inline static bool ProcessBudgetLoaded = false;
+   inline static std::shared_ptr<const CoreBudget> ProcessBudget;
+
+   std::vector<int> Cores;
+   std::array<float, StageCount> Weights;
+   bool PinThreads;
+   std::array<std::vector<int>, StageCount> StageCores;
+};
\ No newline at end of file
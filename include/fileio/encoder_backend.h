@@ -0,0 +1,87 @@
+#pragma once
+
+#include "fileio/file_encoder.h"
+
+#include <mutex>
+
+// Everything that differs between the encoder libraries: which libavcodec encoder is opened, which pixel format it
+// takes and the private options that tune and thread it. FileEncoder sets what all of them share, which is the size,
+// the time base, the GOP and the generic rate control and threading, and then lets the backend configure the rest.
+class EncoderBackend
+{
+public:
+   EncoderBackend(std::string name, AVCodecID codec_id);
+   virtual ~EncoderBackend() = default;
+
+   EncoderBackend(const EncoderBackend&) = delete;
+   EncoderBackend& operator=(const EncoderBackend&) = delete;
+
+   [[nodiscard]] const std::string& getName() const { return Name; }
+   [[nodiscard]] AVCodecID getCodecID() const { return CodecID; }
+   // False if the linked libavcodec was built without this encoder.
+   [[nodiscard]] bool isAvailable() const { return findEncoder() != nullptr; }
+   [[nodiscard]] const AVCodec* findEncoder() const;
+   [[nodiscard]] virtual AVPixelFormat getPixelFormat(const EncoderOptions& options, AVPixelFormat frame_format) const;
+   // Called before the context is opened, after the options shared by all backends are set.
+   virtual void configure(AVCodecContext* context, const EncoderOptions& options) const;
+
+   // Registered backends live as long as the program, so the pointers find() returns stay valid.
+   // Throws if a backend with the same name is already registered.
+   static void registerBackend(std::unique_ptr<EncoderBackend> backend);
+   // The backend with this name, or nullptr if there is none or it is not available.
+   [[nodiscard]] static const EncoderBackend* find(const std::string& name);
+   // The first available backend registered for the codec, or one with the default libavcodec encoder of it.
+   [[nodiscard]] static const EncoderBackend* find(AVCodecID codec_id);
+   [[nodiscard]] static std::vector<const EncoderBackend*> getAvailableBackends();
+
+protected:
+   std::string Name;
+   AVCodecID CodecID;
+
+   // The thread count of the options, or the number of hardware threads if it is 0.
+   [[nodiscard]] static int getThreadCount(const EncoderOptions& options);
+   // Index of the x264 preset, from 0 for placebo to 9 for ultrafast, so that one preset name can drive every backend.
+   [[nodiscard]] static int getSpeedLevel(const std::string& preset);
+
+private:
+   inline static std::mutex RegistryMutex;
+
+   [[nodiscard]] static std::vector<std::unique_ptr<EncoderBackend>>& getRegistry();
+};
+
+class X264Backend final : public EncoderBackend
+{
+public:
+   X264Backend() : EncoderBackend( "libx264", AV_CODEC_ID_H264 ) {}
+
+   [[nodiscard]] AVPixelFormat getPixelFormat(const EncoderOptions& options, AVPixelFormat frame_format) const override;
+   void configure(AVCodecContext* context, const EncoderOptions& options) const override;
+};
+
+// CRF is passed as is, so it takes the VP9 scale from 0 to 63 where about 31 matches the default of x264.
+class VP9Backend final : public EncoderBackend
+{
+public:
+   VP9Backend() : EncoderBackend( "libvpx-vp9", AV_CODEC_ID_VP9 ) {}
+
+   [[nodiscard]] AVPixelFormat getPixelFormat(const EncoderOptions& options, AVPixelFormat frame_format) const override;
+   void configure(AVCodecContext* context, const EncoderOptions& options) const override;
+};
+
+// CRF is passed as is, so it takes the AV1 scale from 0 to 63 where about 35 matches the default of x264.
+class SVTAV1Backend final : public EncoderBackend
+{
+public:
+   SVTAV1Backend() : EncoderBackend( "libsvtav1", AV_CODEC_ID_AV1 ) {}
+
+   void configure(AVCodecContext* context, const EncoderOptions& options) const override;
+};
+
+class FFV1Backend final : public EncoderBackend
+{
+public:
+   FFV1Backend() : EncoderBackend( "ffv1", AV_CODEC_ID_FFV1 ) {}
+
+   [[nodiscard]] AVPixelFormat getPixelFormat(const EncoderOptions& options, AVPixelFormat frame_format) const override;
+   void configure(AVCodecContext* context, const EncoderOptions& options) const override;
+};
\ No newline at end of file
@@ -27,6 +27,7 @@ constexpr int ERROR_EOF = -static_cast<int>(
 );
 constexpr uint FORMAT_OPENED_NO_FILE = 0x0001u;
 constexpr uint FORMAT_WANTS_GLOBAL_HEADER = 0x0040u;
+constexpr uint FORMAT_NO_TIMESTAMPS = 0x0080u;
 constexpr uint CODEC_FLAG_GLOBAL_HEADER = 1u << 22u;
 
 class FileCodec
@@ -2,6 +2,128 @@
 
 #include "fileio/file_codec.h"
 
+class EncoderBackend;
+
+struct EncoderOptions
+{
+   enum class RateControl { CRF, CBR, VBR };
+   enum class Threading { Auto, Frame, Slice, FrameAndSlice };
+   // Encode: every frame is converted and encoded.
+   // Drop: a frame identical to the previous one is skipped, which extends the duration of the previous frame and
+   //       makes the output variable frame rate.
+   // Repeat: the converted previous frame is encoded again, which keeps a constant frame rate but skips the conversion.
+   enum class DuplicateFrames { Encode, Drop, Repeat };
+
+   RateControl RateControlMode = RateControl::VBR;
+   int Bitrate = 5'000'000;
+   int MaxBitrate = 0;
+   int BufferSize = 0;
+   float CRF = 23.0f;
+   int GOPSize = 15;
+   // x264 and SVT-AV1 only. Without the scene cut detection of the encoder, a new GOP starts only at GOPSize or at
+   // a frame the caller marks with FrameHints::Keyframe, which spares the analysis in the lookahead. GOPSize can then
+   // be raised, because the keyframes that matter for the quality already come from the caller.
+   bool SceneCutDetection = true;
+   std::string Preset = "fast";
+   std::string Tune;
+   std::string Profile = "main";
+   int Lookahead = -1;
+   Threading ThreadingMode = Threading::Auto;
+   int ThreadCount = 0;
+   int LookaheadThreadCount = 0;
+   // x264 and VP9 only. x264 encodes with qp=0, which also switches the profile to high444.
+   bool Lossless = false;
+   // Every frame is a keyframe, so any frame can be cut or decoded on its own.
+   bool IntraOnly = false;
+   // Every GOP is exactly GOPSize frames long. No GOP is cut short by the scene cut detection or by
+   // FrameHints::Keyframe, so that fragments and segments of a fixed duration begin at keyframes.
+   bool FixedGOP = false;
+   // Keeps the parameter sets out of the packets and in the extradata, as muxers like MP4 require. VideoWriter sets it
+   // for such muxers, and every encoder whose packets go into the same stream has to be opened with the same value.
+   bool GlobalHeader = false;
+   // AV_PIX_FMT_NONE picks the default of the codec, e.g. BGR0 for FFV1 or the unconverted RGBA for raw video.
+   AVPixelFormat PixelFormat = AV_PIX_FMT_NONE;
+   // Size of the encoded video. 0 keeps the size of the rendered frames, anything else scales them with swscale.
+   int OutputWidth = 0;
+   int OutputHeight = 0;
+   // Lets the encoder measure the error of every frame, which FrameStatistics reports as PSNR.
+   // x264 additionally prints the SSIM of the whole video to the log when it is closed.
+   bool MeasureQuality = false;
+   // If set, the FrameStatistics of every packet are written to this path when the encoder is closed,
+   // as JSON if the extension is .json and as CSV otherwise.
+   std::filesystem::path StatisticsFilePath;
+   DuplicateFrames DuplicateFrameMode = DuplicateFrames::Encode;
+   // Name of the encoder, e.g. "libx264", "libvpx-vp9", "libsvtav1" or "ffv1", which also decides the codec.
+   // Empty uses the first available backend of the codec the encoder is opened with.
+   std::string Backend;
+};
+
+// Describes one encoded packet, in the order the encoder produced them. The times of the frame that became this
+// packet are included, and PSNR is NaN unless EncoderOptions::MeasureQuality was set and the encoder reports errors.
+struct FrameStatistics
+{
+   int64_t FrameNumber;
+   char PictureType;
+   bool Keyframe;
+   int QP;
+   int PacketSize;
+   double ConversionMilliseconds;
+   double SendMilliseconds;
+   double ReceiveMilliseconds;
+   double PSNR;
+};
+
+// A rectangle in the pixels of the rendered frame, whose first row is the first row of the image buffer.
+// A positive priority lowers the quantizer inside of it and a negative one raises it, up to 1 and -1.
+struct RegionOfInterest
+{
+   int Left;
+   int Top;
+   int Width;
+   int Height;
+   float Priority;
+};
+
+// What the caller knows about a frame beyond its pixels.
+struct FrameHints
+{
+   // Encodes the frame as an IDR frame, e.g. at a camera switch or a scene change, so that a GOP begins with it.
+   bool Keyframe = false;
+   // Where the quality matters more or less than elsewhere. Only x264 and libvpx use them, and where regions overlap,
+   // the one that comes first decides.
+   std::vector<RegionOfInterest> Regions;
+   // FileEncoder::hashFrame() of the frame if the caller already has it, e.g. for every rendition of a ladder.
+   std::optional<uint64_t> Hash;
+};
+
+struct EncoderThroughput
+{
+   int64_t Frames = 0;
+   int64_t DuplicateFrames = 0;
+   int64_t Bytes = 0;
+   // Time spent in flipping and converting the rendered frames, and in encoding and muxing them.
+   double ConversionSeconds = 0.0;
+   double EncodingSeconds = 0.0;
+
+   [[nodiscard]] double getFramesPerSecond() const
+   {
+      const double seconds = ConversionSeconds + EncodingSeconds;
+      return seconds > 0.0 ? static_cast<double>(Frames) / seconds : 0.0;
+   }
+};
+
+// Where and how a packet ended up in the container. Position and Size are byte ranges of the output as the muxer
+// wrote it, FrameNumber is the presentation index of the frame and PTS/DTS are in the stream time base.
+struct PacketInfo
+{
+   int64_t FrameNumber;
+   int64_t PTS;
+   int64_t DTS;
+   bool Keyframe;
+   int64_t Position;
+   int64_t Size;
+};
+
 class FileEncoder final : public FileCodec
 {
 public:
@@ -12,20 +134,81 @@ public:
       int frame_width,
       int frame_height,
       float framerate,
-      AVCodecID codec_id
+      AVCodecID codec_id,
+      const EncoderOptions& options
    );
    void close();
-   bool encode(AVFormatContext* format_context, const uint8_t* image_buffer, int track_id);
+   bool encode(
+      AVFormatContext* format_context,
+      const uint8_t* image_buffer,
+      int track_id,
+      const FrameHints& hints = FrameHints{}
+   );
    bool flushVideo(AVFormatContext* format_context, int track_id);
+   // Encodes without a muxer. The packets are in the codec time base and the caller has to free them.
+   bool encode(const uint8_t* image_buffer, std::vector<AVPacket*>& packets, const FrameHints& hints = FrameHints{});
+   bool flushVideo(std::vector<AVPacket*>& packets);
+   // Muxes a packet in the codec time base, which may come from another encoder opened with the same options.
+   bool writePacket(AVFormatContext* format_context, AVPacket* packet, int track_id);
+   [[nodiscard]] const EncoderOptions& getOptions() const { return Options; }
+   [[nodiscard]] AVRational getTimeBase() const { return VideoCodecContext->time_base; }
+   [[nodiscard]] const EncoderThroughput& getThroughput() const { return Throughput; }
+   // The hash the detection of duplicate frames compares, over the rows of a rendered RGBA frame.
+   [[nodiscard]] static uint64_t hashFrame(const uint8_t* image_buffer, int frame_width, int frame_height);
+   // Called for every packet the encoder produces.
+   void setStatisticsCallback(std::function<void(const FrameStatistics&)> callback)
+   {
+      StatisticsReady = std::move( callback );
+   }
+   static bool writeStatistics(
+      const std::filesystem::path& file_path,
+      const std::vector<FrameStatistics>& statistics
+   );
+   // Called after every packet is handed to the muxer.
+   void setPacketCallback(std::function<void(const PacketInfo&)> callback) { PacketWritten = std::move( callback ); }
 
 protected:
-   int Bitrate;
-   int GOPSize;
-   uint8_t* EncodingBuffer;
+   inline static constexpr int FrameAlignment = 32;
+
+   EncoderOptions Options;
+   int EncodedWidth;
+   int EncodedHeight;
+   // FrameHeight is rounded up to even, while the rendered frames have exactly this many rows.
+   int RenderedHeight;
+   AVBufferPool* FramePool;
    AVFrame* OriginalFrame;
    AVFrame* EncodedFrame;
+   // The last converted frame, which a static stretch that follows repeats without converting it again.
+   AVFrame* RepeatedFrame;
+   const EncoderBackend* Backend;
+   uint64_t PreviousFrameHash;
+   int64_t LastSentPTS;
+   std::function<void(const PacketInfo&)> PacketWritten;
+   EncoderThroughput Throughput;
+   std::function<void(const FrameStatistics&)> StatisticsReady;
+   std::vector<FrameStatistics> Statistics;
+   // Conversion and send times of the frames whose packets did not come out yet, by pts.
+   std::map<int64_t, std::pair<double, double>> PendingFrameTimes;
 
+   void setRateControl() const;
+   void setThreading() const;
+   [[nodiscard]] bool needsConversion() const
+   {
+      return VideoCodecContext->pix_fmt != PixelFormat || EncodedWidth != FrameWidth || EncodedHeight != FrameHeight;
+   }
    void setVideoCodecContext(const AVCodec* encoder);
-   void reallocateEncodingBufferIfNeeded();
-   bool writeVideoFrame(AVFormatContext* format_context, const AVFrame* frame, int track_id) const;
+   void createFramePool();
+   bool getPooledFrame(AVFrame* frame) const;
+   [[nodiscard]] bool collectsStatistics() const { return StatisticsReady || !Options.StatisticsFilePath.empty(); }
+   void recordStatistics(const AVPacket* packet, double receive_milliseconds);
+   [[nodiscard]] AVFrame* convertFrame(const uint8_t* image_buffer);
+   bool setRegionsOfInterest(AVFrame* frame, const std::vector<RegionOfInterest>& regions) const;
+   [[nodiscard]] bool isDuplicateFrame(const uint8_t* image_buffer, const FrameHints& hints);
+   bool receivePackets(const AVFrame* frame, const std::function<bool(AVPacket*)>& consume);
+   bool encodeFrame(
+      const uint8_t* image_buffer,
+      const FrameHints& hints,
+      const std::function<bool(AVPacket*)>& consume
+   );
+   bool flushFrames(const std::function<bool(AVPacket*)>& consume);
 };
\ No newline at end of file
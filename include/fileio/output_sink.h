@@ -0,0 +1,106 @@
+#pragma once
+
+#include "base.h"
+
+// Destination of the muxed bytes. VideoWriter buffers the muxer output in a large AVIO buffer and hands it over here
+// in big chunks, so each sink only decides where the bytes go.
+class OutputSink
+{
+public:
+   OutputSink() = default;
+   virtual ~OutputSink() = default;
+
+   OutputSink(const OutputSink&) = delete;
+   OutputSink& operator=(const OutputSink&) = delete;
+
+   [[nodiscard]] virtual bool isOpen() const = 0;
+   [[nodiscard]] virtual bool isSeekable() const = 0;
+   // Path of the written file if the sink is backed by a regular file, which muxers can reopen for post-processing.
+   [[nodiscard]] virtual std::filesystem::path getFilePath() const { return {}; }
+   // Returns the number of written bytes or a negative AVERROR code.
+   virtual int write(const uint8_t* buffer, int size) = 0;
+   // Follows the AVIOContext seek semantics including AVSEEK_SIZE. Returns a negative AVERROR code on failure.
+   virtual int64_t seek(int64_t offset, int whence) = 0;
+
+   // pipe:<fd> writes to an open descriptor, shm:<name> to a shared memory object, and anything else to a file.
+   // Returns nullptr if the destination is malformed. Whether it could be opened is told by isOpen().
+   [[nodiscard]] static std::shared_ptr<OutputSink> create(const std::filesystem::path& destination);
+   [[nodiscard]] static bool isFileDestination(const std::filesystem::path& destination);
+};
+
+class FileSink final : public OutputSink
+{
+public:
+   explicit FileSink(const std::filesystem::path& file_path);
+   ~FileSink() override;
+
+   [[nodiscard]] bool isOpen() const override { return FileDescriptor >= 0; }
+   [[nodiscard]] bool isSeekable() const override { return true; }
+   [[nodiscard]] std::filesystem::path getFilePath() const override { return FilePath; }
+   int write(const uint8_t* buffer, int size) override;
+   int64_t seek(int64_t offset, int whence) override;
+
+private:
+   int FileDescriptor;
+   std::filesystem::path FilePath;
+};
+
+// Writes to a descriptor that cannot seek such as stdout, a pipe or a socket.
+class PipeSink final : public OutputSink
+{
+public:
+   explicit PipeSink(int file_descriptor, bool owns_descriptor = false);
+   ~PipeSink() override;
+
+   [[nodiscard]] bool isOpen() const override { return FileDescriptor >= 0; }
+   [[nodiscard]] bool isSeekable() const override { return false; }
+   int write(const uint8_t* buffer, int size) override;
+   int64_t seek(int64_t offset, int whence) override;
+
+private:
+   int FileDescriptor;
+   bool OwnsDescriptor;
+};
+
+class MemorySink final : public OutputSink
+{
+public:
+   explicit MemorySink(size_t reserved_size = 0);
+   ~MemorySink() override = default;
+
+   [[nodiscard]] bool isOpen() const override { return true; }
+   [[nodiscard]] bool isSeekable() const override { return true; }
+   [[nodiscard]] const std::vector<uint8_t>& getData() const { return Data; }
+   int write(const uint8_t* buffer, int size) override;
+   int64_t seek(int64_t offset, int whence) override;
+
+private:
+   std::vector<uint8_t> Data;
+   size_t Position;
+};
+
+// Writes into a POSIX shared memory object, which another process can map while or after the video is written.
+// The object grows on demand and is truncated to the written size when the sink is destroyed.
+class SharedMemorySink final : public OutputSink
+{
+public:
+   explicit SharedMemorySink(std::string name, size_t initial_capacity = 64 * 1024 * 1024);
+   ~SharedMemorySink() override;
+
+   [[nodiscard]] bool isOpen() const override { return MappedData != nullptr; }
+   [[nodiscard]] bool isSeekable() const override { return true; }
+   [[nodiscard]] const std::string& getName() const { return Name; }
+   [[nodiscard]] size_t getSize() const { return Size; }
+   int write(const uint8_t* buffer, int size) override;
+   int64_t seek(int64_t offset, int whence) override;
+
+private:
+   std::string Name;
+   int FileDescriptor;
+   uint8_t* MappedData;
+   size_t Capacity;
+   size_t Size;
+   size_t Position;
+
+   bool reserve(size_t capacity);
+};
\ No newline at end of file
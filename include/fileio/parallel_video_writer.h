@@ -0,0 +1,81 @@
+#pragma once
+
+#include "fileio/video_writer.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Splits the frames into chunks of whole GOPs and encodes the chunks concurrently, each with its own FileEncoder.
+// A chunk begins with an IDR frame and references no frame outside of it, so the packets of all chunks form one
+// stream once their timestamps are shifted to the first frame of their chunk. The chunks are muxed in order.
+// Up to worker_count * chunk_frames rendered frames are buffered, which is what keeps every worker busy.
+class ParallelVideoWriter
+{
+public:
+   ParallelVideoWriter();
+   ~ParallelVideoWriter();
+
+   ParallelVideoWriter(const ParallelVideoWriter&) = delete;
+   ParallelVideoWriter& operator=(const ParallelVideoWriter&) = delete;
+
+   // A worker_count of 0 uses one encoder per 16 hardware threads. A chunk_frames of 0 uses 4 GOPs per chunk.
+   // Otherwise chunk_frames is rounded up to whole GOPs, so the keyframes are where a single encoder would put them.
+   [[nodiscard]] bool open(
+      const std::filesystem::path& video_file_path,
+      int frame_width,
+      int frame_height,
+      float framerate,
+      AVCodecID codec_id,
+      const EncoderOptions& options = EncoderOptions{},
+      const MuxerOptions& muxer_options = MuxerOptions{},
+      int worker_count = 0,
+      int chunk_frames = 0
+   );
+   void close();
+   void writeVideo(const uint8_t* image_buffer, const FrameHints& hints = FrameHints{});
+
+private:
+   struct Chunk
+   {
+      int64_t FirstFrame = 0;
+      std::deque<std::vector<uint8_t>> Frames;
+      std::deque<FrameHints> Hints;
+      // No frame is added to a complete chunk anymore.
+      bool Complete = false;
+      bool Taken = false;
+      bool Encoded = false;
+      bool Failed = false;
+      std::vector<AVPacket*> Packets;
+      std::vector<FrameStatistics> Statistics;
+   };
+
+   bool Running;
+   int FrameWidth;
+   int FrameHeight;
+   float Framerate;
+   AVCodecID VideoCodecID;
+   int ChunkFrames;
+   size_t FrameSize;
+   size_t MaxBufferedFrames;
+   size_t BufferedFrames;
+   int64_t FrameCount;
+   EncoderOptions WorkerOptions;
+   // The workers only report their statistics, which are written in frame order for the whole video.
+   std::filesystem::path StatisticsFilePath;
+   std::vector<FrameStatistics> Statistics;
+   VideoWriter Writer;
+   std::deque<std::unique_ptr<Chunk>> Chunks;
+   std::vector<std::vector<uint8_t>> FreeFrames;
+   std::vector<std::thread> Workers;
+   std::mutex Mutex;
+   std::condition_variable FrameAdded;
+   std::condition_variable FrameReleased;
+   std::condition_variable ChunkEncoded;
+
+   [[nodiscard]] Chunk* findWaitingChunk() const;
+   void work();
+   void encodeChunk(Chunk& chunk);
+   [[nodiscard]] bool muxEncodedChunks(bool wait_for_all);
+};
\ No newline at end of file
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "fileio/video_writer.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+struct Rendition
+{
+   std::filesystem::path FilePath;
+   // OutputWidth and OutputHeight select the resolution of the rendition, the rate control its bitrate.
+   EncoderOptions Options;
+   MuxerOptions Muxer;
+};
+
+// Encodes every rendered frame into several renditions. A frame is copied once into a shared buffer, and each
+// rendition scales and encodes it on its own thread, so the slowest rendition decides how far the renderer can
+// run ahead.
+class RenditionLadder
+{
+public:
+   RenditionLadder();
+   ~RenditionLadder();
+
+   RenditionLadder(const RenditionLadder&) = delete;
+   RenditionLadder& operator=(const RenditionLadder&) = delete;
+
+   [[nodiscard]] bool open(
+      const std::vector<Rendition>& renditions,
+      int frame_width,
+      int frame_height,
+      float framerate,
+      AVCodecID codec_id
+   );
+   void close();
+   void writeVideo(const uint8_t* image_buffer, const FrameHints& hints = FrameHints{});
+   [[nodiscard]] size_t getRenditionCount() const { return Workers.size(); }
+   [[nodiscard]] EncoderThroughput getThroughput(size_t index) const { return Workers[index]->Writer.getThroughput(); }
+
+private:
+   struct RenditionWorker
+   {
+      VideoWriter Writer;
+      std::deque<std::pair<std::shared_ptr<const std::vector<uint8_t>>, FrameHints>> Frames;
+      std::thread Thread;
+      std::atomic<bool> Failed{ false };
+   };
+
+   inline static constexpr size_t FramePoolSize = 4;
+
+   bool Running;
+   // Set if a rendition looks for duplicate frames, in which case the frame is hashed once for all of them.
+   bool HashesFrames;
+   int FrameWidth;
+   int FrameHeight;
+   size_t FrameSize;
+   std::vector<std::shared_ptr<std::vector<uint8_t>>> FramePool;
+   std::vector<std::unique_ptr<RenditionWorker>> Workers;
+   std::mutex Mutex;
+   std::condition_variable FrameAdded;
+   std::condition_variable FrameReleased;
+
+   [[nodiscard]] std::shared_ptr<std::vector<uint8_t>> findFreeFrame() const;
+   void work(RenditionWorker& worker);
+};
\ No newline at end of file
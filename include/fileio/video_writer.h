@@ -1,6 +1,62 @@
 #pragma once
 
 #include "fileio/file_encoder.h"
+#include "fileio/output_sink.h"
+
+struct MuxerOptions
+{
+   // Progressive: a classic MP4 whose index is written when the video is closed.
+   // Fragmented: a CMAF fragmented MP4 which can be read while it is still being written.
+   // Segmented: HLS with fMP4 segments, one file per fragment and a playlist that is updated after every segment.
+   enum class Layout { Progressive, Fragmented, Segmented };
+
+   Layout LayoutMode = Layout::Progressive;
+   // Every fragment or segment begins at a keyframe, so the GOP size is derived from this duration.
+   float FragmentDuration = 2.0f;
+   // Segmented layout only. Both are relative to the directory of the playlist.
+   std::string SegmentFileName = "segment_%05d.m4s";
+   std::string InitFileName = "init.mp4";
+   // Progressive layout into a file only. The index of the MP4 is moved to the front when the video is closed.
+   bool FastStart = false;
+   // Progressive layout only. If set, a FrameIndexFile is written to this path when the video is closed.
+   std::filesystem::path IndexFilePath;
+};
+
+// Sidecar index of a progressive MP4, laid out as
+//   Header | Record[FrameCount]
+// The records are ordered by frame number, so the byte range of any frame is found without a search.
+// A frame that was dropped as a duplicate has no packet of its own. Its record is flagged Duplicate and repeats the
+// record of SourceFrame, the frame shown in its place.
+struct FrameIndexFile
+{
+   enum Flag : uint32_t { Keyframe = 1u, Duplicate = 2u };
+
+   struct Header
+   {
+      std::array<char, 4> Magic;
+      uint32_t Version;
+      uint32_t FrameCount;
+      int32_t TimeBaseNumerator;
+      int32_t TimeBaseDenominator;
+      uint32_t Reserved;
+   };
+
+   struct Record
+   {
+      uint64_t Offset;
+      uint32_t Size;
+      uint32_t Flags;
+      int64_t PTS;
+      int64_t DTS;
+      uint32_t SourceFrame;
+      uint32_t Reserved;
+   };
+
+   inline static constexpr std::array<char, 4> Magic = { 'O', 'V', 'K', 'I' };
+   inline static constexpr uint32_t Version = 2;
+   // SourceFrame of a frame that has no record yet.
+   inline static constexpr uint32_t NoFrame = std::numeric_limits<uint32_t>::max();
+};
 
 class VideoWriter
 {
@@ -13,11 +69,39 @@ public:
       int frame_width,
       int frame_height,
       float framerate,
-      AVCodecID codec_id
+      AVCodecID codec_id,
+      const EncoderOptions& options = EncoderOptions{},
+      const MuxerOptions& muxer_options = MuxerOptions{}
+   );
+   // Writes the container through the given sink instead of a file. The format has to be named explicitly.
+   // The segmented layout is not available here because it writes several files.
+   [[nodiscard]] bool open(
+      std::shared_ptr<OutputSink> sink,
+      const std::string& format_name,
+      int frame_width,
+      int frame_height,
+      float framerate,
+      AVCodecID codec_id,
+      const EncoderOptions& options = EncoderOptions{},
+      const MuxerOptions& muxer_options = MuxerOptions{}
    );
    void close();
+   [[nodiscard]] EncoderThroughput getThroughput() const
+   {
+      return VideoEncoder != nullptr ? VideoEncoder->getThroughput() : EncoderThroughput{};
+   }
+   // Rounded up to whole pages. It takes effect at the next open.
+   void setIOBufferSize(size_t size);
 
-   void writeVideo(const uint8_t* image_buffer) const;
+   void writeVideo(const uint8_t* image_buffer, const FrameHints& hints = FrameHints{}) const;
+   // Muxes a packet that another FileEncoder produced with getEncoderOptions(), in the codec time base.
+   bool writePacket(AVPacket* packet) const;
+   [[nodiscard]] const EncoderOptions& getEncoderOptions() const { return VideoEncoder->getOptions(); }
+   // Takes effect for the frames written after the video is opened.
+   void setStatisticsCallback(std::function<void(const FrameStatistics&)> callback) const
+   {
+      if (VideoEncoder != nullptr) VideoEncoder->setStatisticsCallback( std::move( callback ) );
+   }
    void operator<<(const uint8_t* image_buffer) const
    {
       VideoEncoder->encode( FormatContext, image_buffer, VideoTrackID );
@@ -30,12 +114,30 @@ private:
    int FrameHeight;
    int FrameIndex;
    AVRational InverseFramerate;
+   MuxerOptions Muxer;
    AVFormatContext* FormatContext;
    uint8_t* IOContextBuffer;
    size_t IOContextBufferSize;
+   std::shared_ptr<OutputSink> Sink;
    std::unique_ptr<FileEncoder> VideoEncoder;
+   std::vector<FrameIndexFile::Record> IndexRecords;
 
-   [[nodiscard]] bool initialize(const std::filesystem::path& video_file_path);
+   static int writeIOContext(void* opaque, uint8_t* buffer, int size);
+   static int64_t seekIOContext(void* opaque, int64_t offset, int whence);
+   [[nodiscard]] bool initialize(std::shared_ptr<OutputSink> sink, const AVOutputFormat* output_format);
+   [[nodiscard]] bool initializeSegmented(const std::filesystem::path& playlist_path);
+   [[nodiscard]] bool openVideo(
+      int frame_width,
+      int frame_height,
+      float framerate,
+      AVCodecID codec_id,
+      const EncoderOptions& options
+   );
+   [[nodiscard]] bool usesFastStart() const;
+   [[nodiscard]] bool writesFrameIndex() const;
+   void setMuxerOptions(AVDictionary** options) const;
    void writeHeader();
    void addVideoTrack();
+   void recordPacket(const PacketInfo& info);
+   void writeFrameIndex(int64_t offset_shift) const;
 };
\ No newline at end of file
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "renderer.h"
+
+#include <queue>
+
+// One video of a job, written as output=<path>[:<width>x<height>[@<bitrate>]], e.g. output=low.mp4:640x360@800k.
+// The path may also be pipe:<fd> or shm:<name>, which are written as MP4, see OutputSink::create().
+struct RenderOutput
+{
+   std::filesystem::path Path;
+   // Size of the encoded video, 0 for the size of the rendered frames.
+   int Width = 0;
+   int Height = 0;
+   // Bits per second, optionally followed by k or M in the job line. 0 keeps the bitrate of the encoder options.
+   int Bitrate = 0;
+};
+
+struct RenderJob
+{
+   std::string Name;
+   // Higher runs first. Jobs of the same priority run in the order they arrived.
+   int Priority = 0;
+   uint32_t Width = 1280;
+   uint32_t Height = 720;
+   uint32_t FirstFrame = 0;
+   uint32_t FrameCount = 150;
+   // The texture of the squares, which is all a scene consists of. Empty keeps the current one.
+   std::filesystem::path Scene;
+   // Several outputs are encoded as renditions of a single render.
+   std::vector<RenderOutput> Outputs;
+   // If set, the range is rendered in segments of this many frames, which a restarted job does not render again.
+   // See SegmentedRender.
+   uint32_t SegmentFrames = 0;
+   // Renderers drawing interleaved frames at the same time. See ParallelRenderer.
+   int Workers = 1;
+   // Encoders working on chunks of whole GOPs of the single output at once. 0 encodes on one encoder.
+   int ChunkEncoders = 0;
+   // The container layout of every output. A segmented job only applies it when the segments are stitched.
+   MuxerOptions Muxer;
+   // h264, or one of the capture modes x264-lossless (qp=0, every frame a keyframe), ffv1 and raw.
+   std::string Codec = "h264";
+
+   // The options an output is encoded with, on top of which the renderer sets the threads and the keyframes.
+   [[nodiscard]] EncoderOptions getEncoderOptions(size_t output_index = 0) const;
+   [[nodiscard]] AVCodecID getCodecID() const;
+   // The extension of the default output, whose container has to hold the codec.
+   [[nodiscard]] std::string getFileExtension() const;
+};
+
+// Keeps one renderer alive across jobs, so the instance, the device, the pipelines and the loaded textures are only
+// created for the first job. Jobs are read one per line, either from a stream or from the clients of a Unix socket,
+// and are rendered one after another on the thread that called serve() or listen(), which the renderer requires.
+//
+// A job line is a list of key=value pairs, e.g.
+//   render name=intro priority=1 size=1920x1080 frames=0-149 scene=emoy.png output=intro.mp4 workers=4
+// or segment=300 instead of workers=4, where output may be repeated unless the job is segmented or has several
+// workers, e.g. output=high.mp4 output=mid.mp4:1280x720@3M output=low.mp4:640x360@800k for a rendition ladder.
+// chunks=4 encodes a single output on 4 encoders at once. layout=progressive|fragmented|hls picks the container
+// layout, where an hls output names the playlist and its segments are written next to it. A segmented job writes
+// its output to a file, and serve() does not take pipe:1 while it replies on the standard output.
+// A progressive output written to a file moves its index to the front with faststart, a flag without a value, and
+// index=<path> writes the frame index of a single progressive output to path, see FrameIndexFile.
+// codec=h264|x264-lossless|ffv1|raw picks the codec. ffv1 goes into .mkv and raw into .nut, which the output names,
+// so these two are written to files and not in segments.
+// "status" reports the queue, and "shutdown" stops the server after the running job.
+// Replies are lines too: queued, started, progress, done, failed or cancelled followed by the job name, or error.
+// done also tells the seconds the job took and the frames it rendered and encoded per second.
+// Nothing else is written to the output, and the diagnostics of the renderer go to the standard error.
+class JobServer final
+{
+public:
+   using Reporter = std::function<void(const std::string& message)>;
+
+   JobServer();
+   ~JobServer() = default;
+
+   JobServer(const JobServer&) = delete;
+   JobServer& operator=(const JobServer&) = delete;
+
+   // Returns once the input has ended and every queued job is rendered, or after a shutdown.
+   void serve(std::istream& input, std::ostream& output);
+   // Returns after a client sent a shutdown.
+   void listen(const std::filesystem::path& socket_path);
+   // Reports progress every this many frames besides the last one.
+   void setProgressInterval(uint32_t frames) { ProgressInterval = std::max( frames, 1u ); }
+   [[nodiscard]] static std::optional<RenderJob> parseJob(const std::string& line, std::string& error);
+
+private:
+   struct QueuedJob
+   {
+      RenderJob Job;
+      uint64_t Sequence;
+      Reporter Report;
+   };
+
+   struct JobOrder
+   {
+      bool operator()(const QueuedJob& a, const QueuedJob& b) const
+      {
+         return a.Job.Priority != b.Job.Priority ? a.Job.Priority < b.Job.Priority : a.Sequence > b.Sequence;
+      }
+   };
+
+   struct Client
+   {
+      int FileDescriptor;
+      std::mutex WriteMutex;
+      std::atomic<bool> Finished;
+
+      explicit Client(int file_descriptor) : FileDescriptor( file_descriptor ), Finished( false ) {}
+      ~Client();
+
+      void send(const std::string& message);
+   };
+
+   bool Accepting;
+   bool Stopped;
+   bool RepliesOnStandardOutput;
+   uint64_t NextSequence;
+   uint32_t ProgressInterval;
+   std::string RunningJob;
+   std::mutex Mutex;
+   std::condition_variable JobAdded;
+   std::priority_queue<QueuedJob, std::vector<QueuedJob>, JobOrder> Jobs;
+   std::shared_ptr<CommonVK> Common;
+   std::unique_ptr<RendererVK> Renderer;
+
+   // Queues a job or runs a command. Returns false if the line was a shutdown.
+   bool handleLine(const std::string& line, const Reporter& report);
+   void stop();
+   void finishInput();
+   void run();
+   void runJob(const QueuedJob& queued_job);
+   void readClient(const std::shared_ptr<Client>& client);
+};
\ No newline at end of file
@@ -1,11 +1,12 @@
 #pragma once
 
 #include "common.h"
+#include "asset_bundle.h"
 
 class ObjectVK final
 {
 public:
-   explicit ObjectVK(CommonVK* common);
+   explicit ObjectVK(CommonVK* common, const AssetBundle* assets = nullptr);
    ~ObjectVK();
 
    void setSquareObject(const std::string& texture_file_path);
@@ -22,6 +23,13 @@ public:
    [[nodiscard]] VkSampler getTextureSampler() const { return TextureSampler; }
    [[nodiscard]] VkDescriptorPool getDescriptorPool() const { return DescriptorPool; }
    [[nodiscard]] const VkDescriptorSet* getDescriptorSet() const { return &DescriptorSet; }
+   // Pixels the object covered before or covers after the last updateUniformBuffer, which is empty if it did not move.
+   [[nodiscard]] VkRect2D getDamageRegion() const { return DamageRegion; }
+   // Pixels the object covers in the frame of the last updateUniformBuffer.
+   [[nodiscard]] VkRect2D getScreenBounds() const { return ScreenBounds; }
+   // How much the encoder favors the object over the rest of the frame, from -1 to 1. 0 is no preference.
+   void setPriority(float priority) { Priority = std::clamp( priority, -1.0f, 1.0f ); }
+   [[nodiscard]] float getPriority() const { return Priority; }
 
 private:
    struct Vertex
@@ -70,6 +78,7 @@ private:
    };
 
    CommonVK* Common;
+   const AssetBundle* Assets;
    std::vector<Vertex> Vertices;
    VkImage TextureImage;
    VkDeviceMemory TextureImageMemory;
@@ -80,13 +89,27 @@ private:
    UniformBuffer Material;
    UniformBuffer Light;
    VkDescriptorSet DescriptorSet;
+   bool HasTransform;
+   glm::mat4 LastTransform;
+   VkExtent2D LastExtent;
+   VkRect2D ScreenBounds;
+   VkRect2D DamageRegion;
+   float Priority;
 
    static void getSquareObject(std::vector<Vertex>& vertices);
-   [[nodiscard]] static VkCommandBuffer beginSingleTimeCommands();
-   static void endSingleTimeCommands(VkCommandBuffer command_buffer);
-   static void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout);
-   static void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+   [[nodiscard]] VkCommandBuffer beginSingleTimeCommands() const;
+   void endSingleTimeCommands(VkCommandBuffer command_buffer) const;
+   void transitionImageLayout(
+      VkImage image,
+      VkFormat format,
+      VkImageLayout old_layout,
+      VkImageLayout new_layout
+   ) const;
+   void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) const;
+   void uploadTextureImage(const void* pixels, uint width, uint height);
    void createTextureImage(const std::string& texture_file_path);
    void createTextureImageView();
    void createTextureSampler();
+   [[nodiscard]] VkRect2D projectBounds(VkExtent2D extent, const glm::mat4& transform) const;
+   void updateDamageRegion(VkExtent2D extent, const glm::mat4& transform);
 };
\ No newline at end of file
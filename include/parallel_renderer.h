@@ -0,0 +1,64 @@
+#pragma once
+
+#include "job_server.h"
+
+// Hands the frames that several renderers finish out of order to the encoder in the order of their index. A frame
+// can only be started once it is less than Capacity frames ahead of the next one to encode, so that fast renderers
+// wait for slow ones and the encoder instead of piling up frames.
+class FrameReorderBuffer final
+{
+public:
+   FrameReorderBuffer(uint32_t first_frame, uint32_t frame_count, size_t capacity, size_t frame_size);
+
+   FrameReorderBuffer(const FrameReorderBuffer&) = delete;
+   FrameReorderBuffer& operator=(const FrameReorderBuffer&) = delete;
+
+   // Blocks until the frame fits into the window and returns a buffer to render it into, which is empty if aborted.
+   [[nodiscard]] std::vector<uint8_t> acquire(uint32_t frame_index);
+   void push(uint32_t frame_index, std::vector<uint8_t> frame, FrameHints hints);
+   // Blocks until the next frame is rendered. Returns false after the last frame or if aborted.
+   [[nodiscard]] bool pop(std::vector<uint8_t>& frame, FrameHints& hints);
+   // Gives the buffer of a popped frame back once it is encoded.
+   void recycle(std::vector<uint8_t> frame);
+   // Wakes up everyone waiting, so that a failed renderer or encoder does not leave the others blocked.
+   void abort();
+   [[nodiscard]] bool isComplete() const;
+
+private:
+   struct RenderedFrame
+   {
+      std::vector<uint8_t> Data;
+      FrameHints Hints;
+   };
+
+   bool Aborted;
+   uint32_t NextFrame;
+   uint32_t EndFrame;
+   size_t Capacity;
+   size_t FrameSize;
+   std::map<uint32_t, RenderedFrame> Frames;
+   std::vector<std::vector<uint8_t>> FreeFrames;
+   mutable std::mutex Mutex;
+   std::condition_variable WindowMoved;
+   std::condition_variable FramePushed;
+};
+
+// Renders interleaved frames of a job on several renderers at once. Every renderer runs on a thread of its own with
+// its own command pool, they share the device and its queue, and a FrameReorderBuffer feeds their frames to a single
+// VideoWriter. This keeps the cores busy when one frame alone cannot, as with lavapipe at low resolutions.
+class ParallelRenderer final
+{
+public:
+   ParallelRenderer(std::shared_ptr<CommonVK> common, int worker_count);
+
+   void setProgressCallback(RendererVK::ProgressCallback callback) { Progress = std::move( callback ); }
+   // Writes the frame range of the job into its first output.
+   [[nodiscard]] bool render(const RenderJob& job);
+
+private:
+   int WorkerCount;
+   std::shared_ptr<CommonVK> Common;
+   RendererVK::ProgressCallback Progress;
+
+   void work(int worker_index, const RenderJob& job, FrameReorderBuffer& reorder_buffer);
+};
\ No newline at end of file
@@ -2,15 +2,57 @@
 
 #include "object.h"
 #include "shader.h"
-#include "fileio/video_writer.h"
+#include "core_budget.h"
+#include "fileio/rendition_ladder.h"
+#include "fileio/parallel_video_writer.h"
 
 class RendererVK final
 {
 public:
+   // Called after every frame with the number of frames rendered so far and the number of frames of the range.
+   using ProgressCallback = std::function<void(uint32_t rendered_frames, uint32_t frame_count)>;
+
    RendererVK();
+   // Renders with a context shared with other renderers, which may play on other threads at the same time.
+   // A renderer has to stay on the thread of its first play(), which owns the pool of its command buffers.
+   explicit RendererVK(std::shared_ptr<CommonVK> common);
    ~RendererVK();
 
    void play();
+   void resize(uint32_t width, uint32_t height);
+   // Renders once and encodes every frame into each rendition instead of the single result.mp4.
+   void setRenditions(std::vector<Rendition> renditions) { Renditions = std::move( renditions ); }
+   // The single video written when there are no renditions. pipe:<fd> and shm:<name> are taken as well.
+   void setOutputPath(std::filesystem::path output_path) { OutputPath = std::move( output_path ); }
+   // play() renders frame_count frames starting at first_frame, whose index drives the animation.
+   void setFrameRange(uint32_t first_frame, uint32_t frame_count)
+   {
+      FirstFrame = first_frame;
+      FrameCount = frame_count;
+   }
+   // Replaces the texture of the squares. Everything else stays loaded, so switching scenes only uploads the image.
+   void setTexture(const std::filesystem::path& texture_path);
+   void setProgressCallback(ProgressCallback callback) { Progress = std::move( callback ); }
+   // Draws a frame and copies it with tightly packed rows into frame, which holds at least width * height * 4 bytes,
+   // for a caller that encodes it itself. A renderer used like this has to stay on one thread as with play().
+   FrameHints renderFrame(uint32_t frame_index, uint8_t* frame);
+   [[nodiscard]] float getFramerate() const { return Framerate; }
+   // The options of the single video, which a stream written elsewhere has to match to be muxed together with it.
+   [[nodiscard]] EncoderOptions getEncoderOptions() const;
+   // Encodes the single video in chunks of whole GOPs on this many encoders at once, see ParallelVideoWriter.
+   // 0 encodes it on one encoder. Renditions are always encoded on one encoder each.
+   void setChunkEncoders(int encoder_count) { ChunkEncoders = std::max( encoder_count, 0 ); }
+   // What getEncoderOptions() starts from. The renderer only fills in the threads and the keyframe placement.
+   void setEncoderOptions(EncoderOptions options) { BaseEncoderOptions = std::move( options ); }
+   // The container layout of the single video. Renditions carry their own.
+   void setMuxerOptions(MuxerOptions options) { Muxer = std::move( options ); }
+   // The codec of every video, whose container is picked by the extension of the output path.
+   void setCodec(AVCodecID codec_id) { VideoCodecID = codec_id; }
+   [[nodiscard]] AVCodecID getCodecID() const { return VideoCodecID; }
+   // Marks a frame where the scene changes, e.g. by a camera switch, which the encoder makes a keyframe.
+   void addSceneCut(uint32_t frame_index) { SceneCuts.insert( frame_index ); }
+   // Has to be called before the first play(), which picks the device unless the shared context already has one.
+   void setDeviceSelection(CommonVK::DeviceSelection selection) { DeviceChoice = std::move( selection ); }
 
 private:
    struct FrameBufferAttachment
@@ -20,88 +62,80 @@ private:
 		VkImageView View;
 	};
 
+   struct ReadbackSlot
+   {
+      VkImage Image;
+      VkDeviceMemory Memory;
+      VkSubresourceLayout Layout;
+      uint8_t* Data;
+   };
+
    uint32_t FrameWidth;
    uint32_t FrameHeight;
-   uint32_t FrameIndex;
+   uint32_t FirstFrame;
+   uint32_t FrameCount;
    float Framerate;
-   VkInstance Instance;
    VkFormat ColorFormat;
    VkFramebuffer Framebuffer;
+   // Owned by Shader like its base pipeline.
+   VkPipeline UnlitPipeline;
    std::shared_ptr<CommonVK> Common;
+   std::shared_ptr<AssetBundle> Assets;
    FrameBufferAttachment ColorAttachment;
    FrameBufferAttachment DepthAttachment;
+   ReadbackSlot Readback;
+   // The readback image keeps the previous frame, so only the damaged regions are copied unless this is set.
+   bool FullReadbackNeeded;
+   uint64_t ReadbackBytes;
    VkBuffer VertexBuffer;
    VkDeviceMemory VertexBufferMemory;
+   // The pool of the thread that allocated CommandBuffer, which has to be freed into the same pool.
+   VkCommandPool CommandPool;
    VkCommandBuffer CommandBuffer;
-   VkFence Fence;
+   // The timeline value of the last frame submitted, which is waited for before the frame resources are touched.
+   uint64_t LastSubmission;
    std::shared_ptr<ObjectVK> UpperSquareObject;
    std::shared_ptr<ObjectVK> LowerSquareObject;
    std::shared_ptr<ShaderVK> Shader;
    std::shared_ptr<VideoWriter> Recorder;
+   std::shared_ptr<ParallelVideoWriter> ChunkedRecorder;
+   int ChunkEncoders;
+   std::shared_ptr<RenditionLadder> Ladder;
+   std::vector<Rendition> Renditions;
+   std::filesystem::path OutputPath;
+   EncoderOptions BaseEncoderOptions;
+   MuxerOptions Muxer;
+   AVCodecID VideoCodecID;
+   std::filesystem::path TexturePath;
+   ProgressCallback Progress;
+   std::set<uint32_t> SceneCuts;
+   CommonVK::DeviceSelection DeviceChoice;
+   // The budget of the process when the renderer was created, or nullptr to leave the thread counts to the libraries.
+   std::shared_ptr<const CoreBudget> Budget;
 
-#ifdef NDEBUG
-   inline static constexpr bool EnableValidationLayers = false;
-#else
-   inline static constexpr bool EnableValidationLayers = true;
-   VkDebugUtilsMessengerEXT DebugMessenger{};
-
-   static void populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& create_info);
-   void setupDebugMessenger();
-   static VkResult createDebugUtilsMessengerEXT(
-      VkInstance instance,
-      const VkDebugUtilsMessengerCreateInfoEXT* create_info,
-      const VkAllocationCallbacks* allocator,
-      VkDebugUtilsMessengerEXT* debug_messenger
-   )
-   {
-       auto func = (PFN_vkCreateDebugUtilsMessengerEXT)vkGetInstanceProcAddr(
-         instance,
-         "vkCreateDebugUtilsMessengerEXT"
-      );
-       if (func != nullptr) return func( instance, create_info, allocator, debug_messenger );
-       else return VK_ERROR_EXTENSION_NOT_PRESENT;
-   }
-
-   static void destroyDebugUtilsMessengerEXT(
-      VkInstance instance,
-      VkDebugUtilsMessengerEXT debug_messenger,
-      const VkAllocationCallbacks* allocator
-   )
-   {
-      auto func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(
-         instance,
-         "vkDestroyDebugUtilsMessengerEXT"
-      );
-      if (func != nullptr) func( instance, debug_messenger, allocator);
-   }
-
-   static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
-      VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
-      VkDebugUtilsMessageTypeFlagsEXT message_type,
-      const VkDebugUtilsMessengerCallbackDataEXT* callback_data,
-      void* user_data
-   )
-   {
-      std::cerr << "validation layer: " << callback_data->pMessage << "\n";
-      return VK_FALSE;
-   }
-#endif
-
+   void loadAssetBundle();
    void createImageViews();
    void createObject();
    void createGraphicsPipeline();
    void createDepthResources();
    void createFramebuffers();
-   static void copyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size);
+   void createReadbackSlot();
+   void createFrameResources();
+   void destroyFrameResources();
+   void copyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size);
    void createVertexBuffer();
    void createCommandBuffer();
-   void createSyncObjects();
    void initializeVulkan();
    void recordCommandBuffer(VkCommandBuffer command_buffer);
-   void drawFrame();
-   void writeFrame();
-   void writeVideo();
-   [[nodiscard]] static std::vector<const char*> getRequiredExtensions();
-   void createInstance();
+   // Everything on screen is a function of the frame index alone, so any frame can be drawn without the ones before.
+   void drawFrame(uint32_t frame_index);
+   [[nodiscard]] std::vector<VkRect2D> collectDamageRegions() const;
+   // Records the copy of the damaged regions into the readback image right after the render pass of the frame.
+   void recordReadback(VkCommandBuffer command_buffer);
+   void readbackFrame();
+   void writeFrame(uint32_t frame_index);
+   [[nodiscard]] FrameHints getFrameHints(uint32_t frame_index) const;
+   void writeVideo(uint32_t frame_index);
    void createRecorder();
+   void closeRecorder();
 };
\ No newline at end of file
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "job_server.h"
+
+// Which segments of a segmented job are complete. A segment is appended as one line once its video is closed and
+// flushed, so the file stays valid wherever a render is killed, and the worker processes of one render can share it.
+class RenderManifest final
+{
+public:
+   struct Segment
+   {
+      uint32_t FirstFrame;
+      uint32_t FrameCount;
+   };
+
+   // The segments are planned from the frame range and the segment length of the job.
+   RenderManifest(std::filesystem::path manifest_path, const RenderJob& job);
+
+   // Creates the manifest or reads the segments completed so far. Throws if it was written for another job.
+   void load();
+   [[nodiscard]] const std::vector<Segment>& getSegments() const { return Segments; }
+   [[nodiscard]] std::vector<Segment> getPendingSegments() const;
+   void markComplete(const Segment& segment);
+   [[nodiscard]] std::filesystem::path getSegmentPath(const Segment& segment) const;
+
+private:
+   std::filesystem::path ManifestPath;
+   std::string Header;
+   std::vector<Segment> Segments;
+   std::set<uint32_t> CompletedSegments;
+};
+
+// Renders the frame range of a job as independent segments and concatenates them into its output. Every segment
+// starts with a keyframe and is encoded with the same options, so the segments are muxed together without encoding
+// them again. The manifest and the segments are written next to the output, as <output>.manifest and
+// <output>.segments/, and a render that was stopped resumes with the segments still missing.
+class SegmentedRender final
+{
+public:
+   explicit SegmentedRender(RenderJob job);
+
+   // Renders the pending segments whose position among them modulo worker_count is worker_index.
+   [[nodiscard]] bool renderSegments(RendererVK& renderer, int worker_index = 0, int worker_count = 1);
+   // Forks worker_count processes that render the pending segments, waits for them and stitches the output once
+   // every segment is complete. Has to be called before the process initializes Vulkan.
+   [[nodiscard]] bool run(int worker_count);
+   // The renderer provides the framerate and the encoder options the segments were written with.
+   [[nodiscard]] bool stitch(const RendererVK& renderer);
+
+private:
+   RenderJob Job;
+   RenderManifest Manifest;
+   // What every segment is encoded with, and so what stitch() takes the stream parameters from.
+   EncoderOptions SegmentOptions;
+
+   void runWorkers(int worker_count);
+   [[nodiscard]] static bool appendSegment(
+      const VideoWriter& writer,
+      const std::filesystem::path& segment_path,
+      int64_t frame_offset,
+      AVRational frame_time_base
+   );
+};
\ No newline at end of file
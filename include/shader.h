@@ -1,34 +1,86 @@
 #pragma once
 
 #include "common.h"
+#include "asset_bundle.h"
 
 class ShaderVK
 {
 public:
-   explicit ShaderVK(CommonVK* common);
+   explicit ShaderVK(CommonVK* common, const AssetBundle* assets = nullptr);
    virtual ~ShaderVK();
 
    [[nodiscard]] VkRenderPass getRenderPass() const { return RenderPass; }
    [[nodiscard]] VkDescriptorSetLayout getDescriptorSetLayout() const { return DescriptorSetLayout; }
    [[nodiscard]] VkPipelineLayout getPipelineLayout() const { return PipelineLayout; }
    [[nodiscard]] VkPipeline getGraphicsPipeline() const { return GraphicsPipeline; }
+   [[nodiscard]] bool isUsingPipelineLibraries() const { return UsePipelineLibraries; }
    void createRenderPass(VkFormat color_format);
    void createDescriptorSetLayout();
    virtual void createGraphicsPipeline(
       const std::string& vertex_shader_path,
       const std::string& fragment_shader_path,
       const VkVertexInputBindingDescription& binding_description,
-      const  std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions,
-      const VkExtent2D& extent
+      const  std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions
    );
+   // Creates a pipeline that only differs in the fragment shader. When VK_EXT_graphics_pipeline_library is available,
+   // only the fragment shader library is compiled and then linked with the libraries of the base pipeline.
+   [[nodiscard]] VkPipeline createFragmentVariant(const std::string& fragment_shader_path);
+   void savePipelineCache(const std::filesystem::path& cache_file_path) const;
 
 private:
+   // Every state of a graphics pipeline is kept here, so that the pipeline libraries and the monolithic fallback
+   // are built from the same descriptions. The create infos point into this struct, so it must not be moved.
+   struct PipelineStates
+   {
+      VkVertexInputBindingDescription BindingDescription;
+      std::array<VkVertexInputAttributeDescription, 3> AttributeDescriptions;
+      std::array<VkDynamicState, 2> DynamicStates;
+      VkPipelineVertexInputStateCreateInfo VertexInput;
+      VkPipelineInputAssemblyStateCreateInfo InputAssembly;
+      VkPipelineViewportStateCreateInfo ViewportState;
+      VkPipelineRasterizationStateCreateInfo Rasterizer;
+      VkPipelineMultisampleStateCreateInfo Multisampling;
+      VkPipelineDepthStencilStateCreateInfo DepthStencil;
+      VkPipelineColorBlendAttachmentState ColorBlendAttachment;
+      VkPipelineColorBlendStateCreateInfo ColorBlending;
+      VkPipelineDynamicStateCreateInfo DynamicState;
+   };
+
    CommonVK* Common;
+   const AssetBundle* Assets;
+   bool UsePipelineLibraries;
    VkRenderPass RenderPass;
    VkDescriptorSetLayout DescriptorSetLayout;
    VkPipelineLayout PipelineLayout;
    VkPipeline GraphicsPipeline;
+   VkPipelineCache PipelineCache;
+   VkShaderModule VertexShaderModule;
+   VkPipeline VertexInputLibrary;
+   VkPipeline PreRasterizationLibrary;
+   VkPipeline FragmentShaderLibrary;
+   VkPipeline FragmentOutputLibrary;
+   std::unique_ptr<PipelineStates> States;
+   std::vector<VkPipeline> FragmentShaderLibraryVariants;
+   std::vector<VkPipeline> Variants;
 
    static std::vector<char> readFile(const std::string& filename);
-   static VkShaderModule createShaderModule(const std::vector<char>& code);
+   [[nodiscard]] VkShaderModule createShaderModule(const uint32_t* code, size_t code_size) const;
+   [[nodiscard]] VkShaderModule createShaderModule(const std::string& shader_path) const;
+   void createPipelineCache();
+   static VkPipelineShaderStageCreateInfo getShaderStageInfo(VkShaderStageFlagBits stage, VkShaderModule module);
+   void initializePipelineStates(
+      const VkVertexInputBindingDescription& binding_description,
+      const std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions
+   );
+   void createPipelineLayout();
+   [[nodiscard]] VkPipeline createPipelineLibrary(
+      VkGraphicsPipelineLibraryFlagsEXT library_flags,
+      VkGraphicsPipelineCreateInfo& pipeline_info
+   ) const;
+   [[nodiscard]] VkPipeline createVertexInputLibrary() const;
+   [[nodiscard]] VkPipeline createPreRasterizationLibrary() const;
+   [[nodiscard]] VkPipeline createFragmentShaderLibrary(VkShaderModule fragment_shader_module) const;
+   [[nodiscard]] VkPipeline createFragmentOutputLibrary() const;
+   [[nodiscard]] VkPipeline linkPipelineLibraries(VkPipeline fragment_shader_library) const;
+   [[nodiscard]] VkPipeline createMonolithicPipeline(VkShaderModule fragment_shader_module) const;
 };
\ No newline at end of file
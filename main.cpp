@@ -1,7 +1,47 @@
-#include "renderer.h"
+#include "segmented_render.h"
 
-int main()
+int main(int argc, char* argv[])
 {
+   // --serve reads jobs from the standard input, and --serve=<socket path> from the clients of a Unix socket.
+   const std::string argument = argc > 1 ? argv[1] : "";
+   if (argument == "--serve") {
+      JobServer server;
+      server.serve( std::cin, std::cout );
+      return 0;
+   }
+   if (argument.rfind( "--serve=", 0 ) == 0) {
+      JobServer server;
+      server.listen( argument.substr( std::string("--serve=").size() ) );
+      return 0;
+   }
+   // --segmented=<worker count> followed by the fields of a job line, e.g.
+   //   --segmented=4 frames=0-8999 size=1920x1080 output=long.mp4 segment=300
+   // shards the segments across worker processes. Running the same command again resumes an unfinished render.
+   if (argument.rfind( "--segmented=", 0 ) == 0) {
+      std::string fields, error;
+      for (int i = 2; i < argc; ++i) fields += std::string(argv[i]) + " ";
+      std::optional<RenderJob> job = JobServer::parseJob( fields, error );
+      if (!job.has_value() || job->Outputs.size() != 1) {
+         std::cerr << (job.has_value() ? "a segmented render needs an output" : error) << "\n";
+         return 1;
+      }
+      if (job->SegmentFrames == 0) job->SegmentFrames = 300;
+
+      const std::string count = argument.substr( std::string("--segmented=").size() );
+      int worker_count = 0;
+      try {
+         const auto is_digit = [](char c) { return std::isdigit( c ) != 0; };
+         if (count.empty() || !std::all_of( count.begin(), count.end(), is_digit )) throw std::invalid_argument(count);
+         worker_count = std::stoi( count );
+      }
+      catch (const std::exception&) {
+         std::cerr << "invalid worker count " << count << "\n";
+         return 1;
+      }
+      SegmentedRender render(*job);
+      return render.run( worker_count ) ? 0 : 1;
+   }
+
    RendererVK renderer;
    renderer.play();
    return 0;
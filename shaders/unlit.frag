@@ -0,0 +1,14 @@
+#version 460
+
+layout (binding = 1) uniform sampler2D BaseTexture;
+
+layout (location = 0) in vec3 position_in_ec;
+layout (location = 1) in vec3 normal_in_ec;
+layout (location = 2) in vec2 tex_coord;
+
+layout(location = 0) out vec4 final_color;
+
+void main()
+{
+   final_color = texture( BaseTexture, tex_coord ).bgra;
+}
\ No newline at end of file
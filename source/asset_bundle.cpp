@@ -0,0 +1,85 @@
+#include "asset_bundle.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+AssetBundle::AssetBundle() : FileDescriptor( -1 ), MappedData( nullptr ), MappedSize( 0 )
+{
+}
+
+AssetBundle::~AssetBundle()
+{
+   close();
+}
+
+bool AssetBundle::open(const std::filesystem::path& bundle_path)
+{
+   close();
+   FileDescriptor = ::open( bundle_path.c_str(), O_RDONLY | O_CLOEXEC );
+   if (FileDescriptor < 0) return false;
+
+   struct stat file_status{};
+   if (fstat( FileDescriptor, &file_status ) != 0 || file_status.st_size < static_cast<off_t>(sizeof( Header ))) {
+      close();
+      return false;
+   }
+
+   MappedSize = static_cast<size_t>(file_status.st_size);
+   void* data = mmap( nullptr, MappedSize, PROT_READ, MAP_PRIVATE | MAP_POPULATE, FileDescriptor, 0 );
+   if (data == MAP_FAILED) {
+      MappedSize = 0;
+      close();
+      return false;
+   }
+   MappedData = static_cast<const uint8_t*>(data);
+
+   const auto* header = reinterpret_cast<const Header*>(MappedData);
+   const uint64_t index_end = sizeof( Header ) + static_cast<uint64_t>(header->EntryCount) * sizeof( IndexEntry );
+   if (header->Magic != Magic || header->Version != Version || index_end > MappedSize) {
+      close();
+      return false;
+   }
+
+   const auto* entries = reinterpret_cast<const IndexEntry*>(MappedData + sizeof( Header ));
+   for (uint32_t i = 0; i < header->EntryCount; ++i) {
+      const IndexEntry& entry = entries[i];
+      // Checked without adding them, which a corrupt entry could make wrap around.
+      if (entry.Size > MappedSize || entry.Offset > MappedSize - entry.Size) {
+         close();
+         return false;
+      }
+
+      const std::string name(entry.Name.data(), strnlen( entry.Name.data(), entry.Name.size() ));
+      Assets[name] = Asset{
+         entry.Type,
+         entry.Width,
+         entry.Height,
+         MappedData + entry.Offset,
+         static_cast<size_t>(entry.Size)
+      };
+   }
+   return true;
+}
+
+void AssetBundle::close()
+{
+   Assets.clear();
+   if (MappedData != nullptr) {
+      munmap( const_cast<uint8_t*>(MappedData), MappedSize );
+      MappedData = nullptr;
+      MappedSize = 0;
+   }
+   if (FileDescriptor >= 0) {
+      ::close( FileDescriptor );
+      FileDescriptor = -1;
+   }
+}
+
+std::optional<AssetBundle::Asset> AssetBundle::find(const std::string& name) const
+{
+   const auto it = Assets.find( name );
+   if (it == Assets.end()) return std::nullopt;
+   return it->second;
+}
\ No newline at end of file
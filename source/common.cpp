@@ -1,5 +1,127 @@
 #include "common.h"
 
+CommonVK::CommonVK() :
+   Instance{}, PhysicalDevice{}, Device{}, GraphicsQueue{}, GraphicsPipelineLibrarySupported( false ),
+   TimelineSemaphoreSupported( false ), Timeline{}, SubmittedValue( 0 ), CompletedValue( 0 )
+{
+}
+
+CommonVK::~CommonVK()
+{
+   if (Device != VK_NULL_HANDLE) {
+      vkDeviceWaitIdle( Device );
+      vkDestroySemaphore( Device, Timeline, nullptr );
+      for (const auto& fence : PendingFences) vkDestroyFence( Device, fence.second, nullptr );
+      for (const auto& fence : FreeFences) vkDestroyFence( Device, fence, nullptr );
+      for (const auto& command_pool : CommandPools) vkDestroyCommandPool( Device, command_pool.second, nullptr );
+      vkDestroyDevice( Device, nullptr );
+   }
+   if (Instance != VK_NULL_HANDLE) {
+#ifdef _DEBUG
+      destroyDebugUtilsMessengerEXT( Instance, DebugMessenger, nullptr );
+#endif
+      vkDestroyInstance( Instance, nullptr );
+   }
+}
+
+#ifdef _DEBUG
+void CommonVK::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& create_info)
+{
+   create_info = {};
+   create_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+   create_info.messageSeverity =
+      VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
+      VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
+      VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+   create_info.messageType =
+      VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
+      VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
+      VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+   create_info.pfnUserCallback = debugCallback;
+}
+
+void CommonVK::setupDebugMessenger()
+{
+   VkDebugUtilsMessengerCreateInfoEXT create_info;
+   populateDebugMessengerCreateInfo( create_info );
+
+   const VkResult result = createDebugUtilsMessengerEXT(
+   Instance,
+   &create_info,
+   nullptr,
+   &DebugMessenger
+   );
+   if (result != VK_SUCCESS) throw std::runtime_error("failed to set up debug messenger!");
+}
+#endif
+
+std::vector<const char*> CommonVK::getRequiredExtensions()
+{
+   std::vector<const char*> extensions;
+#ifdef _DEBUG
+   extensions.push_back( VK_EXT_DEBUG_UTILS_EXTENSION_NAME );
+#endif
+   return extensions;
+}
+
+void CommonVK::createInstance()
+{
+#ifdef _DEBUG
+   if (!checkValidationLayerSupport()) {
+      throw std::runtime_error("validation layers requested, but not available!");
+   }
+#endif
+
+   VkApplicationInfo application_info{};
+   application_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+   application_info.pApplicationName = "Hello Vulkan";
+   application_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+   application_info.pEngineName = "No Engine";
+   application_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+   // Vulkan 1.1 is needed for vkGetPhysicalDeviceFeatures2, which queries the pipeline library support, and 1.2 for
+   // timeline semaphores. A device of an older version still works with fences.
+   application_info.apiVersion = VK_API_VERSION_1_2;
+
+   VkInstanceCreateInfo create_info{};
+   create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+   create_info.pApplicationInfo = &application_info;
+
+   std::vector<const char*> extensions = getRequiredExtensions();
+   create_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+   create_info.ppEnabledExtensionNames = extensions.data();
+
+#ifdef NDEBUG
+   create_info.enabledLayerCount = 0;
+   create_info.pNext = nullptr;
+#else
+   create_info.enabledLayerCount = getValidationLayerSize();
+   create_info.ppEnabledLayerNames = getValidationLayerNames();
+
+   VkDebugUtilsMessengerCreateInfoEXT debug_create_info{};
+   populateDebugMessengerCreateInfo( debug_create_info );
+   create_info.pNext = static_cast<VkDebugUtilsMessengerCreateInfoEXT*>(&debug_create_info);
+#endif
+
+   if (vkCreateInstance( &create_info, nullptr, &Instance ) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create Instance!");
+   }
+}
+
+void CommonVK::initialize(const DeviceSelection& selection)
+{
+   // Renderers sharing the context may be started on several threads at once.
+   std::call_once( InitializationFlag, [this, &selection] {
+      createInstance();
+#ifdef _DEBUG
+      setupDebugMessenger();
+#endif
+      pickPhysicalDevice( selection );
+      createLogicalDevice();
+      createTimeline();
+   } );
+}
+
+
 bool CommonVK::checkValidationLayerSupport()
 {
    uint32_t layer_count;
@@ -47,7 +169,7 @@ CommonVK::QueueFamilyIndices CommonVK::findQueueFamilies(VkPhysicalDevice device
    return indices;
 }
 
-bool CommonVK::checkDeviceExtensionSupport(VkPhysicalDevice device)
+bool CommonVK::checkDeviceExtensionSupport(VkPhysicalDevice device, std::set<std::string> required_extensions)
 {
    uint32_t extension_count;
    vkEnumerateDeviceExtensionProperties(
@@ -65,38 +187,198 @@ bool CommonVK::checkDeviceExtensionSupport(VkPhysicalDevice device)
       available_extensions.data()
    );
 
-   std::set<std::string> required_extensions(DeviceExtensions.begin(), DeviceExtensions.end());
    for (const auto& extension : available_extensions) {
       required_extensions.erase( extension.extensionName );
    }
    return required_extensions.empty();
 }
 
+bool CommonVK::checkGraphicsPipelineLibrarySupport(VkPhysicalDevice device)
+{
+   // vkGetPhysicalDeviceFeatures2 is core since 1.1 and cannot be called for a device of 1.0.
+   VkPhysicalDeviceProperties properties;
+   vkGetPhysicalDeviceProperties( device, &properties );
+   if (properties.apiVersion < VK_API_VERSION_1_1) return false;
+
+   const bool extensions_supported = checkDeviceExtensionSupport(
+      device,
+      { VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME }
+   );
+   if (!extensions_supported) return false;
+
+   VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT library_features{};
+   library_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+
+   VkPhysicalDeviceFeatures2 features{};
+   features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+   features.pNext = &library_features;
+   vkGetPhysicalDeviceFeatures2( device, &features );
+   return library_features.graphicsPipelineLibrary == VK_TRUE;
+}
+
+bool CommonVK::checkTimelineSemaphoreSupport(VkPhysicalDevice device)
+{
+   // The instance may be 1.2 while the device is not, and then the feature structure is not known to it.
+   VkPhysicalDeviceProperties properties;
+   vkGetPhysicalDeviceProperties( device, &properties );
+   if (properties.apiVersion < VK_API_VERSION_1_2) return false;
+
+   VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+   timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+
+   VkPhysicalDeviceFeatures2 features{};
+   features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+   features.pNext = &timeline_features;
+   vkGetPhysicalDeviceFeatures2( device, &features );
+   return timeline_features.timelineSemaphore == VK_TRUE;
+}
+
 bool CommonVK::isDeviceSuitable(VkPhysicalDevice device)
 {
-   QueueFamilyIndices indices = findQueueFamilies( device );
-   if (!indices.isComplete()) return false;
+   // Nothing is presented, so a graphics queue is all an offscreen renderer needs, and no extension is required.
+   // This keeps software implementations such as lavapipe and ICDs without window system support usable.
+   return findQueueFamilies( device ).isComplete();
+}
+
+int64_t CommonVK::scoreDevice(VkPhysicalDevice device)
+{
+   if (!isDeviceSuitable( device )) return -1;
+
+   VkPhysicalDeviceProperties properties;
+   vkGetPhysicalDeviceProperties( device, &properties );
+   int64_t score = 0;
+   switch (properties.deviceType) {
+      case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score = 4; break;
+      case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score = 3; break;
+      case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score = 2; break;
+      case VK_PHYSICAL_DEVICE_TYPE_CPU: score = 1; break;
+      default: break;
+   }
+
+   // The type outweighs everything else, then every GiB of device local memory counts, and the optional features
+   // only decide between otherwise equal devices.
+   score <<= 40;
+   VkPhysicalDeviceMemoryProperties memory_properties;
+   vkGetPhysicalDeviceMemoryProperties( device, &memory_properties );
+   VkDeviceSize device_local_size = 0;
+   for (uint32_t i = 0; i < memory_properties.memoryHeapCount; ++i) {
+      if (memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+         device_local_size += memory_properties.memoryHeaps[i].size;
+      }
+   }
+   score += static_cast<int64_t>(device_local_size >> 30) << 8;
+   if (checkGraphicsPipelineLibrarySupport( device )) score += 2;
+
+   VkPhysicalDeviceFeatures features;
+   vkGetPhysicalDeviceFeatures( device, &features );
+   if (features.samplerAnisotropy) score += 1;
+   return score;
+}
+
+std::string CommonVK::getDeviceUUID(VkPhysicalDevice device)
+{
+   // A 1.0 device may not have vkGetPhysicalDeviceProperties2, and without a UUID a selection by UUID never matches.
+   VkPhysicalDeviceProperties device_properties;
+   vkGetPhysicalDeviceProperties( device, &device_properties );
+   if (device_properties.apiVersion < VK_API_VERSION_1_1) return {};
+
+   VkPhysicalDeviceIDProperties id_properties{};
+   id_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+
+   VkPhysicalDeviceProperties2 properties{};
+   properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+   properties.pNext = &id_properties;
+   vkGetPhysicalDeviceProperties2( device, &properties );
+
+   std::ostringstream uuid;
+   uuid << std::hex << std::setfill( '0' );
+   for (const uint8_t byte : id_properties.deviceUUID) uuid << std::setw( 2 ) << static_cast<int>(byte);
+   return uuid.str();
+}
+
+CommonVK::DeviceSelection CommonVK::parseDeviceSelection(const std::string& value)
+{
+   DeviceSelection selection;
+   if (value.empty()) return selection;
 
-   bool extensions_supported = checkDeviceExtensionSupport( device );
+   if (std::all_of( value.begin(), value.end(), [](unsigned char c) { return std::isdigit( c ) != 0; } )) {
+      try {
+         selection.Index = std::stoi( value );
+      }
+      catch (const std::out_of_range&) {
+         throw std::runtime_error("invalid device selection " + value);
+      }
+      return selection;
+   }
 
-   VkPhysicalDeviceFeatures supported_features;
-   vkGetPhysicalDeviceFeatures( device, &supported_features );
-   return extensions_supported && supported_features.samplerAnisotropy;
+   std::string digits;
+   for (const char c : value) {
+      if (c != '-') digits += static_cast<char>(std::tolower( static_cast<unsigned char>(c) ));
+   }
+   const bool is_uuid = digits.size() == VK_UUID_SIZE * 2 &&
+      std::all_of( digits.begin(), digits.end(), [](unsigned char c) { return std::isxdigit( c ) != 0; } );
+   if (is_uuid) selection.UUID = digits;
+   else selection.Name = value;
+   return selection;
 }
 
-void CommonVK::pickPhysicalDevice(VkInstance instance)
+bool CommonVK::isDeviceSelected(VkPhysicalDevice device, uint32_t index, const DeviceSelection& selection)
+{
+   const auto to_lower = [](std::string text) {
+      std::transform(
+         text.begin(), text.end(), text.begin(),
+         [](unsigned char c) { return static_cast<char>(std::tolower( c )); }
+      );
+      return text;
+   };
+
+   if (!selection.Name.empty()) {
+      VkPhysicalDeviceProperties properties;
+      vkGetPhysicalDeviceProperties( device, &properties );
+      return to_lower( properties.deviceName ).find( to_lower( selection.Name ) ) != std::string::npos;
+   }
+   if (!selection.UUID.empty()) return getDeviceUUID( device ) == parseDeviceSelection( selection.UUID ).UUID;
+   return static_cast<int>(index) == selection.Index;
+}
+
+void CommonVK::pickPhysicalDevice(const DeviceSelection& selection)
 {
    uint32_t device_count = 0;
-   vkEnumeratePhysicalDevices( instance, &device_count, nullptr );
+   vkEnumeratePhysicalDevices( Instance, &device_count, nullptr );
    if (device_count == 0) throw std::runtime_error( "failed to find GPUs with Vulkan support!");
 
    std::vector<VkPhysicalDevice> devices(device_count);
    vkEnumeratePhysicalDevices(
-      instance,
+      Instance,
       &device_count,
       devices.data()
    );
-   PhysicalDevice = devices[0];
+
+   const char* environment = std::getenv( "OFFSCREEN_VULKAN_DEVICE" );
+   const DeviceSelection chosen =
+      environment != nullptr && *environment != '\0' ? parseDeviceSelection( environment ) : selection;
+
+   // Among equal scores the first device wins, so the choice is the same on every run of the same machine.
+   PhysicalDevice = VK_NULL_HANDLE;
+   int64_t best_score = -1;
+   for (uint32_t i = 0; i < device_count; ++i) {
+      if (!chosen.isEmpty() && !isDeviceSelected( devices[i], i, chosen )) continue;
+
+      const int64_t score = scoreDevice( devices[i] );
+      if (score > best_score) {
+         best_score = score;
+         PhysicalDevice = devices[i];
+      }
+   }
+   if (PhysicalDevice == VK_NULL_HANDLE) {
+      throw std::runtime_error(
+         chosen.isEmpty() ? "failed to find a suitable GPU!" : "failed to find the selected GPU!"
+      );
+   }
+
+   VkPhysicalDeviceProperties properties;
+   vkGetPhysicalDeviceProperties( PhysicalDevice, &properties );
+   std::cerr << "device: " << properties.deviceName << " (" << getDeviceUUID( PhysicalDevice ) << ")\n";
 }
 
 void CommonVK::createLogicalDevice()
@@ -117,13 +399,38 @@ void CommonVK::createLogicalDevice()
    VkPhysicalDeviceFeatures device_features{};
    // write later ...
 
+   // Pipelines are split into separately compiled libraries when the device supports it.
+   // Otherwise, ShaderVK falls back to monolithic pipelines.
+   std::vector<const char*> extensions;
+   VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT library_features{};
+   library_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+   GraphicsPipelineLibrarySupported = checkGraphicsPipelineLibrarySupport( PhysicalDevice );
+   if (GraphicsPipelineLibrarySupported) {
+      extensions.emplace_back( VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME );
+      extensions.emplace_back( VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME );
+      library_features.graphicsPipelineLibrary = VK_TRUE;
+   }
+
+   VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+   timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+   TimelineSemaphoreSupported = checkTimelineSemaphoreSupport( PhysicalDevice );
+   timeline_features.timelineSemaphore = TimelineSemaphoreSupported ? VK_TRUE : VK_FALSE;
+
+   void* features_chain = nullptr;
+   if (TimelineSemaphoreSupported) features_chain = &timeline_features;
+   if (GraphicsPipelineLibrarySupported) {
+      library_features.pNext = features_chain;
+      features_chain = &library_features;
+   }
+
    VkDeviceCreateInfo create_info{};
    create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+   create_info.pNext = features_chain;
    create_info.queueCreateInfoCount = static_cast<uint32_t>(queue_create_infos.size());
    create_info.pQueueCreateInfos = queue_create_infos.data();
    create_info.pEnabledFeatures = &device_features;
-   create_info.enabledExtensionCount = static_cast<uint32_t>(DeviceExtensions.size());
-   create_info.ppEnabledExtensionNames = DeviceExtensions.data();
+   create_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+   create_info.ppEnabledExtensionNames = extensions.data();
 
 #ifdef NDBUG
    create_info.enabledLayerCount = 0;
@@ -151,7 +458,7 @@ void CommonVK::createLogicalDevice()
    );
 }
 
-void CommonVK::createCommandPool()
+VkCommandPool CommonVK::createCommandPool() const
 {
    QueueFamilyIndices queue_family_indices = findQueueFamilies( PhysicalDevice );
 
@@ -160,20 +467,191 @@ void CommonVK::createCommandPool()
    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
    pool_info.queueFamilyIndex = queue_family_indices.GraphicsFamily.value();
 
+   VkCommandPool command_pool;
    const VkResult result = vkCreateCommandPool(
-      CommonVK::getDevice(),
+      Device,
       &pool_info,
       nullptr,
-      &CommandPool
+      &command_pool
    );
    if (result != VK_SUCCESS) throw std::runtime_error("failed to create command pool!");
+   return command_pool;
+}
+
+VkCommandPool CommonVK::getCommandPool()
+{
+   // A command pool is externally synchronized as well, so giving every thread its own one needs no lock while
+   // recording. The lock only guards the map.
+   std::lock_guard<std::mutex> lock(CommandPoolMutex);
+   const std::thread::id thread_id = std::this_thread::get_id();
+   const auto it = CommandPools.find( thread_id );
+   if (it != CommandPools.end()) return it->second;
+   return CommandPools.emplace( thread_id, createCommandPool() ).first->second;
+}
+
+void CommonVK::releaseCommandPool()
+{
+   std::lock_guard<std::mutex> lock(CommandPoolMutex);
+   const auto it = CommandPools.find( std::this_thread::get_id() );
+   if (it == CommandPools.end()) return;
+   vkDestroyCommandPool( Device, it->second, nullptr );
+   CommandPools.erase( it );
+}
+
+void CommonVK::createTimeline()
+{
+   if (!TimelineSemaphoreSupported) return;
+
+   VkSemaphoreTypeCreateInfo type_info{};
+   type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+   type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+   type_info.initialValue = 0;
+
+   VkSemaphoreCreateInfo semaphore_info{};
+   semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+   semaphore_info.pNext = &type_info;
+   const VkResult result = vkCreateSemaphore(
+      Device,
+      &semaphore_info,
+      nullptr,
+      &Timeline
+   );
+   if (result != VK_SUCCESS) throw std::runtime_error("failed to create timeline semaphore!");
+}
+
+VkFence CommonVK::acquireFence()
+{
+   {
+      std::lock_guard<std::mutex> lock(FenceMutex);
+      if (!FreeFences.empty()) {
+         VkFence fence = FreeFences.back();
+         FreeFences.pop_back();
+         return fence;
+      }
+   }
+
+   VkFenceCreateInfo fence_create_info{};
+   fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+   VkFence fence;
+   if (vkCreateFence( Device, &fence_create_info, nullptr, &fence ) != VK_SUCCESS) {
+      throw std::runtime_error("failed to create fence!");
+   }
+   return fence;
+}
+
+uint64_t CommonVK::submit(const VkSubmitInfo& submit_info)
+{
+   if (!TimelineSemaphoreSupported) {
+      VkFence fence = acquireFence();
+      std::lock_guard<std::mutex> lock(QueueMutex);
+      if (vkQueueSubmit( GraphicsQueue, 1, &submit_info, fence ) != VK_SUCCESS) {
+         std::lock_guard<std::mutex> fence_lock(FenceMutex);
+         FreeFences.emplace_back( fence );
+         throw std::runtime_error("failed to submit command buffer!");
+      }
+      // Still under the queue lock, so the fences stay in the order of their values.
+      std::lock_guard<std::mutex> fence_lock(FenceMutex);
+      PendingFences.emplace_back( ++SubmittedValue, fence );
+      return SubmittedValue;
+   }
+
+   // The timeline is signaled after the semaphores of the caller, whose values are ignored as they are binary.
+   std::vector<VkSemaphore> signal_semaphores(
+      submit_info.pSignalSemaphores, submit_info.pSignalSemaphores + submit_info.signalSemaphoreCount
+   );
+   signal_semaphores.emplace_back( Timeline );
+   std::vector<uint64_t> signal_values(signal_semaphores.size(), 0);
+
+   VkTimelineSemaphoreSubmitInfo timeline_info{};
+   timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+   timeline_info.pNext = submit_info.pNext;
+   timeline_info.signalSemaphoreValueCount = static_cast<uint32_t>(signal_values.size());
+   timeline_info.pSignalSemaphoreValues = signal_values.data();
+
+   VkSubmitInfo timeline_submit_info = submit_info;
+   timeline_submit_info.pNext = &timeline_info;
+   timeline_submit_info.signalSemaphoreCount = static_cast<uint32_t>(signal_semaphores.size());
+   timeline_submit_info.pSignalSemaphores = signal_semaphores.data();
+
+   std::lock_guard<std::mutex> lock(QueueMutex);
+   signal_values.back() = SubmittedValue + 1;
+   if (vkQueueSubmit( GraphicsQueue, 1, &timeline_submit_info, VK_NULL_HANDLE ) != VK_SUCCESS) {
+      throw std::runtime_error("failed to submit command buffer!");
+   }
+   return ++SubmittedValue;
+}
+
+void CommonVK::completeValue(uint64_t value)
+{
+   uint64_t completed = CompletedValue.load();
+   while (completed < value && !CompletedValue.compare_exchange_weak( completed, value )) {}
+}
+
+void CommonVK::wait(uint64_t value)
+{
+   if (value <= CompletedValue.load()) return;
+
+   if (TimelineSemaphoreSupported) {
+      VkSemaphoreWaitInfo wait_info{};
+      wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+      wait_info.semaphoreCount = 1;
+      wait_info.pSemaphores = &Timeline;
+      wait_info.pValues = &value;
+      if (vkWaitSemaphores( Device, &wait_info, UINT64_MAX ) != VK_SUCCESS) {
+         throw std::runtime_error("failed to wait for timeline semaphore!");
+      }
+      completeValue( value );
+      return;
+   }
+
+   // Other threads waiting meanwhile queue up behind the lock, but this is the fallback for old devices only.
+   std::lock_guard<std::mutex> lock(FenceMutex);
+   while (!PendingFences.empty() && PendingFences.front().first <= value) {
+      VkFence fence = PendingFences.front().second;
+      if (vkWaitForFences( Device, 1, &fence, VK_TRUE, UINT64_MAX ) != VK_SUCCESS) {
+         throw std::runtime_error("failed to wait for fence!");
+      }
+      vkResetFences( Device, 1, &fence );
+      completeValue( PendingFences.front().first );
+      FreeFences.emplace_back( fence );
+      PendingFences.pop_front();
+   }
+}
+
+bool CommonVK::isComplete(uint64_t value)
+{
+   if (value <= CompletedValue.load()) return true;
+
+   if (TimelineSemaphoreSupported) {
+      uint64_t reached = 0;
+      if (vkGetSemaphoreCounterValue( Device, Timeline, &reached ) != VK_SUCCESS) return false;
+      completeValue( reached );
+      return value <= reached;
+   }
+
+   std::lock_guard<std::mutex> lock(FenceMutex);
+   while (!PendingFences.empty() && vkGetFenceStatus( Device, PendingFences.front().second ) == VK_SUCCESS) {
+      VkFence fence = PendingFences.front().second;
+      vkResetFences( Device, 1, &fence );
+      completeValue( PendingFences.front().first );
+      FreeFences.emplace_back( fence );
+      PendingFences.pop_front();
+   }
+   return value <= CompletedValue.load();
+}
+
+uint64_t CommonVK::submitAndWait(const VkSubmitInfo& submit_info)
+{
+   const uint64_t value = submit( submit_info );
+   wait( value );
+   return value;
 }
 
 VkFormat CommonVK::findSupportedFormat(
    const std::vector<VkFormat>& candidates,
    VkImageTiling tiling,
    VkFormatFeatureFlags features
-)
+) const
 {
    for (VkFormat format : candidates) {
       VkFormatProperties props;
@@ -185,7 +663,7 @@ VkFormat CommonVK::findSupportedFormat(
    throw std::runtime_error("failed to find supported format!");
 }
 
-VkFormat CommonVK::findDepthFormat()
+VkFormat CommonVK::findDepthFormat() const
 {
    return findSupportedFormat(
       { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
@@ -194,7 +672,7 @@ VkFormat CommonVK::findDepthFormat()
    );
 }
 
-uint32_t CommonVK::findMemoryType(uint32_t type_filter, VkMemoryPropertyFlags properties)
+uint32_t CommonVK::findMemoryType(uint32_t type_filter, VkMemoryPropertyFlags properties) const
 {
    VkPhysicalDeviceMemoryProperties memory_properties;
    vkGetPhysicalDeviceMemoryProperties( PhysicalDevice, &memory_properties );
@@ -212,7 +690,7 @@ void CommonVK::createBuffer(
    VkMemoryPropertyFlags properties,
    VkBuffer& buffer,
    VkDeviceMemory& buffer_memory
-)
+) const
 {
    VkBufferCreateInfo buffer_info{};
    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -252,7 +730,7 @@ void CommonVK::createImage(
    VkMemoryPropertyFlags properties,
    VkImage& image,
    VkDeviceMemory& image_memory
-)
+) const
 {
    VkImageCreateInfo image_info{};
    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -291,7 +769,7 @@ void CommonVK::createImage(
    vkBindImageMemory( Device, image, image_memory, 0 );
 }
 
-VkImageView CommonVK::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags)
+VkImageView CommonVK::createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags) const
 {
    VkImageViewCreateInfo view_info{};
    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -319,7 +797,7 @@ VkCommandBuffer CommonVK::createCommandBuffer(VkCommandBufferLevel level)
 {
    VkCommandBufferAllocateInfo command_buffer_allocate_info {};
    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-   command_buffer_allocate_info.commandPool = CommandPool;
+   command_buffer_allocate_info.commandPool = getCommandPool();
    command_buffer_allocate_info.level = level;
    command_buffer_allocate_info.commandBufferCount = 1;
 
@@ -342,28 +820,45 @@ void CommonVK::flushCommandBuffer(VkCommandBuffer command_buffer)
 
    vkEndCommandBuffer( command_buffer );
 
-   VkSubmitInfo submitInfo{};
-   submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-   submitInfo.commandBufferCount = 1;
-   submitInfo.pCommandBuffers = &command_buffer;
-
-   VkFenceCreateInfo fence_create_info{};
-   fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-   fence_create_info.flags = 0;
-
-   VkFence fence;
-   vkCreateFence( Device, &fence_create_info, nullptr, &fence );
-   vkQueueSubmit( GraphicsQueue, 1, &submitInfo, fence );
-   vkWaitForFences( Device, 1, &fence, VK_TRUE, UINT64_MAX );
-   vkDestroyFence( Device, fence, nullptr );
+   VkSubmitInfo submit_info{};
+   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+   submit_info.commandBufferCount = 1;
+   submit_info.pCommandBuffers = &command_buffer;
+   submitAndWait( submit_info );
    vkFreeCommandBuffers(
       Device,
-      CommandPool,
+      getCommandPool(),
       1,
       &command_buffer
    );
 }
 
+bool CommonVK::areRectsOverlapping(const VkRect2D& a, const VkRect2D& b)
+{
+   return a.offset.x < b.offset.x + static_cast<int32_t>(b.extent.width) &&
+      b.offset.x < a.offset.x + static_cast<int32_t>(a.extent.width) &&
+      a.offset.y < b.offset.y + static_cast<int32_t>(b.extent.height) &&
+      b.offset.y < a.offset.y + static_cast<int32_t>(a.extent.height);
+}
+
+VkRect2D CommonVK::uniteRects(const VkRect2D& a, const VkRect2D& b)
+{
+   if (isRectEmpty( a )) return b;
+   if (isRectEmpty( b )) return a;
+
+   const int32_t left = std::min( a.offset.x, b.offset.x );
+   const int32_t top = std::min( a.offset.y, b.offset.y );
+   const int32_t right = std::max(
+      a.offset.x + static_cast<int32_t>(a.extent.width),
+      b.offset.x + static_cast<int32_t>(b.extent.width)
+   );
+   const int32_t bottom = std::max(
+      a.offset.y + static_cast<int32_t>(a.extent.height),
+      b.offset.y + static_cast<int32_t>(b.extent.height)
+   );
+   return { { left, top }, { static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) } };
+}
+
 void CommonVK::insertImageMemoryBarrier(
    VkCommandBuffer command_buffer,
    VkImage image,
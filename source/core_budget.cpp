@@ -0,0 +1,219 @@
+#include "core_budget.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+namespace
+{
+   const std::array<const char*, CoreBudget::StageCount> StageNames = { "rasterization", "encoding", "io" };
+
+   double getProcessSeconds()
+   {
+      rusage usage{};
+      if (getrusage( RUSAGE_SELF, &usage ) != 0) return 0.0;
+      return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+         static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+   }
+}
+
+CoreBudget::CoreBudget(std::vector<int> cores, const std::array<float, StageCount>& weights, bool pin_threads) :
+   Cores( std::move( cores ) ), Weights( weights ), PinThreads( pin_threads )
+{
+   if (Cores.empty()) throw std::runtime_error("a core budget needs at least one core");
+
+   if (Cores.size() < StageCount) {
+      for (auto& stage_cores : StageCores) stage_cores = Cores;
+      return;
+   }
+
+   // One core for every stage first, and the rest by the largest remainder of the weights.
+   const size_t spare_count = Cores.size() - StageCount;
+   const float weight_sum = std::max( Weights[0] + Weights[1] + Weights[2], std::numeric_limits<float>::epsilon() );
+   std::array<size_t, StageCount> counts{};
+   std::array<float, StageCount> remainders{};
+   size_t assigned = 0;
+   for (size_t i = 0; i < StageCount; ++i) {
+      const float share = static_cast<float>(spare_count) * std::max( Weights[i], 0.0f ) / weight_sum;
+      counts[i] = 1 + static_cast<size_t>(share);
+      remainders[i] = share - std::floor( share );
+      assigned += counts[i];
+   }
+   while (assigned < Cores.size()) {
+      const auto largest = static_cast<size_t>(
+         std::distance( remainders.begin(), std::max_element( remainders.begin(), remainders.end() ) )
+      );
+      counts[largest]++;
+      remainders[largest] = -1.0f;
+      assigned++;
+   }
+
+   auto core = Cores.begin();
+   for (size_t i = 0; i < StageCount; ++i) {
+      StageCores[i].assign( core, core + static_cast<std::ptrdiff_t>(counts[i]) );
+      core += static_cast<std::ptrdiff_t>(counts[i]);
+   }
+}
+
+std::shared_ptr<const CoreBudget> CoreBudget::getProcessBudget()
+{
+   std::lock_guard<std::mutex> lock(ProcessBudgetMutex);
+   if (!ProcessBudgetLoaded) {
+      ProcessBudgetLoaded = true;
+      const char* environment = std::getenv( "OFFSCREEN_VULKAN_CORE_BUDGET" );
+      if (environment != nullptr && *environment != '\0') ProcessBudget = parse( environment );
+   }
+   return ProcessBudget;
+}
+
+void CoreBudget::setProcessBudget(std::shared_ptr<const CoreBudget> budget)
+{
+   std::lock_guard<std::mutex> lock(ProcessBudgetMutex);
+   ProcessBudgetLoaded = true;
+   ProcessBudget = std::move( budget );
+}
+
+std::shared_ptr<CoreBudget> CoreBudget::parse(const std::string& value)
+{
+   std::string weights_value = value;
+   bool pin_threads = false;
+   const size_t comma = value.find( ',' );
+   if (comma != std::string::npos) {
+      if (value.substr( comma + 1 ) != "pin") throw std::runtime_error("invalid core budget " + value);
+      weights_value = value.substr( 0, comma );
+      pin_threads = true;
+   }
+
+   // On a node without a GPU, llvmpipe needs the most, but x264 at a fast preset is not far behind.
+   std::array<float, StageCount> weights = { 5.0f, 4.0f, 1.0f };
+   if (weights_value != "auto") {
+      std::istringstream stream(weights_value);
+      char separator = ':';
+      for (size_t i = 0; i < StageCount; ++i) {
+         const bool separated = i == 0 || (stream >> separator && separator == ':');
+         if (!separated || !(stream >> weights[i]) || weights[i] < 0.0f) {
+            throw std::runtime_error("invalid core budget " + value);
+         }
+      }
+      // Anything after the last weight, such as a fourth one, is as wrong as a missing one.
+      std::string rest;
+      if (stream >> rest) throw std::runtime_error("invalid core budget " + value);
+   }
+   return std::make_shared<CoreBudget>( getAllowedCores(), weights, pin_threads );
+}
+
+std::vector<int> CoreBudget::getAllowedCores()
+{
+   std::vector<int> cores;
+   cpu_set_t allowed;
+   CPU_ZERO( &allowed );
+   if (sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0) {
+      for (int i = 0; i < CPU_SETSIZE; ++i) {
+         if (CPU_ISSET( i, &allowed )) cores.emplace_back( i );
+      }
+   }
+   if (cores.empty()) {
+      const int hardware_threads = std::max( static_cast<int>(std::thread::hardware_concurrency()), 1 );
+      for (int i = 0; i < hardware_threads; ++i) cores.emplace_back( i );
+   }
+   return cores;
+}
+
+std::shared_ptr<CoreBudget> CoreBudget::split(int part_count, int part_index) const
+{
+   const auto parts = static_cast<size_t>(std::max( part_count, 1 ));
+   const auto index = static_cast<size_t>(std::max( part_index, 0 ));
+   // With more parts than cores, the parts share the cores instead of ending up with none.
+   if (parts >= Cores.size()) {
+      return std::make_shared<CoreBudget>( std::vector<int>{ Cores[index % Cores.size()] }, Weights, PinThreads );
+   }
+
+   const auto begin = static_cast<std::ptrdiff_t>(Cores.size() * index / parts);
+   const auto end = static_cast<std::ptrdiff_t>(Cores.size() * (index + 1) / parts);
+   return std::make_shared<CoreBudget>(
+      std::vector<int>(Cores.begin() + begin, Cores.begin() + end), Weights, PinThreads
+   );
+}
+
+void CoreBudget::limitRasterizerThreads() const
+{
+   setenv( "LP_NUM_THREADS", std::to_string( getThreadCount( Stage::Rasterization ) ).c_str(), 0 );
+}
+
+void CoreBudget::bindCurrentThread(Stage stage) const
+{
+   if (!PinThreads) return;
+
+   cpu_set_t cores;
+   CPU_ZERO( &cores );
+   for (const int core : getCores( stage )) CPU_SET( core, &cores );
+   if (pthread_setaffinity_np( pthread_self(), sizeof( cores ), &cores ) != 0) {
+      std::cerr << "could not bind a thread to the " << StageNames[static_cast<size_t>(stage)] << " cores\n";
+   }
+}
+
+CoreBudget::Sample CoreBudget::sample()
+{
+   Sample sample;
+   sample.Time = std::chrono::steady_clock::now();
+   sample.ProcessSeconds = getProcessSeconds();
+
+   std::ifstream file("/proc/stat");
+   std::string line;
+   while (std::getline( file, line )) {
+      // The first line sums up all cores, and the lines of single cores follow as cpu0, cpu1, ...
+      if (line.rfind( "cpu", 0 ) != 0 || line.size() < 4 || !std::isdigit( line[3] )) continue;
+
+      std::istringstream stream(line.substr( 3 ));
+      size_t core = 0;
+      stream >> core;
+      // user nice system idle iowait irq softirq steal
+      std::array<uint64_t, 8> ticks{};
+      for (auto& tick : ticks) stream >> tick;
+      if (core >= sample.TotalTicks.size()) {
+         sample.BusyTicks.resize( core + 1, 0 );
+         sample.TotalTicks.resize( core + 1, 0 );
+      }
+      uint64_t total = 0;
+      for (const uint64_t tick : ticks) total += tick;
+      sample.TotalTicks[core] = total;
+      sample.BusyTicks[core] = total - ticks[3] - ticks[4];
+   }
+   return sample;
+}
+
+void CoreBudget::printUtilization(const Sample& start, std::ostream& stream) const
+{
+   const Sample end = sample();
+   stream << "cores" << (PinThreads ? "" : " (not pinned)") << ":" << std::fixed << std::setprecision( 1 );
+   for (size_t i = 0; i < StageCount; ++i) {
+      uint64_t busy = 0, total = 0;
+      for (const int core : StageCores[i]) {
+         const auto c = static_cast<size_t>(core);
+         if (c >= start.TotalTicks.size() || c >= end.TotalTicks.size()) continue;
+         busy += end.BusyTicks[c] - start.BusyTicks[c];
+         total += end.TotalTicks[c] - start.TotalTicks[c];
+      }
+      stream << " " << StageNames[i] << " " << StageCores[i].size() << " threads "
+         << (total > 0 ? 100.0 * static_cast<double>(busy) / static_cast<double>(total) : 0.0) << "%,";
+   }
+
+   const std::chrono::duration<double> elapsed = end.Time - start.Time;
+   const double available = elapsed.count() * static_cast<double>(Cores.size());
+   stream << " process " << (available > 0.0 ? 100.0 * (end.ProcessSeconds - start.ProcessSeconds) / available : 0.0)
+      << "% of " << Cores.size() << " cores\n";
+}
+
+CoreBudget::ScopedBinding::ScopedBinding(const CoreBudget* budget, Stage stage) : Bound( false ), PreviousCores{}
+{
+   if (budget == nullptr || !budget->isPinning()) return;
+
+   CPU_ZERO( &PreviousCores );
+   if (pthread_getaffinity_np( pthread_self(), sizeof( PreviousCores ), &PreviousCores ) != 0) return;
+   budget->bindCurrentThread( stage );
+   Bound = true;
+}
+
+CoreBudget::ScopedBinding::~ScopedBinding()
+{
+   if (Bound) pthread_setaffinity_np( pthread_self(), sizeof( PreviousCores ), &PreviousCores );
+}
\ No newline at end of file
@@ -0,0 +1,268 @@
+#include "fileio/encoder_backend.h"
+
+#include <thread>
+
+namespace
+{
+   // Sets an option only if the linked version of the encoder has it, because the wrappers of the newer encoders
+   // gained and lost options between the FFmpeg releases.
+   bool setOptionIfExists(void* object, const char* name, int64_t value)
+   {
+      const AVOption* option = av_opt_find( object, name, nullptr, 0, 0 );
+      if (option == nullptr) return false;
+      return av_opt_set_int( object, name, std::clamp<int64_t>(
+         value, static_cast<int64_t>(option->min), static_cast<int64_t>(option->max)
+      ), 0 ) >= 0;
+   }
+
+   bool setOptionIfExists(void* object, const char* name, const std::string& value)
+   {
+      if (av_opt_find( object, name, nullptr, 0, 0 ) == nullptr) return false;
+      return av_opt_set( object, name, value.c_str(), 0 ) >= 0;
+   }
+
+   // The number of tile columns as a power of two, where every column is at least min_tile_width pixels wide.
+   int getTileColumnsLog2(int width, int min_tile_width, int max_log2)
+   {
+      int log2 = 0;
+      while (log2 < max_log2 && (width >> (log2 + 1)) >= min_tile_width) log2++;
+      return log2;
+   }
+}
+
+EncoderBackend::EncoderBackend(std::string name, AVCodecID codec_id) : Name( std::move( name ) ), CodecID( codec_id )
+{
+}
+
+const AVCodec* EncoderBackend::findEncoder() const
+{
+   return avcodec_find_encoder_by_name( Name.c_str() );
+}
+
+AVPixelFormat EncoderBackend::getPixelFormat(const EncoderOptions& options, AVPixelFormat frame_format) const
+{
+   if (options.PixelFormat != AV_PIX_FMT_NONE) return options.PixelFormat;
+   switch (CodecID) {
+      case AV_CODEC_ID_MJPEG:
+         return AV_PIX_FMT_YUVJ420P;
+      case AV_CODEC_ID_RAWVIDEO:
+         return frame_format;
+      default:
+         return AV_PIX_FMT_YUV420P;
+   }
+}
+
+void EncoderBackend::configure(AVCodecContext*, const EncoderOptions&) const
+{
+}
+
+int EncoderBackend::getThreadCount(const EncoderOptions& options)
+{
+   if (options.ThreadCount > 0) return options.ThreadCount;
+   return std::max( static_cast<int>(std::thread::hardware_concurrency()), 1 );
+}
+
+int EncoderBackend::getSpeedLevel(const std::string& preset)
+{
+   static const std::array<const char*, 10> presets{
+      "placebo", "veryslow", "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast"
+   };
+   for (size_t i = 0; i < presets.size(); ++i) {
+      if (preset == presets[i]) return static_cast<int>(i);
+   }
+   return 4;
+}
+
+std::vector<std::unique_ptr<EncoderBackend>>& EncoderBackend::getRegistry()
+{
+   // The order decides which backend find(codec_id) picks when several of them encode the same codec.
+   static std::vector<std::unique_ptr<EncoderBackend>> registry = [] {
+      std::vector<std::unique_ptr<EncoderBackend>> backends;
+      backends.emplace_back( std::make_unique<X264Backend>() );
+      backends.emplace_back( std::make_unique<VP9Backend>() );
+      backends.emplace_back( std::make_unique<SVTAV1Backend>() );
+      backends.emplace_back( std::make_unique<FFV1Backend>() );
+      return backends;
+   }();
+   return registry;
+}
+
+void EncoderBackend::registerBackend(std::unique_ptr<EncoderBackend> backend)
+{
+   std::lock_guard<std::mutex> lock(RegistryMutex);
+   auto& registry = getRegistry();
+   for (const auto& registered : registry) {
+      if (registered->getName() == backend->getName()) {
+         throw std::runtime_error("encoder backend already registered: " + backend->getName());
+      }
+   }
+   registry.emplace_back( std::move( backend ) );
+}
+
+const EncoderBackend* EncoderBackend::find(const std::string& name)
+{
+   std::lock_guard<std::mutex> lock(RegistryMutex);
+   for (const auto& backend : getRegistry()) {
+      if (backend->getName() == name) return backend->isAvailable() ? backend.get() : nullptr;
+   }
+
+   // Any other libavcodec encoder can be named as well, and then it runs with the shared options only.
+   const AVCodec* encoder = avcodec_find_encoder_by_name( name.c_str() );
+   if (encoder == nullptr) return nullptr;
+   return getRegistry().emplace_back( std::make_unique<EncoderBackend>( encoder->name, encoder->id ) ).get();
+}
+
+const EncoderBackend* EncoderBackend::find(AVCodecID codec_id)
+{
+   std::lock_guard<std::mutex> lock(RegistryMutex);
+   for (const auto& backend : getRegistry()) {
+      if (backend->getCodecID() == codec_id && backend->isAvailable()) return backend.get();
+   }
+
+   const AVCodec* encoder = avcodec_find_encoder( codec_id );
+   if (encoder == nullptr) return nullptr;
+   return getRegistry().emplace_back( std::make_unique<EncoderBackend>( encoder->name, codec_id ) ).get();
+}
+
+std::vector<const EncoderBackend*> EncoderBackend::getAvailableBackends()
+{
+   std::lock_guard<std::mutex> lock(RegistryMutex);
+   std::vector<const EncoderBackend*> backends;
+   for (const auto& backend : getRegistry()) {
+      if (backend->isAvailable()) backends.emplace_back( backend.get() );
+   }
+   return backends;
+}
+
+AVPixelFormat X264Backend::getPixelFormat(const EncoderOptions& options, AVPixelFormat) const
+{
+   if (options.PixelFormat != AV_PIX_FMT_NONE) return options.PixelFormat;
+   return options.Lossless ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P;
+}
+
+void X264Backend::configure(AVCodecContext* context, const EncoderOptions& options) const
+{
+   // reference: https://trac.ffmpeg.org/wiki/Encode/H.264
+   // preset, tune, profile and the rate control details are private options of libx264.
+   void* x264 = context->priv_data;
+   if (!options.Preset.empty()) av_opt_set( x264, "preset", options.Preset.c_str(), 0 );
+   if (!options.Tune.empty()) av_opt_set( x264, "tune", options.Tune.c_str(), 0 );
+   if (!options.Profile.empty()) av_opt_set( x264, "profile", options.Profile.c_str(), 0 );
+   if (options.Lookahead >= 0) av_opt_set_int( x264, "rc-lookahead", options.Lookahead, 0 );
+   if (options.Lossless) {
+      // qp=0 is only allowed in the High 4:4:4 Predictive profile.
+      av_opt_set( x264, "profile", "high444", 0 );
+      av_opt_set_int( x264, "qp", 0, 0 );
+   }
+   else if (options.RateControlMode == EncoderOptions::RateControl::CRF) {
+      av_opt_set_double( x264, "crf", options.CRF, 0 );
+   }
+   else if (options.RateControlMode == EncoderOptions::RateControl::CBR) {
+      av_opt_set( x264, "nal-hrd", "cbr", 0 );
+   }
+   if (options.MeasureQuality) av_opt_set_int( x264, "ssim", 1, 0 );
+   // A frame forced to be an I-frame becomes an IDR frame, so that it can start a GOP.
+   av_opt_set_int( x264, "forced-idr", 1, 0 );
+
+   std::vector<std::string> params;
+   if (options.LookaheadThreadCount > 0) {
+      params.emplace_back( "lookahead-threads=" + std::to_string( options.LookaheadThreadCount ) );
+   }
+   if (options.FixedGOP) params.emplace_back( "min-keyint=" + std::to_string( context->gop_size ) );
+   if (!options.SceneCutDetection || options.FixedGOP) params.emplace_back( "scenecut=0" );
+   if (!params.empty()) {
+      std::string joined = params[0];
+      for (size_t i = 1; i < params.size(); ++i) joined += ":" + params[i];
+      av_opt_set( x264, "x264-params", joined.c_str(), 0 );
+   }
+}
+
+AVPixelFormat VP9Backend::getPixelFormat(const EncoderOptions& options, AVPixelFormat) const
+{
+   if (options.PixelFormat != AV_PIX_FMT_NONE) return options.PixelFormat;
+   return options.Lossless ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P;
+}
+
+void VP9Backend::configure(AVCodecContext* context, const EncoderOptions& options) const
+{
+   // reference: https://trac.ffmpeg.org/wiki/Encode/VP9
+   void* vpx = context->priv_data;
+
+   // libvpx runs on one thread unless told otherwise. Its threads work on tile columns, which have to be at least
+   // 256 pixels wide, and row-mt lets several threads share a column as well.
+   if (context->thread_count == 0) context->thread_count = std::min( getThreadCount( options ), 64 );
+   av_opt_set_int( vpx, "tile-columns", getTileColumnsLog2( context->width, 256, 6 ), 0 );
+   setOptionIfExists( vpx, "row-mt", 1 );
+
+   // The faster x264 presets map to the realtime deadline, the others to good with fewer speed features skipped.
+   const int speed = getSpeedLevel( options.Preset );
+   if (speed >= 7) {
+      av_opt_set( vpx, "deadline", "realtime", 0 );
+      av_opt_set_int( vpx, "cpu-used", speed - 1, 0 );
+   }
+   else {
+      av_opt_set( vpx, "deadline", "good", 0 );
+      av_opt_set_int( vpx, "cpu-used", std::clamp( speed - 1, 0, 5 ), 0 );
+   }
+   if (options.Lookahead >= 0) av_opt_set_int( vpx, "lag-in-frames", options.Lookahead, 0 );
+
+   if (options.Lossless) av_opt_set_int( vpx, "lossless", 1, 0 );
+   else if (options.RateControlMode == EncoderOptions::RateControl::CRF) {
+      // A zero bitrate together with crf is the constant quality mode of libvpx.
+      av_opt_set_int( vpx, "crf", std::lround( options.CRF ), 0 );
+   }
+}
+
+void SVTAV1Backend::configure(AVCodecContext* context, const EncoderOptions& options) const
+{
+   // reference: https://gitlab.com/AOMediaCodec/SVT-AV1/-/blob/master/Docs/Ffmpeg.md
+   void* svt = context->priv_data;
+
+   // SVT-AV1 uses every core by itself, and its presets reach further than the x264 ones, so medium maps to 8,
+   // which is already tuned for throughput. The range of the preset option differs between versions.
+   setOptionIfExists( svt, "preset", getSpeedLevel( options.Preset ) + 4 );
+   setOptionIfExists( svt, "tile_columns", getTileColumnsLog2( context->width, 512, 4 ) );
+   setOptionIfExists( svt, "tile_rows", getTileColumnsLog2( context->height, 512, 4 ) );
+   if (options.Lookahead >= 0) setOptionIfExists( svt, "la_depth", options.Lookahead );
+
+   std::vector<std::string> params;
+   if (options.ThreadCount > 0) params.emplace_back( "lp=" + std::to_string( options.ThreadCount ) );
+   if (!options.SceneCutDetection || options.FixedGOP) params.emplace_back( "scd=0" );
+   if (options.RateControlMode == EncoderOptions::RateControl::CRF) {
+      // The older wrappers only have the constant quantizer mode.
+      if (!setOptionIfExists( svt, "crf", std::lround( options.CRF ) )) {
+         setOptionIfExists( svt, "rc", 0 );
+         setOptionIfExists( svt, "qp", std::lround( options.CRF ) );
+      }
+   }
+   else if (options.RateControlMode == EncoderOptions::RateControl::VBR) setOptionIfExists( svt, "rc", 1 );
+   else if (options.RateControlMode == EncoderOptions::RateControl::CBR) setOptionIfExists( svt, "rc", 2 );
+   if (!params.empty()) {
+      std::string joined = params[0];
+      for (size_t i = 1; i < params.size(); ++i) joined += ":" + params[i];
+      setOptionIfExists( svt, "svtav1-params", joined );
+   }
+}
+
+AVPixelFormat FFV1Backend::getPixelFormat(const EncoderOptions& options, AVPixelFormat) const
+{
+   if (options.PixelFormat != AV_PIX_FMT_NONE) return options.PixelFormat;
+   // Only a swizzle away from the rendered RGBA, so the capture stays lossless.
+   return AV_PIX_FMT_0RGB32;
+}
+
+void FFV1Backend::configure(AVCodecContext* context, const EncoderOptions& options) const
+{
+   // Version 3 codes the slices of a frame independently, and slices are the only way FFV1 uses several threads,
+   // so there is at least a slice for every thread. The encoder only accepts grids of slices with at least two rows,
+   // and fails to open with any other count, so the count is rounded up to the next grid it takes. Too many small
+   // slices would cost compression, hence the limit.
+   context->level = 3;
+   if (options.ThreadingMode == EncoderOptions::Threading::Auto) context->thread_type = FF_THREAD_SLICE;
+   if (context->thread_count == 0) context->thread_count = getThreadCount( options );
+   if (context->slices > 0) return;
+
+   constexpr std::array<int, 7> slice_counts = { 4, 6, 9, 12, 16, 20, 24 };
+   const auto count = std::lower_bound( slice_counts.begin(), slice_counts.end(), context->thread_count );
+   context->slices = count != slice_counts.end() ? *count : slice_counts.back();
+}
\ No newline at end of file
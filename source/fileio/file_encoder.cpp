@@ -1,8 +1,60 @@
 #include "fileio/file_encoder.h"
+#include "fileio/encoder_backend.h"
+
+extern "C"
+{
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
+}
 
 FileEncoder::FileEncoder() :
-   Bitrate( 5'000'000 ), GOPSize( 15 ), EncodingBuffer( nullptr ), OriginalFrame( nullptr ), EncodedFrame( nullptr )
+   EncodedWidth( 0 ), EncodedHeight( 0 ), RenderedHeight( 0 ), FramePool( nullptr ), OriginalFrame( nullptr ),
+   EncodedFrame( nullptr ), RepeatedFrame( nullptr ), Backend( nullptr ), PreviousFrameHash( 0 ), LastSentPTS( -1 )
+{
+}
+
+void FileEncoder::setRateControl() const
+{
+   if (Options.Lossless) {
+      VideoCodecContext->bit_rate = 0;
+      return;
+   }
+   switch (Options.RateControlMode) {
+      case EncoderOptions::RateControl::CRF:
+         VideoCodecContext->bit_rate = 0;
+         break;
+      case EncoderOptions::RateControl::CBR:
+         VideoCodecContext->bit_rate = Options.Bitrate;
+         VideoCodecContext->rc_min_rate = Options.Bitrate;
+         VideoCodecContext->rc_max_rate = Options.Bitrate;
+         VideoCodecContext->rc_buffer_size = Options.BufferSize > 0 ? Options.BufferSize : Options.Bitrate;
+         break;
+      case EncoderOptions::RateControl::VBR:
+         VideoCodecContext->bit_rate = Options.Bitrate;
+         if (Options.MaxBitrate > 0) {
+            VideoCodecContext->rc_max_rate = Options.MaxBitrate;
+            VideoCodecContext->rc_buffer_size = Options.BufferSize > 0 ? Options.BufferSize : Options.MaxBitrate;
+         }
+         break;
+   }
+}
+
+void FileEncoder::setThreading() const
 {
+   VideoCodecContext->thread_count = Options.ThreadCount;
+   switch (Options.ThreadingMode) {
+      case EncoderOptions::Threading::Auto:
+         break;
+      case EncoderOptions::Threading::Frame:
+         VideoCodecContext->thread_type = FF_THREAD_FRAME;
+         break;
+      case EncoderOptions::Threading::Slice:
+         VideoCodecContext->thread_type = FF_THREAD_SLICE;
+         break;
+      case EncoderOptions::Threading::FrameAndSlice:
+         VideoCodecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+         break;
+   }
 }
 
 void FileEncoder::setVideoCodecContext(const AVCodec* encoder)
@@ -12,40 +64,40 @@ void FileEncoder::setVideoCodecContext(const AVCodec* encoder)
    if (VideoCodecContext == nullptr)
       throw std::runtime_error("Could not find video codec context");
 
-   VideoCodecContext->width = FrameWidth;
-   VideoCodecContext->height = FrameHeight;
-   VideoCodecContext->bit_rate = Bitrate;
-   VideoCodecContext->gop_size = GOPSize;
-   VideoCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+   VideoCodecContext->width = EncodedWidth;
+   VideoCodecContext->height = EncodedHeight;
+   VideoCodecContext->gop_size = Options.IntraOnly ? 1 : Options.GOPSize;
+   if (Options.IntraOnly) VideoCodecContext->max_b_frames = 0;
+   if (Options.FixedGOP) VideoCodecContext->keyint_min = VideoCodecContext->gop_size;
+   VideoCodecContext->pix_fmt = Backend->getPixelFormat( Options, PixelFormat );
    VideoCodecContext->time_base = av_d2q( 1.0 / Framerate, 1 );
    VideoCodecContext->framerate = av_d2q( Framerate, 1000 );
-   switch (VideoCodecID) {
-      case AV_CODEC_ID_H264:
-         // reference: https://trac.ffmpeg.org/wiki/Encode/H.264
-         av_opt_set( VideoCodecContext, "preset", "fast", 0 );
-         //av_opt_set( VideoCodecContext, "tune", "zerolatency", 0 );
-         av_opt_set( VideoCodecContext, "profile:v", "main", 0 );
-         av_opt_set( VideoCodecContext, "b", std::to_string( Bitrate ).c_str(), 0 );
-         break;
-      case AV_CODEC_ID_MJPEG:
-         VideoCodecContext->pix_fmt = AV_PIX_FMT_YUVJ420P;
-         break;
-      default:
-         break;
-   }
+   if (Options.MeasureQuality) setVideoCodecContextFlag( AV_CODEC_FLAG_PSNR );
+   if (Options.GlobalHeader) setVideoCodecContextFlag( CODEC_FLAG_GLOBAL_HEADER );
+   setRateControl();
+   setThreading();
+   Backend->configure( VideoCodecContext, Options );
 
    OriginalFrame = av_frame_alloc();
    EncodedFrame = av_frame_alloc();
-   if (OriginalFrame == nullptr || EncodedFrame == nullptr) throw std::runtime_error("Could not allocate AVFrame");
-   OriginalFrame->width = EncodedFrame->width = FrameWidth;
-   OriginalFrame->height = EncodedFrame->height = FrameHeight;
+   RepeatedFrame = av_frame_alloc();
+   if (OriginalFrame == nullptr || EncodedFrame == nullptr || RepeatedFrame == nullptr) {
+      throw std::runtime_error("Could not allocate AVFrame");
+   }
+   OriginalFrame->width = FrameWidth;
+   OriginalFrame->height = FrameHeight;
    OriginalFrame->format = PixelFormat;
+   EncodedFrame->width = EncodedWidth;
+   EncodedFrame->height = EncodedHeight;
    EncodedFrame->format = VideoCodecContext->pix_fmt;
+   // Downscaling averages the covered pixels, which keeps small renditions from aliasing.
+   const bool scaled = EncodedWidth != FrameWidth || EncodedHeight != FrameHeight;
    SWSContext = sws_getContext(
       FrameWidth, FrameHeight, PixelFormat,
-      FrameWidth, FrameHeight, VideoCodecContext->pix_fmt,
-      SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
+      EncodedWidth, EncodedHeight, VideoCodecContext->pix_fmt,
+      scaled ? SWS_AREA : SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
    );
+   createFramePool();
 
    if (avcodec_open2( VideoCodecContext, encoder, nullptr ) < 0) {
       close();
@@ -57,74 +109,258 @@ bool FileEncoder::openVideo(
    int frame_width,
    int frame_height,
    float framerate,
-   AVCodecID codec_id
+   AVCodecID codec_id,
+   const EncoderOptions& options
 )
 {
+   Options = options;
+   Throughput = EncoderThroughput{};
+   Statistics.clear();
+   PendingFrameTimes.clear();
+   PreviousFrameHash = 0;
+   LastSentPTS = -1;
    FrameWidth = frame_width;
    FrameHeight = static_cast<int>(((frame_height + 1u) >> 1u) << 1u);
+   RenderedHeight = frame_height;
+   EncodedWidth = Options.OutputWidth > 0 ? static_cast<int>(((Options.OutputWidth + 1u) >> 1u) << 1u) : FrameWidth;
+   EncodedHeight = Options.OutputHeight > 0 ? static_cast<int>(((Options.OutputHeight + 1u) >> 1u) << 1u) : FrameHeight;
    Framerate = framerate;
-   VideoCodecID = codec_id;
-   const AVCodec* encoder;
-   switch (VideoCodecID) {
-      case AV_CODEC_ID_H264:
-         encoder = avcodec_find_encoder_by_name( "libx264" );
-         break;
-      case AV_CODEC_ID_H263:
-      case AV_CODEC_ID_H263I:
-         VideoCodecID = AV_CODEC_ID_H263P;
-      default:
-         encoder = avcodec_find_encoder( VideoCodecID );
-         break;
-   }
-   setVideoCodecContext( encoder );
+   if (codec_id == AV_CODEC_ID_H263 || codec_id == AV_CODEC_ID_H263I) codec_id = AV_CODEC_ID_H263P;
+
+   // A named backend decides the codec, which may differ from the one asked for.
+   Backend = Options.Backend.empty() ? EncoderBackend::find( codec_id ) : EncoderBackend::find( Options.Backend );
+   if (Backend == nullptr) throw std::runtime_error("Could not find encoder backend");
+   VideoCodecID = Backend->getCodecID();
+   setVideoCodecContext( Backend->findEncoder() );
    Packet = av_packet_alloc();
    return true;
 }
 
 void FileEncoder::close()
 {
+   if (!Options.StatisticsFilePath.empty() && !Statistics.empty()) {
+      if (!writeStatistics( Options.StatisticsFilePath, Statistics )) {
+         std::cerr << "Could not write encoder statistics to " << Options.StatisticsFilePath.string() << "\n";
+      }
+      Statistics.clear();
+   }
+   PendingFrameTimes.clear();
    if (OriginalFrame != nullptr) av_frame_free( &OriginalFrame );
    if (EncodedFrame != nullptr) av_frame_free( &EncodedFrame );
-   if (EncodingBuffer != nullptr) {
-      free( EncodingBuffer );
-      EncodingBuffer = nullptr;
-   }
+   if (RepeatedFrame != nullptr) av_frame_free( &RepeatedFrame );
+   // Buffers still referenced by the encoder keep the pool alive until they are returned.
+   if (FramePool != nullptr) av_buffer_pool_uninit( &FramePool );
 }
 
-void FileEncoder::reallocateEncodingBufferIfNeeded()
+void FileEncoder::createFramePool()
 {
+   if (FramePool != nullptr) av_buffer_pool_uninit( &FramePool );
+   if (!needsConversion()) return;
+
+   // Every converted frame is taken from this pool, so the encoding loop does not allocate once it is warmed up.
    const int buffer_size = av_image_get_buffer_size(
       VideoCodecContext->pix_fmt,
-      FrameWidth,
-      FrameHeight,
-      1
+      EncodedWidth,
+      EncodedHeight,
+      FrameAlignment
    );
-   if (sizeof( EncodingBuffer ) < buffer_size) {
-      if (EncodingBuffer != nullptr) free( EncodingBuffer );
-      EncodingBuffer = (uint8_t*)malloc( buffer_size * sizeof( uint8_t ) );
+   if (buffer_size < 0) throw std::runtime_error("Could not compute the encoding buffer size");
+   FramePool = av_buffer_pool_init( buffer_size, av_buffer_alloc );
+   if (FramePool == nullptr) throw std::runtime_error("Could not allocate the encoding buffer pool");
+}
+
+bool FileEncoder::getPooledFrame(AVFrame* frame) const
+{
+   av_frame_unref( frame );
+   frame->buf[0] = av_buffer_pool_get( FramePool );
+   if (frame->buf[0] == nullptr) return false;
+
+   frame->width = EncodedWidth;
+   frame->height = EncodedHeight;
+   frame->format = VideoCodecContext->pix_fmt;
+   return av_image_fill_arrays(
+      frame->data, frame->linesize, frame->buf[0]->data,
+      VideoCodecContext->pix_fmt, EncodedWidth, EncodedHeight, FrameAlignment
+   ) >= 0;
+}
+
+bool FileEncoder::writePacket(AVFormatContext* format_context, AVPacket* packet, int track_id)
+{
+   const AVStream* stream = format_context->streams[track_id];
+   const int64_t frame_number = packet->pts;
+   av_packet_rescale_ts( packet, VideoCodecContext->time_base, stream->time_base );
+   packet->stream_index = stream->index;
+   if (!PacketWritten || format_context->pb == nullptr) {
+      return av_interleaved_write_frame( format_context, packet ) >= 0;
+   }
+
+   // The muxer takes the packet over, so its properties have to be read before it is written.
+   PacketInfo info{
+      frame_number,
+      packet->pts,
+      packet->dts,
+      (static_cast<uint>(packet->flags) & AV_PKT_FLAG_KEY) != 0,
+      avio_tell( format_context->pb ),
+      0
+   };
+   const int result = av_interleaved_write_frame( format_context, packet );
+   info.Size = avio_tell( format_context->pb ) - info.Position;
+   PacketWritten( info );
+   return result >= 0;
+}
+
+void FileEncoder::recordStatistics(const AVPacket* packet, double receive_milliseconds)
+{
+   FrameStatistics statistics{};
+   statistics.FrameNumber = packet->pts;
+   statistics.PictureType = '?';
+   statistics.Keyframe = (static_cast<uint>(packet->flags) & AV_PKT_FLAG_KEY) != 0;
+   statistics.QP = -1;
+   statistics.PacketSize = packet->size;
+   statistics.ReceiveMilliseconds = receive_milliseconds;
+   statistics.PSNR = std::numeric_limits<double>::quiet_NaN();
+
+   const auto pending = PendingFrameTimes.find( packet->pts );
+   if (pending != PendingFrameTimes.end()) {
+      statistics.ConversionMilliseconds = pending->second.first;
+      statistics.SendMilliseconds = pending->second.second;
+      PendingFrameTimes.erase( pending );
+   }
+
+   // The side data holds the quality as a lambda, the picture type, the number of errors and then the error of each
+   // plane as a sum of squared differences.
+   int size = 0;
+   const uint8_t* quality_stats = av_packet_get_side_data( packet, AV_PKT_DATA_QUALITY_STATS, &size );
+   if (quality_stats != nullptr && size >= 6) {
+      statistics.QP = static_cast<int>(AV_RL32( quality_stats )) / FF_QP2LAMBDA;
+      statistics.PictureType = av_get_picture_type_char( static_cast<AVPictureType>(quality_stats[4]) );
+      const int error_count = std::min<int>( quality_stats[5], 3 );
+      const AVPixFmtDescriptor* descriptor = av_pix_fmt_desc_get( VideoCodecContext->pix_fmt );
+      if (error_count > 0 && size >= 8 + 8 * error_count && descriptor != nullptr) {
+         const double luma_samples = static_cast<double>(EncodedWidth) * EncodedHeight;
+         const double chroma_samples =
+            static_cast<double>(AV_CEIL_RSHIFT( EncodedWidth, descriptor->log2_chroma_w )) *
+            AV_CEIL_RSHIFT( EncodedHeight, descriptor->log2_chroma_h );
+         double error = 0.0, samples = 0.0;
+         for (int i = 0; i < error_count; ++i) {
+            error += static_cast<double>(AV_RL64( quality_stats + 8 + 8 * i ));
+            samples += i == 0 ? luma_samples : chroma_samples;
+         }
+         statistics.PSNR = error > 0.0 ? 10.0 * std::log10( 255.0 * 255.0 * samples / error ) : 100.0;
+      }
+   }
+
+   if (StatisticsReady) StatisticsReady( statistics );
+   if (!Options.StatisticsFilePath.empty()) Statistics.emplace_back( statistics );
+}
+
+bool FileEncoder::writeStatistics(
+   const std::filesystem::path& file_path,
+   const std::vector<FrameStatistics>& statistics
+)
+{
+   std::ofstream file(file_path, std::ios::trunc);
+   if (!file.is_open()) return false;
+
+   const bool json = file_path.extension() == ".json";
+   const auto psnr = [json](double value) -> std::string {
+      if (std::isnan( value )) return json ? "null" : "";
+      std::ostringstream stream;
+      stream << std::fixed << std::setprecision( 3 ) << value;
+      return stream.str();
+   };
+   file << std::fixed << std::setprecision( 3 );
+   if (json) file << "[\n";
+   else file << "frame,type,keyframe,qp,size,conversion_ms,send_ms,receive_ms,psnr\n";
+   for (size_t i = 0; i < statistics.size(); ++i) {
+      const FrameStatistics& frame = statistics[i];
+      if (json) {
+         file << "  {\"frame\": " << frame.FrameNumber
+            << ", \"type\": \"" << frame.PictureType << "\""
+            << ", \"keyframe\": " << (frame.Keyframe ? "true" : "false")
+            << ", \"qp\": " << frame.QP
+            << ", \"size\": " << frame.PacketSize
+            << ", \"conversion_ms\": " << frame.ConversionMilliseconds
+            << ", \"send_ms\": " << frame.SendMilliseconds
+            << ", \"receive_ms\": " << frame.ReceiveMilliseconds
+            << ", \"psnr\": " << psnr( frame.PSNR ) << "}"
+            << (i + 1 < statistics.size() ? ",\n" : "\n");
+      }
+      else {
+         file << frame.FrameNumber << "," << frame.PictureType << "," << (frame.Keyframe ? 1 : 0) << ","
+            << frame.QP << "," << frame.PacketSize << "," << frame.ConversionMilliseconds << ","
+            << frame.SendMilliseconds << "," << frame.ReceiveMilliseconds << "," << psnr( frame.PSNR ) << "\n";
+      }
    }
+   if (json) file << "]\n";
+   return file.good();
 }
 
-bool FileEncoder::writeVideoFrame(AVFormatContext* format_context, const AVFrame* frame, int track_id) const
+bool FileEncoder::receivePackets(const AVFrame* frame, const std::function<bool(AVPacket*)>& consume)
 {
+   using milliseconds = std::chrono::duration<double, std::milli>;
+   const bool collects_statistics = collectsStatistics();
+   const auto send_start_time = std::chrono::steady_clock::now();
    if (avcodec_send_frame( VideoCodecContext, frame ) < 0) return false;
+   if (collects_statistics && frame != nullptr) {
+      PendingFrameTimes[frame->pts].second = milliseconds(std::chrono::steady_clock::now() - send_start_time).count();
+   }
 
    int received = 0;
-   AVStream* stream = format_context->streams[track_id];
    while (received >= 0) {
+      const auto receive_start_time = std::chrono::steady_clock::now();
       received = avcodec_receive_packet( VideoCodecContext, Packet );
       if (received == AVERROR( EAGAIN ) || received == ERROR_EOF) return true;
       else if (received < 0) break;
 
-      av_packet_rescale_ts( Packet, VideoCodecContext->time_base, stream->time_base );
-      Packet->stream_index = stream->index;
-      av_interleaved_write_frame( format_context, Packet );
+      if (collects_statistics) {
+         recordStatistics( Packet, milliseconds(std::chrono::steady_clock::now() - receive_start_time).count() );
+      }
+      Throughput.Bytes += Packet->size;
+      const bool consumed = consume( Packet );
       av_packet_unref( Packet );
+      if (!consumed) return false;
    }
    return false;
 }
 
-bool FileEncoder::encode(AVFormatContext* format_context, const uint8_t* image_buffer, int track_id)
+uint64_t FileEncoder::hashFrame(const uint8_t* image_buffer, int frame_width, int frame_height)
+{
+   // The rounds of XXH64 on four independent lanes, so that the multiplications overlap and the hash is about as
+   // fast as reading the frame. A changed frame colliding with the previous one is practically impossible.
+   constexpr uint64_t prime1 = 0x9E3779B185EBCA87ull;
+   constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+   const auto round = [](uint64_t accumulator, uint64_t input) {
+      accumulator += input * prime2;
+      accumulator = (accumulator << 31u) | (accumulator >> 33u);
+      return accumulator * prime1;
+   };
+
+   const size_t size = static_cast<size_t>(frame_width) * static_cast<size_t>(frame_height) * 4;
+   const size_t block_count = size / 32;
+   std::array<uint64_t, 4> lanes = { prime1 + prime2, prime2, 0, 0 - prime1 };
+   for (size_t i = 0; i < block_count; ++i) {
+      std::array<uint64_t, 4> words{};
+      std::memcpy( words.data(), image_buffer + i * 32, 32 );
+      for (size_t j = 0; j < 4; ++j) lanes[j] = round( lanes[j], words[j] );
+   }
+   uint64_t hash = size;
+   for (const uint64_t lane : lanes) hash = round( hash, lane );
+   for (size_t i = block_count * 32; i < size; ++i) hash = round( hash, image_buffer[i] );
+   return hash;
+}
+
+bool FileEncoder::isDuplicateFrame(const uint8_t* image_buffer, const FrameHints& hints)
+{
+   const uint64_t hash =
+      hints.Hash.has_value() ? *hints.Hash : hashFrame( image_buffer, FrameWidth, RenderedHeight );
+   const bool duplicate = FrameIndex > 0 && hash == PreviousFrameHash;
+   PreviousFrameHash = hash;
+   if (!duplicate) av_frame_unref( RepeatedFrame );
+   return duplicate;
+}
+
+AVFrame* FileEncoder::convertFrame(const uint8_t* image_buffer)
 {
    av_image_fill_arrays(
       OriginalFrame->data, OriginalFrame->linesize, image_buffer,
@@ -134,12 +370,8 @@ bool FileEncoder::encode(AVFormatContext* format_context, const uint8_t* image_b
    AVFrame* frame = OriginalFrame;
    flip( frame );
 
-   if (VideoCodecContext->pix_fmt != PixelFormat) {
-      reallocateEncodingBufferIfNeeded();
-      av_image_fill_arrays(
-         EncodedFrame->data, EncodedFrame->linesize, EncodingBuffer,
-         VideoCodecContext->pix_fmt, FrameWidth, FrameHeight, 1
-      );
+   if (needsConversion()) {
+      if (!getPooledFrame( EncodedFrame )) return nullptr;
       sws_scale(
          SWSContext, frame->data, frame->linesize,
          0, FrameHeight,
@@ -147,11 +379,167 @@ bool FileEncoder::encode(AVFormatContext* format_context, const uint8_t* image_b
       );
       frame = EncodedFrame;
    }
+   return frame;
+}
+
+bool FileEncoder::setRegionsOfInterest(AVFrame* frame, const std::vector<RegionOfInterest>& regions) const
+{
+   // The frame may be reused or refer to a frame encoded before, so the regions of that frame are removed first.
+   av_frame_remove_side_data( frame, AV_FRAME_DATA_REGIONS_OF_INTEREST );
+   if (regions.empty()) return true;
+
+   AVFrameSideData* side_data = av_frame_new_side_data(
+      frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, static_cast<int>(regions.size() * sizeof( AVRegionOfInterest ))
+   );
+   if (side_data == nullptr) return false;
+
+   // The regions are given in the rendered frame, which is flipped and then scaled to the encoded size.
+   const double scale_x = static_cast<double>(EncodedWidth) / FrameWidth;
+   const double scale_y = static_cast<double>(EncodedHeight) / FrameHeight;
+   auto* encoded_regions = reinterpret_cast<AVRegionOfInterest*>(side_data->data);
+   for (size_t i = 0; i < regions.size(); ++i) {
+      const RegionOfInterest& region = regions[i];
+      const int top = FrameHeight - std::clamp( region.Top + region.Height, 0, FrameHeight );
+      const int bottom = FrameHeight - std::clamp( region.Top, 0, FrameHeight );
+      const int left = std::clamp( region.Left, 0, FrameWidth );
+      const int right = std::clamp( region.Left + region.Width, 0, FrameWidth );
+      encoded_regions[i].self_size = sizeof( AVRegionOfInterest );
+      encoded_regions[i].top = static_cast<int>(std::floor( top * scale_y ));
+      encoded_regions[i].bottom = static_cast<int>(std::ceil( bottom * scale_y ));
+      encoded_regions[i].left = static_cast<int>(std::floor( left * scale_x ));
+      encoded_regions[i].right = static_cast<int>(std::ceil( right * scale_x ));
+      // A negative offset lowers the quantizer, which is what a higher priority asks for.
+      const float priority = std::clamp( region.Priority, -1.0f, 1.0f );
+      encoded_regions[i].qoffset = av_make_q( -static_cast<int>(std::lround( priority * 100.0f )), 100 );
+   }
+   return true;
+}
+
+bool FileEncoder::encodeFrame(
+   const uint8_t* image_buffer,
+   const FrameHints& hints,
+   const std::function<bool(AVPacket*)>& consume
+)
+{
+   const auto start_time = std::chrono::steady_clock::now();
+   Throughput.Frames++;
+
+   AVFrame* frame = nullptr;
+   // A keyframe is never dropped or repeated, even if its pixels did not change.
+   const bool duplicate =
+      Options.DuplicateFrameMode != EncoderOptions::DuplicateFrames::Encode && isDuplicateFrame( image_buffer, hints );
+   if (duplicate && !hints.Keyframe) {
+      Throughput.DuplicateFrames++;
+      // Only a frame that needed no conversion is not kept, because it refers to the buffer of the caller. The first
+      // duplicate of such a stretch is copied once and kept for the rest of it.
+      if (RepeatedFrame->buf[0] == nullptr) {
+         AVFrame* converted = convertFrame( image_buffer );
+         if (converted == nullptr || av_frame_ref( RepeatedFrame, converted ) < 0) return false;
+         if (converted == EncodedFrame) av_frame_unref( EncodedFrame );
+      }
+      if (Options.DuplicateFrameMode == EncoderOptions::DuplicateFrames::Drop) {
+         FrameIndex++;
+         Throughput.ConversionSeconds +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+         return true;
+      }
+      if (av_frame_ref( EncodedFrame, RepeatedFrame ) < 0) return false;
+      frame = EncodedFrame;
+   }
+   else frame = convertFrame( image_buffer );
+   if (frame == nullptr) return false;
+
    frame->pts = FrameIndex++;
-   return writeVideoFrame( format_context, frame, track_id );
+   frame->pict_type = hints.Keyframe && !Options.FixedGOP ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+   if (!setRegionsOfInterest( frame, hints.Regions )) {
+      if (frame == EncodedFrame) av_frame_unref( EncodedFrame );
+      return false;
+   }
+   LastSentPTS = frame->pts;
+   const auto converted_time = std::chrono::steady_clock::now();
+   if (collectsStatistics()) {
+      PendingFrameTimes[frame->pts].first =
+         std::chrono::duration<double, std::milli>(converted_time - start_time).count();
+   }
+   const bool result = receivePackets( frame, consume );
+   const auto encoded_time = std::chrono::steady_clock::now();
+   Throughput.ConversionSeconds += std::chrono::duration<double>(converted_time - start_time).count();
+   Throughput.EncodingSeconds += std::chrono::duration<double>(encoded_time - converted_time).count();
+
+   // The encoder holds its own reference to the pooled buffer, which goes back to the pool once it is released.
+   // A converted frame stays referenced in case the next frames repeat it.
+   if (frame == EncodedFrame) {
+      if (!duplicate && Options.DuplicateFrameMode != EncoderOptions::DuplicateFrames::Encode) {
+         av_frame_unref( RepeatedFrame );
+         if (av_frame_ref( RepeatedFrame, EncodedFrame ) < 0) av_frame_unref( RepeatedFrame );
+      }
+      av_frame_unref( EncodedFrame );
+   }
+   return result;
+}
+
+bool FileEncoder::flushFrames(const std::function<bool(AVPacket*)>& consume)
+{
+   const auto start_time = std::chrono::steady_clock::now();
+   bool result = true;
+
+   // Dropped frames at the end would be lost from the timeline, so the kept frame closes it at the last timestamp.
+   if (RepeatedFrame != nullptr && RepeatedFrame->buf[0] != nullptr && LastSentPTS < FrameIndex - 1) {
+      if (av_frame_ref( EncodedFrame, RepeatedFrame ) < 0) return false;
+      EncodedFrame->pts = LastSentPTS = FrameIndex - 1;
+      EncodedFrame->pict_type = AV_PICTURE_TYPE_NONE;
+      av_frame_remove_side_data( EncodedFrame, AV_FRAME_DATA_REGIONS_OF_INTEREST );
+      result = receivePackets( EncodedFrame, consume );
+      av_frame_unref( EncodedFrame );
+   }
+   result = receivePackets( nullptr, consume ) && result;
+   Throughput.EncodingSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+   return result;
+}
+
+bool FileEncoder::encode(
+   AVFormatContext* format_context,
+   const uint8_t* image_buffer,
+   int track_id,
+   const FrameHints& hints
+)
+{
+   return encodeFrame(
+      image_buffer,
+      hints,
+      [this, format_context, track_id](AVPacket* packet) { return writePacket( format_context, packet, track_id ); }
+   );
 }
 
 bool FileEncoder::flushVideo(AVFormatContext* format_context, int track_id)
 {
-   return writeVideoFrame( format_context, nullptr, track_id );
+   return flushFrames(
+      [this, format_context, track_id](AVPacket* packet) { return writePacket( format_context, packet, track_id ); }
+   );
+}
+
+bool FileEncoder::encode(const uint8_t* image_buffer, std::vector<AVPacket*>& packets, const FrameHints& hints)
+{
+   return encodeFrame(
+      image_buffer,
+      hints,
+      [&packets](AVPacket* packet) {
+         AVPacket* clone = av_packet_clone( packet );
+         if (clone == nullptr) return false;
+         packets.emplace_back( clone );
+         return true;
+      }
+   );
+}
+
+bool FileEncoder::flushVideo(std::vector<AVPacket*>& packets)
+{
+   return flushFrames(
+      [&packets](AVPacket* packet) {
+         AVPacket* clone = av_packet_clone( packet );
+         if (clone == nullptr) return false;
+         packets.emplace_back( clone );
+         return true;
+      }
+   );
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "fileio/output_sink.h"
+
+extern "C"
+{
+#include <libavformat/avio.h>
+#include <libavutil/error.h>
+}
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+   int writeAll(int file_descriptor, const uint8_t* buffer, int size)
+   {
+      int written = 0;
+      while (written < size) {
+         const ssize_t result = ::write( file_descriptor, buffer + written, static_cast<size_t>(size - written) );
+         if (result < 0) {
+            if (errno == EINTR) continue;
+            return AVERROR( errno );
+         }
+         written += static_cast<int>(result);
+      }
+      return written;
+   }
+
+   int64_t getSeekPosition(int64_t offset, int whence, int64_t position, int64_t size)
+   {
+      switch (whence) {
+         case SEEK_SET: return offset;
+         case SEEK_CUR: return position + offset;
+         case SEEK_END: return size + offset;
+         default: return AVERROR( EINVAL );
+      }
+   }
+}
+
+std::shared_ptr<OutputSink> OutputSink::create(const std::filesystem::path& destination)
+{
+   const std::string name = destination.string();
+   if (name.rfind( "pipe:", 0 ) == 0) {
+      const std::string descriptor = name.substr( 5 );
+      if (descriptor.empty() || !std::all_of( descriptor.begin(), descriptor.end(), ::isdigit )) return nullptr;
+      return std::make_shared<PipeSink>( std::stoi( descriptor ) );
+   }
+   if (name.rfind( "shm:", 0 ) == 0) {
+      std::string object_name = name.substr( 4 );
+      if (object_name.empty()) return nullptr;
+      if (object_name[0] != '/') object_name.insert( object_name.begin(), '/' );
+      return std::make_shared<SharedMemorySink>( object_name );
+   }
+   return std::make_shared<FileSink>( destination );
+}
+
+bool OutputSink::isFileDestination(const std::filesystem::path& destination)
+{
+   const std::string name = destination.string();
+   return name.rfind( "pipe:", 0 ) != 0 && name.rfind( "shm:", 0 ) != 0;
+}
+
+FileSink::FileSink(const std::filesystem::path& file_path) :
+   FileDescriptor( ::open( file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ), FilePath( file_path )
+{
+}
+
+FileSink::~FileSink()
+{
+   if (FileDescriptor >= 0) ::close( FileDescriptor );
+}
+
+int FileSink::write(const uint8_t* buffer, int size)
+{
+   return writeAll( FileDescriptor, buffer, size );
+}
+
+int64_t FileSink::seek(int64_t offset, int whence)
+{
+   if (whence == AVSEEK_SIZE) {
+      struct stat file_status{};
+      if (fstat( FileDescriptor, &file_status ) != 0) return AVERROR( errno );
+      return file_status.st_size;
+   }
+   const off_t position = lseek( FileDescriptor, static_cast<off_t>(offset), whence );
+   return position < 0 ? AVERROR( errno ) : static_cast<int64_t>(position);
+}
+
+PipeSink::PipeSink(int file_descriptor, bool owns_descriptor) :
+   FileDescriptor( file_descriptor ), OwnsDescriptor( owns_descriptor )
+{
+}
+
+PipeSink::~PipeSink()
+{
+   if (OwnsDescriptor && FileDescriptor >= 0) ::close( FileDescriptor );
+}
+
+int PipeSink::write(const uint8_t* buffer, int size)
+{
+   return writeAll( FileDescriptor, buffer, size );
+}
+
+int64_t PipeSink::seek(int64_t, int)
+{
+   return AVERROR( ESPIPE );
+}
+
+MemorySink::MemorySink(size_t reserved_size) : Position( 0 )
+{
+   Data.reserve( reserved_size );
+}
+
+int MemorySink::write(const uint8_t* buffer, int size)
+{
+   const size_t end = Position + static_cast<size_t>(size);
+   if (end > Data.size()) Data.resize( end );
+   std::copy( buffer, buffer + size, Data.begin() + static_cast<std::ptrdiff_t>(Position) );
+   Position = end;
+   return size;
+}
+
+int64_t MemorySink::seek(int64_t offset, int whence)
+{
+   const auto size = static_cast<int64_t>(Data.size());
+   if (whence == AVSEEK_SIZE) return size;
+
+   const int64_t position = getSeekPosition( offset, whence, static_cast<int64_t>(Position), size );
+   if (position < 0) return AVERROR( EINVAL );
+   Position = static_cast<size_t>(position);
+   return position;
+}
+
+SharedMemorySink::SharedMemorySink(std::string name, size_t initial_capacity) :
+   Name( std::move( name ) ), FileDescriptor( -1 ), MappedData( nullptr ), Capacity( 0 ), Size( 0 ), Position( 0 )
+{
+   FileDescriptor = shm_open( Name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+   if (FileDescriptor >= 0) reserve( std::max<size_t>( initial_capacity, 1 ) );
+}
+
+SharedMemorySink::~SharedMemorySink()
+{
+   if (MappedData != nullptr) munmap( MappedData, Capacity );
+   if (FileDescriptor >= 0) {
+      if (ftruncate( FileDescriptor, static_cast<off_t>(Size) ) != 0) std::cerr << "could not truncate " << Name << "\n";
+      ::close( FileDescriptor );
+   }
+}
+
+bool SharedMemorySink::reserve(size_t capacity)
+{
+   if (capacity <= Capacity) return true;
+   if (ftruncate( FileDescriptor, static_cast<off_t>(capacity) ) != 0) return false;
+
+   void* data = MappedData == nullptr ?
+      mmap( nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, FileDescriptor, 0 ) :
+      mremap( MappedData, Capacity, capacity, MREMAP_MAYMOVE );
+   if (data == MAP_FAILED) return false;
+   MappedData = static_cast<uint8_t*>(data);
+   Capacity = capacity;
+   return true;
+}
+
+int SharedMemorySink::write(const uint8_t* buffer, int size)
+{
+   const size_t end = Position + static_cast<size_t>(size);
+   if (end > Capacity && !reserve( std::max( end, Capacity * 2 ) )) return AVERROR( ENOMEM );
+   std::memcpy( MappedData + Position, buffer, static_cast<size_t>(size) );
+   Position = end;
+   Size = std::max( Size, end );
+   return size;
+}
+
+int64_t SharedMemorySink::seek(int64_t offset, int whence)
+{
+   if (whence == AVSEEK_SIZE) return static_cast<int64_t>(Size);
+
+   const int64_t position =
+      getSeekPosition( offset, whence, static_cast<int64_t>(Position), static_cast<int64_t>(Size) );
+   if (position < 0) return AVERROR( EINVAL );
+   Position = static_cast<size_t>(position);
+   return position;
+}
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include "fileio/parallel_video_writer.h"
+
+ParallelVideoWriter::ParallelVideoWriter() :
+   Running( false ), FrameWidth( 0 ), FrameHeight( 0 ), Framerate( 0.0f ), VideoCodecID( AV_CODEC_ID_NONE ),
+   ChunkFrames( 0 ), FrameSize( 0 ), MaxBufferedFrames( 0 ), BufferedFrames( 0 ), FrameCount( 0 )
+{
+}
+
+ParallelVideoWriter::~ParallelVideoWriter()
+{
+   close();
+}
+
+bool ParallelVideoWriter::open(
+   const std::filesystem::path& video_file_path,
+   int frame_width,
+   int frame_height,
+   float framerate,
+   AVCodecID codec_id,
+   const EncoderOptions& options,
+   const MuxerOptions& muxer_options,
+   int worker_count,
+   int chunk_frames
+)
+{
+   close();
+
+   const int hardware_threads = std::max( static_cast<int>(std::thread::hardware_concurrency()), 1 );
+   if (worker_count <= 0) worker_count = (hardware_threads + 15) / 16;
+
+   // The muxing encoder never sees a frame. It only provides the stream parameters, which match the ones of the
+   // workers because all of them are opened with the same options.
+   EncoderOptions encoder_options = options;
+   if (encoder_options.ThreadCount == 0) encoder_options.ThreadCount = std::max( hardware_threads / worker_count, 1 );
+   if (!Writer.open( video_file_path, frame_width, frame_height, framerate, codec_id, encoder_options, muxer_options )) {
+      return false;
+   }
+
+   // These are the options the muxing encoder was opened with, including the global header the muxer asked for, so
+   // the parameter sets of the chunks match the extradata of the stream.
+   WorkerOptions = Writer.getEncoderOptions();
+   StatisticsFilePath = WorkerOptions.StatisticsFilePath;
+   WorkerOptions.StatisticsFilePath.clear();
+   Statistics.clear();
+   const int gop_size = WorkerOptions.IntraOnly ? 1 : std::max( WorkerOptions.GOPSize, 1 );
+   if (chunk_frames <= 0) chunk_frames = gop_size * 4;
+   ChunkFrames = (chunk_frames + gop_size - 1) / gop_size * gop_size;
+
+   FrameWidth = frame_width;
+   FrameHeight = frame_height;
+   Framerate = framerate;
+   VideoCodecID = codec_id;
+   FrameSize = static_cast<size_t>(av_image_get_buffer_size(
+      AV_PIX_FMT_RGBA, frame_width, static_cast<int>(((frame_height + 1u) >> 1u) << 1u), 1
+   ));
+   MaxBufferedFrames = static_cast<size_t>(worker_count) * static_cast<size_t>(ChunkFrames);
+   BufferedFrames = 0;
+   FrameCount = 0;
+   Running = true;
+   for (int i = 0; i < worker_count; ++i) Workers.emplace_back( &ParallelVideoWriter::work, this );
+   return true;
+}
+
+void ParallelVideoWriter::close()
+{
+   if (!Running) return;
+
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      if (!Chunks.empty()) Chunks.back()->Complete = true;
+      Running = false;
+   }
+   FrameAdded.notify_all();
+   if (!muxEncodedChunks( true )) std::cerr << "Encoding is not properly processed\n";
+   for (auto& worker : Workers) worker.join();
+   if (!StatisticsFilePath.empty() && !FileEncoder::writeStatistics( StatisticsFilePath, Statistics )) {
+      std::cerr << "Could not write encoder statistics to " << StatisticsFilePath.string() << "\n";
+   }
+   Statistics.clear();
+   Workers.clear();
+   FreeFrames.clear();
+   Writer.close();
+}
+
+ParallelVideoWriter::Chunk* ParallelVideoWriter::findWaitingChunk() const
+{
+   for (const auto& chunk : Chunks) {
+      if (!chunk->Taken) return chunk.get();
+   }
+   return nullptr;
+}
+
+void ParallelVideoWriter::work()
+{
+   while (true) {
+      Chunk* chunk = nullptr;
+      {
+         std::unique_lock<std::mutex> lock(Mutex);
+         FrameAdded.wait( lock, [this, &chunk] {
+            chunk = findWaitingChunk();
+            return chunk != nullptr || !Running;
+         } );
+         if (chunk == nullptr) return;
+         chunk->Taken = true;
+      }
+      encodeChunk( *chunk );
+   }
+}
+
+void ParallelVideoWriter::encodeChunk(Chunk& chunk)
+{
+   bool succeeded = true;
+   std::vector<AVPacket*> packets;
+   FileEncoder encoder;
+   try {
+      succeeded = encoder.openVideo( FrameWidth, FrameHeight, Framerate, VideoCodecID, WorkerOptions );
+   }
+   catch (const std::exception& exception) {
+      std::cerr << exception.what() << "\n";
+      succeeded = false;
+   }
+   if (!StatisticsFilePath.empty()) {
+      encoder.setStatisticsCallback( [&chunk](const FrameStatistics& statistics) {
+         chunk.Statistics.emplace_back( statistics );
+         chunk.Statistics.back().FrameNumber += chunk.FirstFrame;
+      } );
+   }
+
+   while (true) {
+      std::vector<uint8_t> frame;
+      FrameHints hints;
+      {
+         std::unique_lock<std::mutex> lock(Mutex);
+         FrameAdded.wait( lock, [&chunk] { return !chunk.Frames.empty() || chunk.Complete; } );
+         if (chunk.Frames.empty()) break;
+         frame = std::move( chunk.Frames.front() );
+         hints = std::move( chunk.Hints.front() );
+         chunk.Frames.pop_front();
+         chunk.Hints.pop_front();
+      }
+      // The frames are still drained after a failure, so that the writer is never blocked by this chunk.
+      if (succeeded) succeeded = encoder.encode( frame.data(), packets, hints );
+      {
+         std::lock_guard<std::mutex> lock(Mutex);
+         FreeFrames.emplace_back( std::move( frame ) );
+         BufferedFrames--;
+      }
+      FrameReleased.notify_one();
+   }
+   if (succeeded) succeeded = encoder.flushVideo( packets );
+   encoder.close();
+
+   // The encoder of every chunk counts its frames from zero, and its time base is one frame.
+   for (AVPacket* packet : packets) {
+      if (packet->pts != AV_NOPTS_VALUE) packet->pts += chunk.FirstFrame;
+      if (packet->dts != AV_NOPTS_VALUE) packet->dts += chunk.FirstFrame;
+   }
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      chunk.Packets = std::move( packets );
+      chunk.Failed = !succeeded;
+      chunk.Encoded = true;
+   }
+   ChunkEncoded.notify_all();
+}
+
+bool ParallelVideoWriter::muxEncodedChunks(bool wait_for_all)
+{
+   bool succeeded = true;
+   while (true) {
+      std::unique_ptr<Chunk> chunk;
+      {
+         std::unique_lock<std::mutex> lock(Mutex);
+         if (wait_for_all) ChunkEncoded.wait( lock, [this] { return Chunks.empty() || Chunks.front()->Encoded; } );
+         if (Chunks.empty() || !Chunks.front()->Encoded) return succeeded;
+         chunk = std::move( Chunks.front() );
+         Chunks.pop_front();
+      }
+      if (chunk->Failed) succeeded = false;
+      Statistics.insert( Statistics.end(), chunk->Statistics.begin(), chunk->Statistics.end() );
+      for (AVPacket* packet : chunk->Packets) {
+         if (succeeded) succeeded = Writer.writePacket( packet );
+         av_packet_free( &packet );
+      }
+   }
+}
+
+void ParallelVideoWriter::writeVideo(const uint8_t* image_buffer, const FrameHints& hints)
+{
+   if (!Running) return;
+
+   std::vector<uint8_t> frame;
+   {
+      std::unique_lock<std::mutex> lock(Mutex);
+      FrameReleased.wait( lock, [this] { return BufferedFrames < MaxBufferedFrames; } );
+      BufferedFrames++;
+      if (!FreeFrames.empty()) {
+         frame = std::move( FreeFrames.back() );
+         FreeFrames.pop_back();
+      }
+   }
+   frame.resize( FrameSize );
+   std::memcpy( frame.data(), image_buffer, static_cast<size_t>(FrameWidth) * FrameHeight * 4 );
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      if (Chunks.empty() || Chunks.back()->Complete) {
+         Chunks.emplace_back( std::make_unique<Chunk>() );
+         Chunks.back()->FirstFrame = FrameCount;
+      }
+      Chunk& chunk = *Chunks.back();
+      chunk.Frames.emplace_back( std::move( frame ) );
+      chunk.Hints.emplace_back( hints );
+      FrameCount++;
+      if (FrameCount - chunk.FirstFrame == ChunkFrames) chunk.Complete = true;
+   }
+   FrameAdded.notify_all();
+
+   if (!muxEncodedChunks( false )) throw std::runtime_error("Encoding is not properly processed");
+}
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "fileio/rendition_ladder.h"
+
+RenditionLadder::RenditionLadder() :
+   Running( false ), HashesFrames( false ), FrameWidth( 0 ), FrameHeight( 0 ), FrameSize( 0 )
+{
+}
+
+RenditionLadder::~RenditionLadder()
+{
+   close();
+}
+
+bool RenditionLadder::open(
+   const std::vector<Rendition>& renditions,
+   int frame_width,
+   int frame_height,
+   float framerate,
+   AVCodecID codec_id
+)
+{
+   close();
+   Workers.clear();
+   if (renditions.empty()) return false;
+
+   for (const auto& rendition : renditions) {
+      auto worker = std::make_unique<RenditionWorker>();
+      if (!worker->Writer.open(
+         rendition.FilePath, frame_width, frame_height, framerate, codec_id, rendition.Options, rendition.Muxer
+      )) {
+         Workers.clear();
+         return false;
+      }
+      Workers.emplace_back( std::move( worker ) );
+   }
+
+   HashesFrames = std::any_of(
+      renditions.begin(), renditions.end(),
+      [](const Rendition& rendition) {
+         return rendition.Options.DuplicateFrameMode != EncoderOptions::DuplicateFrames::Encode;
+      }
+   );
+   FrameWidth = frame_width;
+   FrameHeight = frame_height;
+   FrameSize = static_cast<size_t>(av_image_get_buffer_size(
+      AV_PIX_FMT_RGBA, frame_width, static_cast<int>(((frame_height + 1u) >> 1u) << 1u), 1
+   ));
+   FramePool.clear();
+   for (size_t i = 0; i < FramePoolSize; ++i) {
+      FramePool.emplace_back( std::make_shared<std::vector<uint8_t>>( FrameSize ) );
+   }
+
+   Running = true;
+   for (auto& worker : Workers) worker->Thread = std::thread( &RenditionLadder::work, this, std::ref( *worker ) );
+   return true;
+}
+
+void RenditionLadder::close()
+{
+   if (!Running) return;
+
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Running = false;
+   }
+   FrameAdded.notify_all();
+   for (auto& worker : Workers) {
+      worker->Thread.join();
+      worker->Writer.close();
+   }
+   FramePool.clear();
+}
+
+std::shared_ptr<std::vector<uint8_t>> RenditionLadder::findFreeFrame() const
+{
+   // A buffer is free once no rendition holds it anymore, and then the pool has the only reference.
+   for (const auto& frame : FramePool) {
+      if (frame.use_count() == 1) return frame;
+   }
+   return nullptr;
+}
+
+void RenditionLadder::work(RenditionWorker& worker)
+{
+   while (true) {
+      std::shared_ptr<const std::vector<uint8_t>> frame;
+      FrameHints hints;
+      {
+         std::unique_lock<std::mutex> lock(Mutex);
+         FrameAdded.wait( lock, [this, &worker] { return !worker.Frames.empty() || !Running; } );
+         if (worker.Frames.empty()) return;
+         frame = std::move( worker.Frames.front().first );
+         hints = std::move( worker.Frames.front().second );
+         worker.Frames.pop_front();
+      }
+      if (!worker.Failed) {
+         try {
+            worker.Writer.writeVideo( frame->data(), hints );
+         }
+         catch (const std::exception& exception) {
+            std::cerr << exception.what() << "\n";
+            worker.Failed = true;
+         }
+      }
+      {
+         std::lock_guard<std::mutex> lock(Mutex);
+         frame.reset();
+      }
+      FrameReleased.notify_one();
+   }
+}
+
+void RenditionLadder::writeVideo(const uint8_t* image_buffer, const FrameHints& hints)
+{
+   if (!Running) return;
+
+   std::shared_ptr<std::vector<uint8_t>> frame;
+   {
+      std::unique_lock<std::mutex> lock(Mutex);
+      FrameReleased.wait( lock, [this, &frame] {
+         frame = findFreeFrame();
+         return frame != nullptr;
+      } );
+   }
+   std::memcpy( frame->data(), image_buffer, static_cast<size_t>(FrameWidth) * FrameHeight * 4 );
+   FrameHints frame_hints = hints;
+   if (HashesFrames && !frame_hints.Hash.has_value()) {
+      frame_hints.Hash = FileEncoder::hashFrame( frame->data(), FrameWidth, FrameHeight );
+   }
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      for (auto& worker : Workers) worker->Frames.emplace_back( frame, frame_hints );
+      frame.reset();
+   }
+   FrameAdded.notify_all();
+
+   for (const auto& worker : Workers) {
+      if (worker->Failed) throw std::runtime_error("Encoding is not properly processed");
+   }
+}
\ No newline at end of file
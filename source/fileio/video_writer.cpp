@@ -1,8 +1,10 @@
 #include "fileio/video_writer.h"
 
+#include <unistd.h>
+
 VideoWriter::VideoWriter() :
    HeaderWritten( false ), VideoTrackID( -1 ), FrameWidth( 0 ), FrameHeight( 0 ), FrameIndex( 0 ), InverseFramerate(),
-   FormatContext( nullptr ), IOContextBuffer( nullptr ), IOContextBufferSize( 32 * 1024 ), VideoEncoder( nullptr )
+   FormatContext( nullptr ), IOContextBuffer( nullptr ), IOContextBufferSize( 1024 * 1024 ), VideoEncoder( nullptr )
 {
 }
 
@@ -11,31 +13,124 @@ VideoWriter::~VideoWriter()
    close();
 }
 
-bool VideoWriter::initialize(const std::filesystem::path& video_file_path)
+void VideoWriter::setIOBufferSize(size_t size)
+{
+   const auto page_size = static_cast<size_t>(sysconf( _SC_PAGESIZE ));
+   IOContextBufferSize = std::max<size_t>( (size + page_size - 1) / page_size, 1 ) * page_size;
+}
+
+int VideoWriter::writeIOContext(void* opaque, uint8_t* buffer, int size)
+{
+   return static_cast<OutputSink*>(opaque)->write( buffer, size );
+}
+
+int64_t VideoWriter::seekIOContext(void* opaque, int64_t offset, int whence)
+{
+   return static_cast<OutputSink*>(opaque)->seek( offset, whence );
+}
+
+bool VideoWriter::initialize(std::shared_ptr<OutputSink> sink, const AVOutputFormat* output_format)
 {
    close();
+   if (sink == nullptr || !sink->isOpen()) return false;
+   if (output_format == nullptr || (static_cast<uint>(output_format->flags) & FORMAT_OPENED_NO_FILE)) return false;
+
    FormatContext = avformat_alloc_context();
    if (FormatContext == nullptr) return false;
-   FormatContext->oformat =
-      av_guess_format( nullptr, video_file_path.string().c_str(), nullptr );
-   if (FormatContext->oformat == nullptr || (static_cast<uint>(FormatContext->oformat->flags) & FORMAT_OPENED_NO_FILE)) {
+   FormatContext->oformat = const_cast<AVOutputFormat*>(output_format);
+
+   // The muxer output is collected in one large buffer and handed to the sink only when it is full,
+   // so that the sink sees few large writes instead of many small ones. It is page aligned, so the kernel can copy
+   // it into the page cache a page at a time.
+   Sink = std::move( sink );
+   void* buffer = nullptr;
+   if (posix_memalign( &buffer, static_cast<size_t>(sysconf( _SC_PAGESIZE )), IOContextBufferSize ) != 0) {
       close();
       return false;
    }
-   if (avio_open( &FormatContext->pb, video_file_path.string().c_str(), AVIO_FLAG_WRITE ) < 0) {
+   IOContextBuffer = static_cast<uint8_t*>(buffer);
+   FormatContext->pb = avio_alloc_context(
+      IOContextBuffer, static_cast<int>(IOContextBufferSize), 1, Sink.get(),
+      nullptr, writeIOContext, Sink->isSeekable() ? seekIOContext : nullptr
+   );
+   if (FormatContext->pb == nullptr) {
       close();
       return false;
    }
+   FormatContext->pb->seekable = Sink->isSeekable() ? AVIO_SEEKABLE_NORMAL : 0;
+
+   // The muxer reopens the file by its url to move the index to the front.
+   const std::filesystem::path file_path = Sink->getFilePath();
+   if (!file_path.empty()) FormatContext->url = av_strdup( file_path.string().c_str() );
    return true;
 }
 
+bool VideoWriter::usesFastStart() const
+{
+   return Muxer.LayoutMode == MuxerOptions::Layout::Progressive && Muxer.FastStart &&
+      Sink != nullptr && Sink->isSeekable() && !Sink->getFilePath().empty();
+}
+
+bool VideoWriter::writesFrameIndex() const
+{
+   // Fragmented files collect the samples of a fragment before writing them, so their positions are not known here.
+   return Muxer.LayoutMode == MuxerOptions::Layout::Progressive && !Muxer.IndexFilePath.empty() &&
+      Sink != nullptr && Sink->isSeekable();
+}
+
+bool VideoWriter::initializeSegmented(const std::filesystem::path& playlist_path)
+{
+   close();
+   std::filesystem::path playlist = playlist_path;
+   if (playlist.extension() != ".m3u8") playlist.replace_extension( ".m3u8" );
+   if (playlist.has_parent_path()) {
+      std::error_code error;
+      std::filesystem::create_directories( playlist.parent_path(), error );
+      if (error) return false;
+   }
+
+   // The HLS muxer opens the playlist and every segment by itself, so it does not go through a sink.
+   return avformat_alloc_output_context2( &FormatContext, nullptr, "hls", playlist.string().c_str() ) >= 0;
+}
+
+void VideoWriter::setMuxerOptions(AVDictionary** options) const
+{
+   switch (Muxer.LayoutMode) {
+      case MuxerOptions::Layout::Progressive:
+         av_dict_set( options, "brand", "mp42", 0 );
+         // A classic MP4 patches its header after the media data, so a sink that cannot seek gets a fragmented file.
+         if (!Sink->isSeekable()) {
+            av_dict_set( options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0 );
+         }
+         else if (usesFastStart()) av_dict_set( options, "movflags", "faststart", 0 );
+         break;
+      case MuxerOptions::Layout::Fragmented:
+         // A fragment is cut at every keyframe, which is exactly one GOP.
+         av_dict_set( options, "movflags", "cmaf+frag_keyframe+empty_moov+default_base_moof", 0 );
+         break;
+      case MuxerOptions::Layout::Segmented: {
+         const std::filesystem::path directory = std::filesystem::path(FormatContext->url).parent_path();
+         av_dict_set( options, "hls_segment_type", "fmp4", 0 );
+         av_dict_set( options, "hls_time", std::to_string( Muxer.FragmentDuration ).c_str(), 0 );
+         av_dict_set( options, "hls_list_size", "0", 0 );
+         av_dict_set( options, "hls_playlist_type", "event", 0 );
+         av_dict_set( options, "hls_flags", "independent_segments", 0 );
+         av_dict_set( options, "hls_fmp4_init_filename", Muxer.InitFileName.c_str(), 0 );
+         av_dict_set( options, "hls_segment_filename", (directory / Muxer.SegmentFileName).string().c_str(), 0 );
+      } break;
+   }
+}
+
 void VideoWriter::writeHeader()
 {
-   if (FormatContext == nullptr || FormatContext->pb == nullptr) return;
+   if (FormatContext == nullptr) return;
+   if (FormatContext->pb == nullptr && Muxer.LayoutMode != MuxerOptions::Layout::Segmented) return;
 
    AVDictionary* options = nullptr;
-   av_dict_set( &options, "brand", "mp42", 0 );
-   if (avformat_write_header( FormatContext, &options ) < 0) {
+   setMuxerOptions( &options );
+   const int result = avformat_write_header( FormatContext, &options );
+   av_dict_free( &options );
+   if (result < 0) {
       close();
       throw std::runtime_error("Could not write video header");
    }
@@ -47,60 +142,205 @@ void VideoWriter::addVideoTrack()
    AVStream* stream = avformat_new_stream( FormatContext, nullptr );
    if (stream == nullptr) return;
    VideoTrackID = stream->index;
-   if (static_cast<uint>(FormatContext->oformat->flags) & FORMAT_WANTS_GLOBAL_HEADER) {
-      VideoEncoder->setVideoCodecContextFlag( CODEC_FLAG_GLOBAL_HEADER );
-   }
    VideoEncoder->setVideoCodecParameters( stream->codecpar );
 }
 
-bool VideoWriter::open(
-   const std::filesystem::path& video_file_path,
+void VideoWriter::recordPacket(const PacketInfo& info)
+{
+   if (info.FrameNumber < 0) return;
+
+   const auto frame_number = static_cast<size_t>(info.FrameNumber);
+   if (frame_number >= IndexRecords.size()) {
+      FrameIndexFile::Record missing{};
+      missing.SourceFrame = FrameIndexFile::NoFrame;
+      IndexRecords.resize( frame_number + 1, missing );
+   }
+   FrameIndexFile::Record& record = IndexRecords[frame_number];
+   record.Offset = static_cast<uint64_t>(info.Position);
+   record.Size = static_cast<uint32_t>(info.Size);
+   record.Flags = info.Keyframe ? FrameIndexFile::Keyframe : 0u;
+   record.PTS = info.PTS;
+   record.DTS = info.DTS;
+   record.SourceFrame = static_cast<uint32_t>(frame_number);
+}
+
+void VideoWriter::writeFrameIndex(int64_t offset_shift) const
+{
+   std::ofstream file(Muxer.IndexFilePath, std::ios::binary | std::ios::trunc);
+   if (!file.is_open()) {
+      std::cerr << "Could not write frame index " << Muxer.IndexFilePath.string() << "\n";
+      return;
+   }
+
+   const AVRational time_base = FormatContext->streams[VideoTrackID]->time_base;
+   FrameIndexFile::Header header{};
+   header.Magic = FrameIndexFile::Magic;
+   header.Version = FrameIndexFile::Version;
+   header.FrameCount = static_cast<uint32_t>(IndexRecords.size());
+   header.TimeBaseNumerator = time_base.num;
+   header.TimeBaseDenominator = time_base.den;
+   file.write( reinterpret_cast<const char*>(&header), sizeof( header ) );
+   // The packets arrive in decoding order, so the dropped frames are only known once every packet is written.
+   const FrameIndexFile::Record* shown = nullptr;
+   for (FrameIndexFile::Record record : IndexRecords) {
+      if (record.SourceFrame != FrameIndexFile::NoFrame) shown = &IndexRecords[record.SourceFrame];
+      else if (shown != nullptr) {
+         record = *shown;
+         record.Flags |= FrameIndexFile::Duplicate;
+      }
+      record.Offset += static_cast<uint64_t>(offset_shift);
+      file.write( reinterpret_cast<const char*>(&record), sizeof( record ) );
+   }
+}
+
+bool VideoWriter::openVideo(
    int frame_width,
    int frame_height,
    float framerate,
-   AVCodecID codec_id
+   AVCodecID codec_id,
+   const EncoderOptions& options
 )
 {
    FrameWidth = frame_width;
    FrameHeight = frame_height;
-   if (!initialize( video_file_path )) {
-      close();
-      throw std::runtime_error("Could not initialize video writer");
+
+   // Fragments and segments can only begin at keyframes, so a fixed GOP of one fragment duration keeps them aligned.
+   EncoderOptions encoder_options = options;
+   if (Muxer.LayoutMode != MuxerOptions::Layout::Progressive) {
+      encoder_options.GOPSize = std::max( static_cast<int>(std::lround( Muxer.FragmentDuration * framerate )), 1 );
+      encoder_options.FixedGOP = true;
    }
 
+   // A container without timestamps cannot hold a variable frame rate, so duplicates are repeated there.
+   if (encoder_options.DuplicateFrameMode == EncoderOptions::DuplicateFrames::Drop &&
+       (static_cast<uint>(FormatContext->oformat->flags) & FORMAT_NO_TIMESTAMPS)) {
+      encoder_options.DuplicateFrameMode = EncoderOptions::DuplicateFrames::Repeat;
+   }
+   // The flag only takes effect when the codec is opened, so it cannot be set once the track is added.
+   if (static_cast<uint>(FormatContext->oformat->flags) & FORMAT_WANTS_GLOBAL_HEADER) {
+      encoder_options.GlobalHeader = true;
+   }
    VideoEncoder = std::make_unique<FileEncoder>();
-   if (!VideoEncoder->openVideo( frame_width, frame_height, framerate, codec_id )) {
+   if (!VideoEncoder->openVideo( frame_width, frame_height, framerate, codec_id, encoder_options )) {
       close();
       throw std::runtime_error("Could not open video");
    }
 
    addVideoTrack();
+   if (writesFrameIndex()) {
+      VideoEncoder->setPacketCallback( [this](const PacketInfo& info) { recordPacket( info ); } );
+   }
    writeHeader();
    return true;
 }
 
+bool VideoWriter::open(
+   const std::filesystem::path& video_file_path,
+   int frame_width,
+   int frame_height,
+   float framerate,
+   AVCodecID codec_id,
+   const EncoderOptions& options,
+   const MuxerOptions& muxer_options
+)
+{
+   Muxer = muxer_options;
+   if (Muxer.LayoutMode == MuxerOptions::Layout::Segmented) {
+      if (!OutputSink::isFileDestination( video_file_path ) || !initializeSegmented( video_file_path )) {
+         close();
+         throw std::runtime_error("Could not initialize segmented video writer");
+      }
+      return openVideo( frame_width, frame_height, framerate, codec_id, options );
+   }
+
+   // A pipe or a shared memory object has no extension to guess the container from, so it gets an MP4.
+   const bool is_file = OutputSink::isFileDestination( video_file_path );
+   const AVOutputFormat* output_format =
+      av_guess_format( is_file ? nullptr : "mp4", is_file ? video_file_path.string().c_str() : nullptr, nullptr );
+   if (!initialize( OutputSink::create( video_file_path ), output_format )) {
+      close();
+      throw std::runtime_error("Could not initialize video writer");
+   }
+   return openVideo( frame_width, frame_height, framerate, codec_id, options );
+}
+
+bool VideoWriter::open(
+   std::shared_ptr<OutputSink> sink,
+   const std::string& format_name,
+   int frame_width,
+   int frame_height,
+   float framerate,
+   AVCodecID codec_id,
+   const EncoderOptions& options,
+   const MuxerOptions& muxer_options
+)
+{
+   Muxer = muxer_options;
+   if (Muxer.LayoutMode == MuxerOptions::Layout::Segmented) {
+      throw std::runtime_error("Segmented output needs a playlist path instead of a sink");
+   }
+
+   const AVOutputFormat* output_format = av_guess_format( format_name.c_str(), nullptr, nullptr );
+   if (!initialize( std::move( sink ), output_format )) {
+      close();
+      throw std::runtime_error("Could not initialize video writer");
+   }
+   return openVideo( frame_width, frame_height, framerate, codec_id, options );
+}
+
 void VideoWriter::close()
 {
    if (FormatContext != nullptr) {
-      VideoEncoder->flushVideo( FormatContext, VideoTrackID );
-      if (HeaderWritten) av_write_trailer( FormatContext );
+      if (VideoEncoder != nullptr && HeaderWritten) VideoEncoder->flushVideo( FormatContext, VideoTrackID );
+      if (HeaderWritten) {
+         const int64_t trailer_position = FormatContext->pb != nullptr ? avio_tell( FormatContext->pb ) : 0;
+         av_write_trailer( FormatContext );
+         if (!IndexRecords.empty()) {
+            // Fast start inserts the index in front of the media data, which moves every packet by its size.
+            int64_t offset_shift = 0;
+            if (usesFastStart()) {
+               avio_flush( FormatContext->pb );
+               offset_shift = Sink->seek( 0, AVSEEK_SIZE ) - trailer_position;
+            }
+            writeFrameIndex( offset_shift );
+         }
+      }
+      // A context that only writes keeps the buffer it was given, so the buffer is freed here and not by avio.
       if (FormatContext->pb != nullptr) {
-         avio_close( FormatContext->pb );
-         FormatContext->pb = nullptr;
+         avio_flush( FormatContext->pb );
+         avio_context_free( &FormatContext->pb );
       }
       avformat_free_context( FormatContext );
       FormatContext = nullptr;
    }
+   if (IOContextBuffer != nullptr) {
+      free( IOContextBuffer );
+      IOContextBuffer = nullptr;
+   }
+   Sink.reset();
    if (VideoEncoder != nullptr) VideoEncoder->close();
+   IndexRecords.clear();
    HeaderWritten = false;
    FrameIndex = 0;
    VideoTrackID = -1;
 }
 
-void VideoWriter::writeVideo(const uint8_t* image_buffer) const
+void VideoWriter::writeVideo(const uint8_t* image_buffer, const FrameHints& hints) const
 {
    if (!HeaderWritten || VideoTrackID >= static_cast<int>(FormatContext->nb_streams)) return;
-   if (!VideoEncoder->encode( FormatContext, image_buffer, VideoTrackID )) {
+   if (!VideoEncoder->encode( FormatContext, image_buffer, VideoTrackID, hints )) {
       throw std::runtime_error("Encoding is not properly processed");
    }
+
+   // The MP4 muxer holds the samples of a fragment back until it is complete and then writes it at once,
+   // so this only reaches the sink when a fragment is finished and lets readers consume it without waiting.
+   if (Muxer.LayoutMode == MuxerOptions::Layout::Fragmented) avio_flush( FormatContext->pb );
+}
+
+bool VideoWriter::writePacket(AVPacket* packet) const
+{
+   if (!HeaderWritten || VideoTrackID >= static_cast<int>(FormatContext->nb_streams)) return false;
+   const bool result = VideoEncoder->writePacket( FormatContext, packet, VideoTrackID );
+   if (Muxer.LayoutMode == MuxerOptions::Layout::Fragmented) avio_flush( FormatContext->pb );
+   return result;
 }
\ No newline at end of file
@@ -0,0 +1,523 @@
+#include "segmented_render.h"
+#include "parallel_renderer.h"
+
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+   uint32_t parseUnsigned(const std::string& value)
+   {
+      if (value.empty() || !std::all_of( value.begin(), value.end(), [](char c) { return std::isdigit( c ) != 0; } )) {
+         throw std::invalid_argument(value);
+      }
+      return static_cast<uint32_t>(std::stoul( value ));
+   }
+
+   int parseBitrate(const std::string& value)
+   {
+      uint64_t multiplier = 1;
+      std::string digits = value;
+      if (!digits.empty() && (digits.back() == 'k' || digits.back() == 'K')) multiplier = 1'000;
+      else if (!digits.empty() && digits.back() == 'M') multiplier = 1'000'000;
+      if (multiplier > 1) digits.pop_back();
+
+      const uint64_t bitrate = parseUnsigned( digits ) * multiplier;
+      if (bitrate == 0 || bitrate > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+         throw std::invalid_argument(value);
+      }
+      return static_cast<int>(bitrate);
+   }
+
+   std::string parseCodec(const std::string& value)
+   {
+      if (value != "h264" && value != "x264-lossless" && value != "ffv1" && value != "raw") {
+         throw std::invalid_argument(value);
+      }
+      return value;
+   }
+
+   MuxerOptions::Layout parseLayout(const std::string& value)
+   {
+      if (value == "progressive") return MuxerOptions::Layout::Progressive;
+      if (value == "fragmented") return MuxerOptions::Layout::Fragmented;
+      if (value == "hls") return MuxerOptions::Layout::Segmented;
+      throw std::invalid_argument(value);
+   }
+
+   RenderOutput parseOutput(const std::string& value)
+   {
+      // The path itself may contain colons, so only a suffix that starts like a size is taken for one.
+      RenderOutput output;
+      const size_t colon = value.rfind( ':' );
+      const std::string suffix = colon != std::string::npos ? value.substr( colon + 1 ) : std::string();
+      const size_t x = suffix.find( 'x' );
+      if (suffix.empty() || std::isdigit( suffix[0] ) == 0 || x == std::string::npos) {
+         output.Path = value;
+         return output;
+      }
+
+      const size_t at = suffix.find( '@' );
+      output.Path = value.substr( 0, colon );
+      output.Width = static_cast<int>(parseUnsigned( suffix.substr( 0, x ) ));
+      const std::string height = at != std::string::npos ? suffix.substr( x + 1, at - x - 1 ) : suffix.substr( x + 1 );
+      output.Height = static_cast<int>(parseUnsigned( height ));
+      if (at != std::string::npos) output.Bitrate = parseBitrate( suffix.substr( at + 1 ) );
+      if (output.Path.empty() || output.Width == 0 || output.Height == 0) throw std::invalid_argument(value);
+      return output;
+   }
+}
+
+EncoderOptions RenderJob::getEncoderOptions(size_t output_index) const
+{
+   EncoderOptions options;
+   if (Codec == "x264-lossless") {
+      options.Lossless = true;
+      options.IntraOnly = true;
+   }
+   if (output_index >= Outputs.size()) return options;
+
+   const RenderOutput& output = Outputs[output_index];
+   options.OutputWidth = output.Width;
+   options.OutputHeight = output.Height;
+   if (output.Bitrate > 0) {
+      options.Bitrate = output.Bitrate;
+      // A ladder keeps the renditions near their bitrates, so that a player can switch between them.
+      options.MaxBitrate = output.Bitrate * 3 / 2;
+      options.BufferSize = output.Bitrate * 2;
+   }
+   return options;
+}
+
+AVCodecID RenderJob::getCodecID() const
+{
+   if (Codec == "ffv1") return AV_CODEC_ID_FFV1;
+   if (Codec == "raw") return AV_CODEC_ID_RAWVIDEO;
+   return AV_CODEC_ID_H264;
+}
+
+std::string RenderJob::getFileExtension() const
+{
+   if (Codec == "ffv1") return ".mkv";
+   if (Codec == "raw") return ".nut";
+   return ".mp4";
+}
+
+JobServer::Client::~Client()
+{
+   if (FileDescriptor >= 0) ::close( FileDescriptor );
+}
+
+void JobServer::Client::send(const std::string& message)
+{
+   const std::string line = message + "\n";
+   std::lock_guard<std::mutex> lock(WriteMutex);
+   size_t written = 0;
+   while (written < line.size()) {
+      const ssize_t result = ::send( FileDescriptor, line.data() + written, line.size() - written, MSG_NOSIGNAL );
+      if (result < 0 && errno == EINTR) continue;
+      // A client that went away does not get its replies, but its jobs are still rendered.
+      if (result <= 0) return;
+      written += static_cast<size_t>(result);
+   }
+}
+
+JobServer::JobServer() :
+   Accepting( false ), Stopped( false ), RepliesOnStandardOutput( false ), NextSequence( 0 ), ProgressInterval( 30 ),
+   Common( std::make_shared<CommonVK>() )
+{
+}
+
+std::optional<RenderJob> JobServer::parseJob(const std::string& line, std::string& error)
+{
+   RenderJob job;
+   std::istringstream stream(line);
+   std::string field;
+   try {
+      while (stream >> field) {
+         if (field == "faststart") {
+            job.Muxer.FastStart = true;
+            continue;
+         }
+
+         const size_t separator = field.find( '=' );
+         if (separator == std::string::npos) {
+            error = "expected key=value instead of " + field;
+            return std::nullopt;
+         }
+
+         const std::string key = field.substr( 0, separator );
+         const std::string value = field.substr( separator + 1 );
+         if (key == "name") job.Name = value;
+         else if (key == "priority") {
+            // May be negative, but like every other number it has to be nothing but digits.
+            const bool negative = !value.empty() && value[0] == '-';
+            const uint32_t magnitude = parseUnsigned( negative ? value.substr( 1 ) : value );
+            if (magnitude > static_cast<uint32_t>(std::numeric_limits<int>::max())) throw std::invalid_argument(value);
+            job.Priority = negative ? -static_cast<int>(magnitude) : static_cast<int>(magnitude);
+         }
+         else if (key == "size") {
+            const size_t x = value.find( 'x' );
+            if (x == std::string::npos) throw std::invalid_argument(value);
+            job.Width = parseUnsigned( value.substr( 0, x ) );
+            job.Height = parseUnsigned( value.substr( x + 1 ) );
+         }
+         else if (key == "frames") {
+            // Either a count starting at frame 0 or an inclusive range like 30-89.
+            const size_t dash = value.find( '-' );
+            if (dash == std::string::npos) job.FrameCount = parseUnsigned( value );
+            else {
+               job.FirstFrame = parseUnsigned( value.substr( 0, dash ) );
+               const uint32_t last_frame = parseUnsigned( value.substr( dash + 1 ) );
+               if (last_frame < job.FirstFrame) throw std::invalid_argument(value);
+               job.FrameCount = last_frame - job.FirstFrame + 1;
+            }
+         }
+         else if (key == "scene") job.Scene = value;
+         else if (key == "output") job.Outputs.emplace_back( parseOutput( value ) );
+         else if (key == "segment") job.SegmentFrames = parseUnsigned( value );
+         else if (key == "workers") job.Workers = static_cast<int>(std::max( parseUnsigned( value ), 1u ));
+         else if (key == "chunks") job.ChunkEncoders = static_cast<int>(parseUnsigned( value ));
+         else if (key == "layout") job.Muxer.LayoutMode = parseLayout( value );
+         else if (key == "index") job.Muxer.IndexFilePath = value;
+         else if (key == "codec") job.Codec = parseCodec( value );
+         else {
+            error = "unknown key " + key;
+            return std::nullopt;
+         }
+      }
+   }
+   catch (const std::exception&) {
+      error = "invalid value in " + field;
+      return std::nullopt;
+   }
+
+   if (job.Width == 0 || job.Height == 0 || job.FrameCount == 0) {
+      error = "a job needs a size and a frame count greater than 0";
+      return std::nullopt;
+   }
+   if (job.SegmentFrames > 0 && job.Outputs.size() > 1) {
+      error = "a segmented job has a single output";
+      return std::nullopt;
+   }
+   if (job.SegmentFrames > 0 && !job.Outputs.empty() && !OutputSink::isFileDestination( job.Outputs.front().Path )) {
+      error = "a segmented job writes its output to a file";
+      return std::nullopt;
+   }
+   if (job.Workers > 1 && (job.SegmentFrames > 0 || job.Outputs.size() > 1)) {
+      error = "a job with several workers has a single output and no segments";
+      return std::nullopt;
+   }
+   const bool streams_output = std::any_of(
+      job.Outputs.begin(), job.Outputs.end(),
+      [](const RenderOutput& output) { return !OutputSink::isFileDestination( output.Path ); }
+   );
+   if (job.Muxer.LayoutMode == MuxerOptions::Layout::Segmented && streams_output) {
+      error = "an hls job writes its playlist to a file";
+      return std::nullopt;
+   }
+   // Pipes and shared memory carry MP4, and so do the segments, which holds neither FFV1 nor raw video.
+   const bool needs_container = job.getCodecID() != AV_CODEC_ID_H264;
+   if (needs_container && (streams_output || job.SegmentFrames > 0)) {
+      error = "codec " + job.Codec + " is written to a file and not in segments";
+      return std::nullopt;
+   }
+   if (!job.Muxer.IndexFilePath.empty() &&
+       (job.Outputs.size() > 1 || job.Muxer.LayoutMode != MuxerOptions::Layout::Progressive)) {
+      error = "a frame index is written for a single progressive output";
+      return std::nullopt;
+   }
+   if (job.ChunkEncoders > 0 && (job.Workers > 1 || job.Outputs.size() > 1)) {
+      error = "a job encoded in chunks has a single output and one worker";
+      return std::nullopt;
+   }
+   return job;
+}
+
+bool JobServer::handleLine(const std::string& line, const Reporter& report)
+{
+   std::istringstream stream(line);
+   std::string command;
+   stream >> command;
+   if (command.empty()) return true;
+
+   if (command == "shutdown") {
+      report( "shutting down" );
+      stop();
+      return false;
+   }
+   if (command == "status") {
+      std::lock_guard<std::mutex> lock(Mutex);
+      report(
+         "status running " + (RunningJob.empty() ? std::string("-") : RunningJob) +
+         " queued " + std::to_string( Jobs.size() )
+      );
+      return true;
+   }
+   if (command != "render") {
+      report( "error unknown command " + command );
+      return true;
+   }
+
+   std::string fields, error;
+   std::getline( stream, fields );
+   std::optional<RenderJob> job = parseJob( fields, error );
+   if (!job.has_value()) {
+      report( "error " + error );
+      return true;
+   }
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      const bool writes_standard_output = std::any_of(
+         job->Outputs.begin(), job->Outputs.end(), [](const RenderOutput& output) { return output.Path == "pipe:1"; }
+      );
+      if (RepliesOnStandardOutput && writes_standard_output) {
+         report( "error pipe:1 is taken by the replies" );
+         return true;
+      }
+      if (!Accepting) {
+         report( "error the server does not accept jobs anymore" );
+         return true;
+      }
+      if (job->Name.empty()) job->Name = "job" + std::to_string( NextSequence );
+      const std::string name = job->Name;
+      Jobs.push( QueuedJob{ std::move( *job ), NextSequence++, report } );
+      report( "queued " + name + " " + std::to_string( Jobs.size() ) );
+   }
+   JobAdded.notify_one();
+   return true;
+}
+
+void JobServer::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Accepting = false;
+      Stopped = true;
+   }
+   JobAdded.notify_all();
+}
+
+void JobServer::finishInput()
+{
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Accepting = false;
+   }
+   JobAdded.notify_all();
+}
+
+void JobServer::run()
+{
+   while (true) {
+      std::optional<QueuedJob> queued_job;
+      {
+         std::unique_lock<std::mutex> lock(Mutex);
+         JobAdded.wait( lock, [this] { return Stopped || !Jobs.empty() || !Accepting; } );
+         if (Stopped || Jobs.empty()) break;
+         queued_job = Jobs.top();
+         Jobs.pop();
+         RunningJob = queued_job->Job.Name;
+      }
+      runJob( *queued_job );
+      {
+         std::lock_guard<std::mutex> lock(Mutex);
+         RunningJob.clear();
+      }
+   }
+
+   std::lock_guard<std::mutex> lock(Mutex);
+   while (!Jobs.empty()) {
+      Jobs.top().Report( "cancelled " + Jobs.top().Job.Name );
+      Jobs.pop();
+   }
+}
+
+void JobServer::runJob(const QueuedJob& queued_job)
+{
+   const RenderJob& job = queued_job.Job;
+   const Reporter& report = queued_job.Report;
+   report( "started " + job.Name );
+
+   const auto start = std::chrono::steady_clock::now();
+   try {
+      if (Renderer == nullptr) Renderer = std::make_unique<RendererVK>( Common );
+      Renderer->resize( job.Width, job.Height );
+      Renderer->setFrameRange( job.FirstFrame, job.FrameCount );
+      if (!job.Scene.empty()) Renderer->setTexture( job.Scene );
+
+      const RendererVK::ProgressCallback progress =
+         [this, &job, &report](uint32_t rendered_frames, uint32_t frame_count) {
+            if (rendered_frames % ProgressInterval != 0 && rendered_frames != frame_count) return;
+            report(
+               "progress " + job.Name + " " + std::to_string( rendered_frames ) + "/" + std::to_string( frame_count )
+            );
+         };
+      Renderer->setProgressCallback( progress );
+
+      // A job without an output is written next to the sources under its name.
+      RenderJob output_job = job;
+      if (output_job.Outputs.empty()) {
+         output_job.Outputs.push_back(
+            RenderOutput{ std::filesystem::path(CMAKE_SOURCE_DIR) / (job.Name + job.getFileExtension()) }
+         );
+      }
+      Renderer->setEncoderOptions( output_job.getEncoderOptions() );
+      Renderer->setChunkEncoders( job.ChunkEncoders );
+      Renderer->setMuxerOptions( job.Muxer );
+      Renderer->setCodec( job.getCodecID() );
+      if (job.Workers > 1) {
+         // The workers have renderers of their own on the shared context, so this one stays as it is.
+         ParallelRenderer parallel_renderer(Common, job.Workers);
+         parallel_renderer.setProgressCallback( progress );
+         if (!parallel_renderer.render( output_job )) {
+            throw std::runtime_error("the frames were not rendered or encoded");
+         }
+      }
+      else if (job.SegmentFrames > 0) {
+         // The progress of a segmented job counts the frames of the current segment.
+         SegmentedRender render(output_job);
+         if (!render.renderSegments( *Renderer ) || !render.stitch( *Renderer )) {
+            throw std::runtime_error("the segments were not rendered or stitched, the next run resumes");
+         }
+      }
+      else {
+         std::vector<Rendition> renditions;
+         if (output_job.Outputs.size() > 1) {
+            for (size_t i = 0; i < output_job.Outputs.size(); ++i) {
+               renditions.push_back(
+                  Rendition{ output_job.Outputs[i].Path, output_job.getEncoderOptions( i ), output_job.Muxer }
+               );
+            }
+         }
+         Renderer->setRenditions( std::move( renditions ) );
+         Renderer->setOutputPath( output_job.Outputs.front().Path );
+         Renderer->play();
+      }
+
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      std::ostringstream message;
+      message << "done " << job.Name << " " << std::fixed << std::setprecision( 2 ) << elapsed.count() << "s "
+         << static_cast<double>(job.FrameCount) / elapsed.count() << " fps";
+      report( message.str() );
+   }
+   catch (const std::exception& exception) {
+      report( "failed " + job.Name + " " + exception.what() );
+      // The renderer may have stopped in the middle of a frame. The context survives, so the next job only recreates
+      // the pipelines and the frame resources.
+      Renderer.reset();
+   }
+}
+
+void JobServer::serve(std::istream& input, std::ostream& output)
+{
+   std::mutex output_mutex;
+   const Reporter report = [&output, &output_mutex](const std::string& message) {
+      std::lock_guard<std::mutex> lock(output_mutex);
+      output << message << std::endl;
+   };
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Accepting = true;
+      Stopped = false;
+      RepliesOnStandardOutput = &output == &std::cout;
+   }
+
+   std::thread reader( [this, &input, &report] {
+      std::string line;
+      while (std::getline( input, line )) {
+         if (!handleLine( line, report )) return;
+      }
+      finishInput();
+   } );
+   run();
+   reader.join();
+}
+
+void JobServer::readClient(const std::shared_ptr<Client>& client)
+{
+   const Reporter report = [client](const std::string& message) { client->send( message ); };
+   std::string pending;
+   std::array<char, 4096> buffer{};
+   while (true) {
+      const ssize_t size = ::read( client->FileDescriptor, buffer.data(), buffer.size() );
+      if (size < 0 && errno == EINTR) continue;
+      if (size <= 0) break;
+
+      pending.append( buffer.data(), static_cast<size_t>(size) );
+      size_t end;
+      while ((end = pending.find( '\n' )) != std::string::npos) {
+         const std::string line = pending.substr( 0, end );
+         pending.erase( 0, end + 1 );
+         if (!handleLine( line, report )) {
+            client->Finished = true;
+            return;
+         }
+      }
+   }
+   client->Finished = true;
+}
+
+void JobServer::listen(const std::filesystem::path& socket_path)
+{
+   sockaddr_un address{};
+   if (socket_path.native().size() >= sizeof( address.sun_path )) throw std::runtime_error("socket path is too long");
+
+   const int server = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+   if (server < 0) throw std::runtime_error("could not create a socket");
+   address.sun_family = AF_UNIX;
+   std::strncpy( address.sun_path, socket_path.c_str(), sizeof( address.sun_path ) - 1 );
+   ::unlink( socket_path.c_str() );
+   if (bind( server, reinterpret_cast<sockaddr*>(&address), sizeof( address ) ) != 0 || ::listen( server, 16 ) != 0) {
+      ::close( server );
+      throw std::runtime_error("could not listen on " + socket_path.string());
+   }
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Accepting = true;
+      Stopped = false;
+      RepliesOnStandardOutput = false;
+   }
+
+   // Only the acceptor touches the clients until it is joined. The threads of disconnected clients are joined
+   // whenever a new one connects, so a long running server does not pile them up.
+   std::vector<std::pair<std::shared_ptr<Client>, std::thread>> clients;
+   std::thread acceptor( [this, server, &clients] {
+      while (true) {
+         const int file_descriptor = accept4( server, nullptr, nullptr, SOCK_CLOEXEC );
+         if (file_descriptor < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+         }
+
+         auto client = std::make_shared<Client>( file_descriptor );
+         {
+            std::lock_guard<std::mutex> lock(Mutex);
+            if (Stopped) return;
+         }
+         for (auto it = clients.begin(); it != clients.end();) {
+            if (it->first->Finished) {
+               it->second.join();
+               it = clients.erase( it );
+            }
+            else ++it;
+         }
+         clients.emplace_back( client, std::thread( &JobServer::readClient, this, client ) );
+      }
+   } );
+   std::cout << "listening on " << socket_path.string() << "\n";
+
+   run();
+
+   // Shutting the sockets down wakes up the acceptor and the readers blocked on them.
+   shutdown( server, SHUT_RDWR );
+   acceptor.join();
+   for (auto& client : clients) {
+      shutdown( client.first->FileDescriptor, SHUT_RDWR );
+      client.second.join();
+   }
+   ::close( server );
+   ::unlink( socket_path.c_str() );
+}
\ No newline at end of file
@@ -1,13 +1,15 @@
 #include <object.h>
 
-ObjectVK::ObjectVK(CommonVK* common) :
-   Common( common ), TextureImage{}, TextureImageMemory{}, TextureImageView{}, TextureSampler{}, DescriptorPool{}
+ObjectVK::ObjectVK(CommonVK* common, const AssetBundle* assets) :
+   Common( common ), Assets( assets ), TextureImage{}, TextureImageMemory{}, TextureImageView{}, TextureSampler{},
+   DescriptorPool{}, HasTransform( false ), LastTransform( 1.0f ), LastExtent{}, ScreenBounds{}, DamageRegion{},
+   Priority( 0.0f )
 {
 }
 
 ObjectVK::~ObjectVK()
 {
-   VkDevice device = CommonVK::getDevice();
+   VkDevice device = Common->getDevice();
    vkDestroyDescriptorPool( device, DescriptorPool, nullptr );
    vkDestroyBuffer( device, MVP.UniformBuffer, nullptr );
    vkFreeMemory( device, MVP.UniformBuffersMemory, nullptr );
@@ -34,17 +36,17 @@ void ObjectVK::getSquareObject(std::vector<Vertex>& vertices)
    };
 }
 
-VkCommandBuffer ObjectVK::beginSingleTimeCommands()
+VkCommandBuffer ObjectVK::beginSingleTimeCommands() const
 {
    VkCommandBufferAllocateInfo allocate_info{};
    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-   allocate_info.commandPool = CommonVK::getCommandPool();
+   allocate_info.commandPool = Common->getCommandPool();
    allocate_info.commandBufferCount = 1;
 
    VkCommandBuffer command_buffer;
    vkAllocateCommandBuffers(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &allocate_info,
       &command_buffer
    );
@@ -57,7 +59,7 @@ VkCommandBuffer ObjectVK::beginSingleTimeCommands()
    return command_buffer;
 }
 
-void ObjectVK::endSingleTimeCommands(VkCommandBuffer command_buffer)
+void ObjectVK::endSingleTimeCommands(VkCommandBuffer command_buffer) const
 {
    vkEndCommandBuffer( command_buffer );
 
@@ -66,18 +68,22 @@ void ObjectVK::endSingleTimeCommands(VkCommandBuffer command_buffer)
    submit_info.commandBufferCount = 1;
    submit_info.pCommandBuffers = &command_buffer;
 
-   vkQueueSubmit( CommonVK::getGraphicsQueue(), 1, &submit_info, VK_NULL_HANDLE );
-   vkQueueWaitIdle( CommonVK::getGraphicsQueue() );
+   Common->submitAndWait( submit_info );
 
    vkFreeCommandBuffers(
-      CommonVK::getDevice(),
-      CommonVK::getCommandPool(),
+      Common->getDevice(),
+      Common->getCommandPool(),
       1,
       &command_buffer
    );
 }
 
-void ObjectVK::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout)
+void ObjectVK::transitionImageLayout(
+   VkImage image,
+   VkFormat format,
+   VkImageLayout old_layout,
+   VkImageLayout new_layout
+) const
 {
    VkCommandBuffer command_buffer = beginSingleTimeCommands();
 
@@ -124,7 +130,7 @@ void ObjectVK::transitionImageLayout(VkImage image, VkFormat format, VkImageLayo
    endSingleTimeCommands( command_buffer );
 }
 
-void ObjectVK::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height)
+void ObjectVK::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) const
 {
    VkCommandBuffer command_buffer = beginSingleTimeCommands();
 
@@ -151,25 +157,12 @@ void ObjectVK::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width,
    endSingleTimeCommands( command_buffer );
 }
 
-void ObjectVK::createTextureImage(const std::string& texture_file_path)
+void ObjectVK::uploadTextureImage(const void* pixels, uint width, uint height)
 {
-   const FREE_IMAGE_FORMAT format = FreeImage_GetFileType( texture_file_path.c_str(), 0 );
-   FIBITMAP* texture = FreeImage_Load( format, texture_file_path.c_str() );
-
-   FIBITMAP* texture_converted;
-   constexpr uint n_bits = 32;
-   const uint n_bits_per_pixel = FreeImage_GetBPP( texture );
-   texture_converted = n_bits_per_pixel == n_bits ? texture : FreeImage_ConvertTo32Bits( texture );
-
-   const uint width = FreeImage_GetWidth( texture_converted );
-   const uint height = FreeImage_GetHeight( texture_converted );
-   void* pixels = FreeImage_GetBits( texture_converted );
-   if (!pixels) throw std::runtime_error("failed to load texture image!");
-
    VkBuffer staging_buffer;
    VkDeviceMemory staging_buffer_memory;
    VkDeviceSize image_size = width * height * 4;
-   CommonVK::createBuffer(
+   Common->createBuffer(
       image_size,
       VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -179,17 +172,14 @@ void ObjectVK::createTextureImage(const std::string& texture_file_path)
 
    void* data;
    vkMapMemory(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       staging_buffer_memory,
       0, image_size, 0, &data
    );
       memcpy( data, pixels, static_cast<size_t>(image_size) );
-   vkUnmapMemory( CommonVK::getDevice(), staging_buffer_memory );
-
-   FreeImage_Unload( texture_converted );
-   if (n_bits_per_pixel != n_bits) FreeImage_Unload( texture );
+   vkUnmapMemory( Common->getDevice(), staging_buffer_memory );
 
-   CommonVK::createImage(
+   Common->createImage(
       width, height,
       VK_FORMAT_R8G8B8A8_SRGB,
       VK_IMAGE_TILING_OPTIMAL,
@@ -217,13 +207,44 @@ void ObjectVK::createTextureImage(const std::string& texture_file_path)
       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
    );
 
-   vkDestroyBuffer( CommonVK::getDevice(), staging_buffer, nullptr );
-   vkFreeMemory( CommonVK::getDevice(), staging_buffer_memory, nullptr );
+   vkDestroyBuffer( Common->getDevice(), staging_buffer, nullptr );
+   vkFreeMemory( Common->getDevice(), staging_buffer_memory, nullptr );
+}
+
+void ObjectVK::createTextureImage(const std::string& texture_file_path)
+{
+   // A texture pre-transcoded into the asset bundle is uploaded straight from the mapped file without decoding.
+   if (Assets != nullptr) {
+      const std::optional<AssetBundle::Asset> asset =
+         Assets->find( std::filesystem::path(texture_file_path).filename().string() );
+      if (asset.has_value() && asset->Type == AssetBundle::EntryType::TextureRGBA8) {
+         uploadTextureImage( asset->Data, asset->Width, asset->Height );
+         return;
+      }
+   }
+
+   const FREE_IMAGE_FORMAT format = FreeImage_GetFileType( texture_file_path.c_str(), 0 );
+   FIBITMAP* texture = FreeImage_Load( format, texture_file_path.c_str() );
+
+   FIBITMAP* texture_converted;
+   constexpr uint n_bits = 32;
+   const uint n_bits_per_pixel = FreeImage_GetBPP( texture );
+   texture_converted = n_bits_per_pixel == n_bits ? texture : FreeImage_ConvertTo32Bits( texture );
+
+   const uint width = FreeImage_GetWidth( texture_converted );
+   const uint height = FreeImage_GetHeight( texture_converted );
+   void* pixels = FreeImage_GetBits( texture_converted );
+   if (!pixels) throw std::runtime_error("failed to load texture image!");
+
+   uploadTextureImage( pixels, width, height );
+
+   FreeImage_Unload( texture_converted );
+   if (n_bits_per_pixel != n_bits) FreeImage_Unload( texture );
 }
 
 void ObjectVK::createTextureImageView()
 {
-   TextureImageView = CommonVK::createImageView(
+   TextureImageView = Common->createImageView(
       TextureImage,
       VK_FORMAT_R8G8B8A8_SRGB,
       VK_IMAGE_ASPECT_COLOR_BIT
@@ -233,7 +254,7 @@ void ObjectVK::createTextureImageView()
 void ObjectVK::createTextureSampler()
 {
    VkPhysicalDeviceProperties properties{};
-   vkGetPhysicalDeviceProperties( CommonVK::getPhysicalDevice(), &properties );
+   vkGetPhysicalDeviceProperties( Common->getPhysicalDevice(), &properties );
 
    VkSamplerCreateInfo sampler_info{};
    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -251,7 +272,7 @@ void ObjectVK::createTextureSampler()
    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 
    const VkResult result = vkCreateSampler(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &sampler_info,
       nullptr,
       &TextureSampler
@@ -316,7 +337,7 @@ std::array<VkVertexInputAttributeDescription, 3> ObjectVK::getAttributeDescripti
    pool_info.maxSets = 1;
 
    const VkResult result = vkCreateDescriptorPool(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &pool_info,
       nullptr,
       &DescriptorPool
@@ -329,21 +350,21 @@ void ObjectVK::createUniformBuffers()
    VkDeviceSize mvp_buffer_size = sizeof( MVPUniformBufferObject );
    VkDeviceSize material_buffer_size = sizeof( MaterialUniformBufferObject );
    VkDeviceSize light_buffer_size = sizeof( LightUniformBufferObject );
-   CommonVK::createBuffer(
+   Common->createBuffer(
       mvp_buffer_size,
       VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
       MVP.UniformBuffer,
       MVP.UniformBuffersMemory
    );
-   CommonVK::createBuffer(
+   Common->createBuffer(
       material_buffer_size,
       VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
       Material.UniformBuffer,
       Material.UniformBuffersMemory
    );
-   CommonVK::createBuffer(
+   Common->createBuffer(
       light_buffer_size,
       VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -362,7 +383,7 @@ void ObjectVK::createDescriptorSets(VkDescriptorSetLayout descriptor_set_layout)
    allocate_info.pSetLayouts = layouts.data();
 
    const VkResult result = vkAllocateDescriptorSets(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &allocate_info,
       &DescriptorSet
    );
@@ -422,7 +443,7 @@ void ObjectVK::createDescriptorSets(VkDescriptorSetLayout descriptor_set_layout)
    descriptor_writes[3].pBufferInfo = &light_buffer_info;
 
    vkUpdateDescriptorSets(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       static_cast<uint32_t>(descriptor_writes.size()),
       descriptor_writes.data(),
       0,
@@ -430,6 +451,49 @@ void ObjectVK::createDescriptorSets(VkDescriptorSetLayout descriptor_set_layout)
    );
 }
 
+VkRect2D ObjectVK::projectBounds(VkExtent2D extent, const glm::mat4& transform) const
+{
+   const VkRect2D whole_frame{ { 0, 0 }, extent };
+   glm::vec2 min_point(std::numeric_limits<float>::max());
+   glm::vec2 max_point(std::numeric_limits<float>::lowest());
+   for (const auto& vertex : Vertices) {
+      const glm::vec4 clip = transform * glm::vec4(vertex.Position, 1.0f);
+      // A vertex behind the camera has no meaningful projection, so the object may cover the whole frame.
+      if (clip.w <= 0.0f) return whole_frame;
+
+      const glm::vec2 ndc = glm::vec2(clip) / clip.w;
+      const glm::vec2 pixel = (ndc * 0.5f + 0.5f) * glm::vec2(extent.width, extent.height);
+      min_point = glm::min( min_point, pixel );
+      max_point = glm::max( max_point, pixel );
+   }
+
+   // One more pixel on every side covers the rasterization rules and the texture filtering at the edges.
+   const glm::vec2 size(extent.width, extent.height);
+   const glm::ivec2 top_left = glm::ivec2(glm::clamp( glm::floor( min_point ) - 1.0f, glm::vec2(0.0f), size ));
+   const glm::ivec2 bottom_right = glm::ivec2(glm::clamp( glm::ceil( max_point ) + 1.0f, glm::vec2(0.0f), size ));
+   if (bottom_right.x <= top_left.x || bottom_right.y <= top_left.y) return VkRect2D{};
+   return {
+      { top_left.x, top_left.y },
+      { static_cast<uint32_t>(bottom_right.x - top_left.x), static_cast<uint32_t>(bottom_right.y - top_left.y) }
+   };
+}
+
+void ObjectVK::updateDamageRegion(VkExtent2D extent, const glm::mat4& transform)
+{
+   const bool resized = extent.width != LastExtent.width || extent.height != LastExtent.height;
+   if (HasTransform && !resized && transform == LastTransform) {
+      DamageRegion = VkRect2D{};
+      return;
+   }
+
+   const VkRect2D bounds = projectBounds( extent, transform );
+   DamageRegion = HasTransform && !resized ? CommonVK::uniteRects( ScreenBounds, bounds ) : bounds;
+   ScreenBounds = bounds;
+   LastTransform = transform;
+   LastExtent = extent;
+   HasTransform = true;
+}
+
 void ObjectVK::updateUniformBuffer(VkExtent2D extent, const glm::mat4& to_world)
 {
    MVPUniformBufferObject mvp{};
@@ -450,6 +514,7 @@ void ObjectVK::updateUniformBuffer(VkExtent2D extent, const glm::mat4& to_world)
    // The easiest way to compensate for that is to flip the sign on the scaling factor of the y-axis in the projection
    // matrix. If you do not do this, then the image will be rendered upside down.
    mvp.Projection[1][1] *= -1;
+   updateDamageRegion( extent, mvp.Projection * mvp.View * mvp.Model );
 
    MaterialUniformBufferObject material{};
    material.EmissionColor = glm::vec4(0.2f, 0.2f, 0.2f, 1.0f);
@@ -471,28 +536,28 @@ void ObjectVK::updateUniformBuffer(VkExtent2D extent, const glm::mat4& to_world)
 
    void* mvp_data;
    vkMapMemory(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       MVP.UniformBuffersMemory,
       0, sizeof( mvp ), 0, &mvp_data
    );
       std::memcpy( mvp_data, &mvp, sizeof( mvp ) );
-   vkUnmapMemory( CommonVK::getDevice(), MVP.UniformBuffersMemory );
+   vkUnmapMemory( Common->getDevice(), MVP.UniformBuffersMemory );
 
    void* material_data;
    vkMapMemory(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       Material.UniformBuffersMemory,
       0, sizeof( material ), 0, &material_data
    );
       std::memcpy( material_data, &material, sizeof( material ) );
-   vkUnmapMemory( CommonVK::getDevice(), Material.UniformBuffersMemory );
+   vkUnmapMemory( Common->getDevice(), Material.UniformBuffersMemory );
 
    void* light_data;
    vkMapMemory(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       Light.UniformBuffersMemory,
       0, sizeof( light ), 0, &light_data
    );
       std::memcpy( light_data, &light, sizeof( light ) );
-   vkUnmapMemory( CommonVK::getDevice(), Light.UniformBuffersMemory );
+   vkUnmapMemory( Common->getDevice(), Light.UniformBuffersMemory );
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include "parallel_renderer.h"
+
+FrameReorderBuffer::FrameReorderBuffer(uint32_t first_frame, uint32_t frame_count, size_t capacity, size_t frame_size) :
+   Aborted( false ), NextFrame( first_frame ), EndFrame( first_frame + frame_count ),
+   Capacity( std::max<size_t>( capacity, 1 ) ), FrameSize( frame_size )
+{
+}
+
+std::vector<uint8_t> FrameReorderBuffer::acquire(uint32_t frame_index)
+{
+   std::vector<uint8_t> frame;
+   {
+      std::unique_lock<std::mutex> lock(Mutex);
+      WindowMoved.wait( lock, [this, frame_index] { return Aborted || frame_index < NextFrame + Capacity; } );
+      if (Aborted) return {};
+      if (!FreeFrames.empty()) {
+         frame = std::move( FreeFrames.back() );
+         FreeFrames.pop_back();
+      }
+   }
+   frame.resize( FrameSize );
+   return frame;
+}
+
+void FrameReorderBuffer::push(uint32_t frame_index, std::vector<uint8_t> frame, FrameHints hints)
+{
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Frames[frame_index] = RenderedFrame{ std::move( frame ), std::move( hints ) };
+   }
+   FramePushed.notify_one();
+}
+
+bool FrameReorderBuffer::pop(std::vector<uint8_t>& frame, FrameHints& hints)
+{
+   std::unique_lock<std::mutex> lock(Mutex);
+   if (NextFrame == EndFrame) return false;
+
+   FramePushed.wait( lock, [this] { return Aborted || Frames.find( NextFrame ) != Frames.end(); } );
+   if (Aborted) return false;
+
+   auto it = Frames.find( NextFrame );
+   frame = std::move( it->second.Data );
+   hints = std::move( it->second.Hints );
+   Frames.erase( it );
+   NextFrame++;
+   lock.unlock();
+   WindowMoved.notify_all();
+   return true;
+}
+
+void FrameReorderBuffer::recycle(std::vector<uint8_t> frame)
+{
+   std::lock_guard<std::mutex> lock(Mutex);
+   FreeFrames.emplace_back( std::move( frame ) );
+}
+
+void FrameReorderBuffer::abort()
+{
+   {
+      std::lock_guard<std::mutex> lock(Mutex);
+      Aborted = true;
+   }
+   WindowMoved.notify_all();
+   FramePushed.notify_all();
+}
+
+bool FrameReorderBuffer::isComplete() const
+{
+   std::lock_guard<std::mutex> lock(Mutex);
+   return !Aborted && NextFrame == EndFrame;
+}
+
+ParallelRenderer::ParallelRenderer(std::shared_ptr<CommonVK> common, int worker_count) :
+   WorkerCount( std::max( worker_count, 1 ) ), Common( std::move( common ) )
+{
+}
+
+void ParallelRenderer::work(int worker_index, const RenderJob& job, FrameReorderBuffer& reorder_buffer)
+{
+   // The renderer is created and destroyed on this thread, which owns the pool of its command buffers.
+   try {
+      RendererVK renderer(Common);
+      renderer.resize( job.Width, job.Height );
+      if (!job.Scene.empty()) renderer.setTexture( job.Scene );
+      for (auto i = static_cast<uint32_t>(worker_index); i < job.FrameCount; i += static_cast<uint32_t>(WorkerCount)) {
+         std::vector<uint8_t> frame = reorder_buffer.acquire( job.FirstFrame + i );
+         if (frame.empty()) break;
+
+         FrameHints hints = renderer.renderFrame( job.FirstFrame + i, frame.data() );
+         reorder_buffer.push( job.FirstFrame + i, std::move( frame ), std::move( hints ) );
+      }
+   }
+   catch (const std::exception& exception) {
+      std::cerr << exception.what() << "\n";
+      reorder_buffer.abort();
+   }
+   // The renderer is gone, so nothing of this thread is pending anymore, and a later job runs on new threads.
+   Common->releaseCommandPool();
+}
+
+bool ParallelRenderer::render(const RenderJob& job)
+{
+   // This renderer never draws. It only provides the framerate and the encoder options of play().
+   RendererVK settings(Common);
+   settings.setEncoderOptions( job.getEncoderOptions() );
+   const std::shared_ptr<const CoreBudget> budget = CoreBudget::getProcessBudget();
+   const CoreBudget::Sample start = budget != nullptr ? CoreBudget::sample() : CoreBudget::Sample{};
+   const std::filesystem::path output_path =
+      job.Outputs.empty() ? std::filesystem::path(CMAKE_SOURCE_DIR) / (job.Name + job.getFileExtension()) :
+      job.Outputs.front().Path;
+   VideoWriter writer;
+   bool opened;
+   {
+      const CoreBudget::ScopedBinding binding(budget.get(), CoreBudget::Stage::Encoding);
+      opened = writer.open(
+         output_path,
+         static_cast<int>(job.Width),
+         static_cast<int>(job.Height),
+         settings.getFramerate(),
+         job.getCodecID(),
+         settings.getEncoderOptions(),
+         job.Muxer
+      );
+   }
+   if (!opened) return false;
+
+   // Two frames per renderer let each one start its next frame while the encoder still waits for another renderer.
+   const auto frame_size = static_cast<size_t>(av_image_get_buffer_size(
+      AV_PIX_FMT_RGBA, static_cast<int>(job.Width), static_cast<int>(((job.Height + 1u) >> 1u) << 1u), 1
+   ));
+   FrameReorderBuffer reorder_buffer(job.FirstFrame, job.FrameCount, static_cast<size_t>(WorkerCount) * 2, frame_size);
+   std::vector<std::thread> workers;
+   for (int i = 0; i < WorkerCount; ++i) {
+      workers.emplace_back( &ParallelRenderer::work, this, i, std::cref( job ), std::ref( reorder_buffer ) );
+   }
+
+   bool succeeded = true;
+   try {
+      std::vector<uint8_t> frame;
+      FrameHints hints;
+      uint32_t written_frames = 0;
+      while (reorder_buffer.pop( frame, hints )) {
+         writer.writeVideo( frame.data(), hints );
+         reorder_buffer.recycle( std::move( frame ) );
+         written_frames++;
+         if (Progress) Progress( written_frames, job.FrameCount );
+      }
+   }
+   catch (const std::exception& exception) {
+      std::cerr << exception.what() << "\n";
+      succeeded = false;
+      reorder_buffer.abort();
+   }
+   for (auto& worker : workers) worker.join();
+   writer.close();
+   if (budget != nullptr) budget->printUtilization( start, std::cerr );
+   return succeeded && reorder_buffer.isComplete();
+}
\ No newline at end of file
@@ -1,71 +1,47 @@
 #include "renderer.h"
 
-RendererVK::RendererVK() :
-   FrameWidth( 1280 ), FrameHeight( 720 ), FrameIndex( 0 ), Framerate( 30.0f ), Instance{},
-   ColorFormat( VK_FORMAT_R8G8B8A8_SRGB ), Framebuffer{}, Common( std::make_shared<CommonVK>() ), ColorAttachment{},
-   DepthAttachment{}, VertexBuffer{}, VertexBufferMemory{}, CommandBuffer{}, Fence{}
+RendererVK::RendererVK() : RendererVK( std::make_shared<CommonVK>() )
+{
+}
+
+RendererVK::RendererVK(std::shared_ptr<CommonVK> common) :
+   FrameWidth( 1280 ), FrameHeight( 720 ), FirstFrame( 0 ), FrameCount( 150 ), Framerate( 30.0f ),
+   ColorFormat( VK_FORMAT_R8G8B8A8_SRGB ), Framebuffer{}, UnlitPipeline{}, Common( std::move( common ) ),
+   ColorAttachment{}, DepthAttachment{}, Readback{}, FullReadbackNeeded( true ), ReadbackBytes( 0 ), VertexBuffer{},
+   VertexBufferMemory{}, CommandPool{}, CommandBuffer{}, LastSubmission( 0 ), ChunkEncoders( 0 ),
+   OutputPath( std::filesystem::path(CMAKE_SOURCE_DIR) / "result.mp4" ), VideoCodecID( AV_CODEC_ID_H264 ),
+   TexturePath( std::filesystem::path(CMAKE_SOURCE_DIR) / "emoy.png" ), Budget( CoreBudget::getProcessBudget() )
 {
 }
 
 RendererVK::~RendererVK()
 {
+   // Only the resources of this renderer are destroyed. The device goes with the last renderer sharing the context.
+   VkDevice device = Common->getDevice();
+   Common->wait( LastSubmission );
    UpperSquareObject.reset();
    LowerSquareObject.reset();
+   if (Shader != nullptr) Shader->savePipelineCache( std::filesystem::path(CMAKE_BINARY_DIR) / "pipeline.cache" );
    Shader.reset();
+   Assets.reset();
+   if (CommandBuffer == VK_NULL_HANDLE) return;
 
-   VkDevice device = CommonVK::getDevice();
-   vkDestroyFence( device, Fence, nullptr );
-   vkDestroyImageView( device, ColorAttachment.View, nullptr );
-   vkDestroyImage( device, ColorAttachment.Image, nullptr );
-   vkFreeMemory( device, ColorAttachment.Memory, nullptr );
-   vkDestroyImageView( device, DepthAttachment.View, nullptr );
-   vkDestroyImage( device, DepthAttachment.Image, nullptr );
-   vkFreeMemory( device, DepthAttachment.Memory, nullptr );
+   destroyFrameResources();
    vkDestroyBuffer( device, VertexBuffer, nullptr );
    vkFreeMemory( device, VertexBufferMemory, nullptr );
-   vkDestroyFramebuffer( device, Framebuffer, nullptr );
-   vkDestroyCommandPool( device, CommonVK::getCommandPool(), nullptr );
-   vkDestroyDevice( device, nullptr );
-#ifdef _DEBUG
-   destroyDebugUtilsMessengerEXT( Instance, DebugMessenger, nullptr );
-#endif
-   vkDestroyInstance( Instance, nullptr );
-}
-
-#ifdef _DEBUG
-void RendererVK::populateDebugMessengerCreateInfo(VkDebugUtilsMessengerCreateInfoEXT& create_info)
-{
-   create_info = {};
-   create_info.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-   create_info.messageSeverity =
-      VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT |
-      VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT |
-      VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-   create_info.messageType =
-      VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT |
-      VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT |
-      VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-   create_info.pfnUserCallback = debugCallback;
+   vkFreeCommandBuffers( device, CommandPool, 1, &CommandBuffer );
 }
 
-void RendererVK::setupDebugMessenger()
+void RendererVK::loadAssetBundle()
 {
-   VkDebugUtilsMessengerCreateInfoEXT create_info;
-   populateDebugMessengerCreateInfo( create_info );
-
-   const VkResult result = createDebugUtilsMessengerEXT(
-   Instance,
-   &create_info,
-   nullptr,
-   &DebugMessenger
-   );
-   if (result != VK_SUCCESS) throw std::runtime_error("failed to set up debug messenger!");
+   // The bundle is built by the assets target. Without it, every asset is loaded from its own file.
+   Assets = std::make_shared<AssetBundle>();
+   if (!Assets->open( std::filesystem::path(CMAKE_BINARY_DIR) / "assets.bundle" )) Assets.reset();
 }
-#endif
 
 void RendererVK::createImageViews()
 {
-   CommonVK::createImage(
+   Common->createImage(
       FrameWidth, FrameHeight,
       ColorFormat,
       VK_IMAGE_TILING_OPTIMAL,
@@ -91,7 +67,7 @@ void RendererVK::createImageViews()
    create_info.subresourceRange.layerCount = 1;
 
    const VkResult result = vkCreateImageView(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &create_info,
       nullptr,
       &ColorAttachment.View
@@ -101,30 +77,36 @@ void RendererVK::createImageViews()
 
 void RendererVK::createObject()
 {
-   UpperSquareObject = std::make_shared<ObjectVK>( Common.get() );
-   UpperSquareObject->setSquareObject( std::filesystem::path(CMAKE_SOURCE_DIR) / "emoy.png" );
+   UpperSquareObject = std::make_shared<ObjectVK>( Common.get(), Assets.get() );
+   UpperSquareObject->setSquareObject( TexturePath );
    UpperSquareObject->createDescriptorPool();
    UpperSquareObject->createUniformBuffers();
    UpperSquareObject->createDescriptorSets( Shader->getDescriptorSetLayout() );
+   UpperSquareObject->setPriority( 0.5f );
 
-   LowerSquareObject = std::make_shared<ObjectVK>( Common.get() );
-   LowerSquareObject->setSquareObject( std::filesystem::path(CMAKE_SOURCE_DIR) / "emoy.png" );
+   LowerSquareObject = std::make_shared<ObjectVK>( Common.get(), Assets.get() );
+   LowerSquareObject->setSquareObject( TexturePath );
    LowerSquareObject->createDescriptorPool();
    LowerSquareObject->createUniformBuffers();
    LowerSquareObject->createDescriptorSets( Shader->getDescriptorSetLayout() );
+   LowerSquareObject->setPriority( 0.5f );
 }
 
 void RendererVK::createGraphicsPipeline()
 {
-   Shader = std::make_shared<ShaderVK>( Common.get() );
+   Shader = std::make_shared<ShaderVK>( Common.get(), Assets.get() );
    Shader->createRenderPass( ColorFormat );
    Shader->createDescriptorSetLayout();
    Shader->createGraphicsPipeline(
       std::filesystem::path(CMAKE_SOURCE_DIR) / "shaders/shader.vert.spv",
       std::filesystem::path(CMAKE_SOURCE_DIR) / "shaders/shader.frag.spv",
       ObjectVK::getBindingDescription(),
-      ObjectVK::getAttributeDescriptions(),
-      { FrameWidth, FrameHeight }
+      ObjectVK::getAttributeDescriptions()
+   );
+   // The upper square is drawn without lighting. Only its fragment shader is compiled, the rest of the pipeline is
+   // shared with the lit one.
+   UnlitPipeline = Shader->createFragmentVariant(
+      std::filesystem::path(CMAKE_SOURCE_DIR) / "shaders/unlit.frag.spv"
    );
 }
 
@@ -141,7 +123,7 @@ void RendererVK::createFramebuffers()
    framebuffer_info.layers = 1;
 
    const VkResult result = vkCreateFramebuffer(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &framebuffer_info,
       nullptr,
       &Framebuffer
@@ -151,8 +133,8 @@ void RendererVK::createFramebuffers()
 
 void RendererVK::createDepthResources()
 {
-   VkFormat depth_format = CommonVK::findDepthFormat();
-   CommonVK::createImage(
+   VkFormat depth_format = Common->findDepthFormat();
+   Common->createImage(
       FrameWidth, FrameHeight,
       depth_format,
       VK_IMAGE_TILING_OPTIMAL,
@@ -161,23 +143,128 @@ void RendererVK::createDepthResources()
       DepthAttachment.Image,
       DepthAttachment.Memory
    );
-   DepthAttachment.View = CommonVK::createImageView(
+   DepthAttachment.View = Common->createImageView(
       DepthAttachment.Image,
       depth_format,
       VK_IMAGE_ASPECT_DEPTH_BIT
    );
 }
 
+void RendererVK::createReadbackSlot()
+{
+   Common->createImage(
+      FrameWidth, FrameHeight,
+      ColorFormat,
+      VK_IMAGE_TILING_LINEAR,
+      VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+      Readback.Image,
+      Readback.Memory
+   );
+
+   VkImageSubresource subresource{};
+   subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+   vkGetImageSubresourceLayout(
+      Common->getDevice(),
+      Readback.Image,
+      &subresource,
+      &Readback.Layout
+   );
+
+   // The readback image stays mapped for its whole lifetime, so no frame has to map or allocate anything.
+   void* data;
+   vkMapMemory(
+      Common->getDevice(),
+      Readback.Memory,
+      0,
+      VK_WHOLE_SIZE,
+      0,
+      &data
+   );
+   Readback.Data = static_cast<uint8_t*>(data) + Readback.Layout.offset;
+
+   // The copies of every frame write to the image in the general layout, so that they need no transition.
+   VkCommandBuffer command_buffer = Common->createCommandBuffer( VK_COMMAND_BUFFER_LEVEL_PRIMARY );
+   CommonVK::insertImageMemoryBarrier(
+      command_buffer,
+      Readback.Image,
+      0,
+      VK_ACCESS_TRANSFER_WRITE_BIT,
+      VK_IMAGE_LAYOUT_UNDEFINED,
+      VK_IMAGE_LAYOUT_GENERAL,
+      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
+   );
+   Common->flushCommandBuffer( command_buffer );
+   FullReadbackNeeded = true;
+}
+
+void RendererVK::createFrameResources()
+{
+   createImageViews();
+   createDepthResources();
+   createFramebuffers();
+   createReadbackSlot();
+}
+
+void RendererVK::destroyFrameResources()
+{
+   VkDevice device = Common->getDevice();
+   if (Readback.Memory != VK_NULL_HANDLE) vkUnmapMemory( device, Readback.Memory );
+   vkFreeMemory( device, Readback.Memory, nullptr );
+   vkDestroyImage( device, Readback.Image, nullptr );
+   vkDestroyFramebuffer( device, Framebuffer, nullptr );
+   vkDestroyImageView( device, ColorAttachment.View, nullptr );
+   vkDestroyImage( device, ColorAttachment.Image, nullptr );
+   vkFreeMemory( device, ColorAttachment.Memory, nullptr );
+   vkDestroyImageView( device, DepthAttachment.View, nullptr );
+   vkDestroyImage( device, DepthAttachment.Image, nullptr );
+   vkFreeMemory( device, DepthAttachment.Memory, nullptr );
+   Readback = {};
+   Framebuffer = VK_NULL_HANDLE;
+   ColorAttachment = {};
+   DepthAttachment = {};
+}
+
+void RendererVK::resize(uint32_t width, uint32_t height)
+{
+   if (width == FrameWidth && height == FrameHeight) return;
+
+   FrameWidth = width;
+   FrameHeight = height;
+   if (CommandBuffer == VK_NULL_HANDLE) return;
+
+   // The device, pipelines and scene objects do not depend on the render target size,
+   // so only the attachments and the readback slot are recreated.
+   Common->wait( LastSubmission );
+   destroyFrameResources();
+   createFrameResources();
+}
+
+void RendererVK::setTexture(const std::filesystem::path& texture_path)
+{
+   if (texture_path == TexturePath) return;
+
+   TexturePath = texture_path;
+   if (CommandBuffer == VK_NULL_HANDLE) return;
+
+   // The squares keep their geometry, so the vertex buffer is still valid for the new objects.
+   Common->wait( LastSubmission );
+   createObject();
+   FullReadbackNeeded = true;
+}
+
 void RendererVK::copyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size)
 {
    VkCommandBufferAllocateInfo allocate_info{};
    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-   allocate_info.commandPool = CommonVK::getCommandPool();
+   allocate_info.commandPool = Common->getCommandPool();
    allocate_info.commandBufferCount = 1;
 
    VkCommandBuffer command_buffer;
-   vkAllocateCommandBuffers( CommonVK::getDevice(), &allocate_info, &command_buffer );
+   vkAllocateCommandBuffers( Common->getDevice(), &allocate_info, &command_buffer );
 
    VkCommandBufferBeginInfo begin_info{};
    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -198,12 +285,11 @@ void RendererVK::copyBuffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSi
    submit_info.commandBufferCount = 1;
    submit_info.pCommandBuffers = &command_buffer;
 
-   vkQueueSubmit( CommonVK::getGraphicsQueue(), 1, &submit_info, VK_NULL_HANDLE );
-   vkQueueWaitIdle( CommonVK::getGraphicsQueue() );
+   Common->submitAndWait( submit_info );
 
    vkFreeCommandBuffers(
-      CommonVK::getDevice(),
-      CommonVK::getCommandPool(),
+      Common->getDevice(),
+      Common->getCommandPool(),
       1,
       &command_buffer
    );
@@ -214,7 +300,7 @@ void RendererVK::createVertexBuffer()
    VkBuffer staging_buffer;
    VkDeviceMemory staging_buffer_memory;
    const VkDeviceSize buffer_size = LowerSquareObject->getVertexBufferSize();
-   CommonVK::createBuffer(
+   Common->createBuffer(
       buffer_size,
       VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -224,14 +310,14 @@ void RendererVK::createVertexBuffer()
 
    void* data;
    vkMapMemory(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       staging_buffer_memory,
       0, buffer_size, 0, &data
    );
       memcpy( data, LowerSquareObject->getVertexData(), static_cast<size_t>(buffer_size) );
-   vkUnmapMemory( CommonVK::getDevice(), staging_buffer_memory );
+   vkUnmapMemory( Common->getDevice(), staging_buffer_memory );
 
-   CommonVK::createBuffer(
+   Common->createBuffer(
       buffer_size,
       VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
@@ -240,72 +326,147 @@ void RendererVK::createVertexBuffer()
    );
    copyBuffer( staging_buffer, VertexBuffer, buffer_size );
 
-   vkDestroyBuffer( CommonVK::getDevice(), staging_buffer, nullptr );
-   vkFreeMemory( CommonVK::getDevice(), staging_buffer_memory, nullptr );
+   vkDestroyBuffer( Common->getDevice(), staging_buffer, nullptr );
+   vkFreeMemory( Common->getDevice(), staging_buffer_memory, nullptr );
 }
 
 void RendererVK::createCommandBuffer()
 {
+   CommandPool = Common->getCommandPool();
    VkCommandBufferAllocateInfo allocate_info{};
    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-   allocate_info.commandPool = CommonVK::getCommandPool();
+   allocate_info.commandPool = CommandPool;
    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
    allocate_info.commandBufferCount = 1;
 
    const VkResult result = vkAllocateCommandBuffers(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &allocate_info,
       &CommandBuffer
    );
    if (result != VK_SUCCESS) throw std::runtime_error("failed to allocate command buffers!");
 }
 
-void RendererVK::createSyncObjects()
+EncoderOptions RendererVK::getEncoderOptions() const
 {
-   VkFenceCreateInfo fence_info{};
-   fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-   fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-   const VkResult fence_result = vkCreateFence(
-      CommonVK::getDevice(),
-      &fence_info,
-      nullptr,
-      &Fence
-   );
-   if (fence_result != VK_SUCCESS) throw std::runtime_error("failed to create synchronization objects for a frame!");
+   // The marked cuts already place the keyframes where the content changes, so x264 does not have to look for them
+   // and the GOPs in between can be longer.
+   EncoderOptions options = BaseEncoderOptions;
+   if (Budget != nullptr && options.ThreadCount == 0) {
+      options.ThreadCount = Budget->getThreadCount( CoreBudget::Stage::Encoding );
+   }
+   if (!SceneCuts.empty()) {
+      options.SceneCutDetection = false;
+      options.GOPSize = std::max( static_cast<int>(std::lround( Framerate * 5.0f )), options.GOPSize );
+   }
+   return options;
 }
 
 void RendererVK::createRecorder()
 {
+   // The encoders start their threads when they are opened, and the threads stay on the cores of this thread.
+   const CoreBudget::ScopedBinding binding(Budget.get(), CoreBudget::Stage::Encoding);
+   if (!Renditions.empty()) {
+      // The renditions encode at the same time, so they share the encoding threads.
+      std::vector<Rendition> renditions = Renditions;
+      if (Budget != nullptr) {
+         const int thread_count = Budget->getThreadCount( CoreBudget::Stage::Encoding );
+         for (auto& rendition : renditions) {
+            if (rendition.Options.ThreadCount == 0) {
+               rendition.Options.ThreadCount = std::max( thread_count / static_cast<int>(renditions.size()), 1 );
+            }
+         }
+      }
+      Ladder = std::make_shared<RenditionLadder>();
+      const bool result = Ladder->open(
+         renditions,
+         static_cast<int>(FrameWidth),
+         static_cast<int>(FrameHeight),
+         Framerate,
+         VideoCodecID
+      );
+      if (!result) throw std::runtime_error("Could not write video");
+      return;
+   }
+
+   if (ChunkEncoders > 0) {
+      // The chunk encoders run at the same time, so they share the encoding threads.
+      EncoderOptions options = getEncoderOptions();
+      if (Budget != nullptr) options.ThreadCount = std::max( options.ThreadCount / ChunkEncoders, 1 );
+      ChunkedRecorder = std::make_shared<ParallelVideoWriter>();
+      const bool result = ChunkedRecorder->open(
+         OutputPath,
+         static_cast<int>(FrameWidth),
+         static_cast<int>(FrameHeight),
+         Framerate,
+         VideoCodecID,
+         options,
+         Muxer,
+         ChunkEncoders
+      );
+      if (!result) throw std::runtime_error("Could not write video");
+      return;
+   }
+
    Recorder = std::make_shared<VideoWriter>();
-   const std::string output_file_path = std::string(CMAKE_SOURCE_DIR) + "/result.mp4";
    const bool result = Recorder->open(
-      output_file_path,
+      OutputPath,
       static_cast<int>(FrameWidth),
       static_cast<int>(FrameHeight),
       Framerate,
-      AV_CODEC_ID_H264
+      VideoCodecID,
+      getEncoderOptions(),
+      Muxer
    );
    if (!result) throw std::runtime_error("Could not write video");
 }
 
+void RendererVK::closeRecorder()
+{
+   // The throughput is part of the statistics, so it is only reported for a video whose statistics are collected.
+   const auto print_throughput = [](const std::string& name, const EncoderThroughput& throughput) {
+      std::cerr << name << ": " << throughput.Frames << " frames, " << throughput.DuplicateFrames << " duplicates, "
+         << std::fixed << std::setprecision( 1 ) << throughput.getFramesPerSecond() << " fps (conversion "
+         << throughput.ConversionSeconds << " s, encoding " << throughput.EncodingSeconds << " s, "
+         << static_cast<double>(throughput.Bytes) / (1024.0 * 1024.0) << " MiB)\n";
+   };
+
+   if (Ladder != nullptr) {
+      Ladder->close();
+      for (size_t i = 0; i < Ladder->getRenditionCount(); ++i) {
+         if (Renditions[i].Options.StatisticsFilePath.empty()) continue;
+         print_throughput( Renditions[i].FilePath.filename().string(), Ladder->getThroughput( i ) );
+      }
+      Ladder.reset();
+   }
+   if (Recorder != nullptr) {
+      Recorder->close();
+      if (!BaseEncoderOptions.StatisticsFilePath.empty()) {
+         print_throughput( OutputPath.filename().string(), Recorder->getThroughput() );
+      }
+      Recorder.reset();
+   }
+   if (ChunkedRecorder != nullptr) {
+      ChunkedRecorder->close();
+      ChunkedRecorder.reset();
+   }
+}
+
 void RendererVK::initializeVulkan()
 {
-   createInstance();
-#ifdef _DEBUG
-   setupDebugMessenger();
-#endif
-   Common->pickPhysicalDevice( Instance );
-   Common->createLogicalDevice();
-   Common->createCommandPool();
-   createImageViews();
+   if (Budget != nullptr) {
+      // llvmpipe starts its rasterizer threads with the device, so they stay on the cores bound here.
+      Budget->limitRasterizerThreads();
+      const CoreBudget::ScopedBinding binding(Budget.get(), CoreBudget::Stage::Rasterization);
+      Common->initialize( DeviceChoice );
+   }
+   else Common->initialize( DeviceChoice );
+   loadAssetBundle();
    createGraphicsPipeline();
    createObject();
-   createDepthResources();
-   createFramebuffers();
+   createFrameResources();
    createVertexBuffer();
    createCommandBuffer();
-   createSyncObjects();
-   createRecorder();
 }
 
 void RendererVK::recordCommandBuffer(VkCommandBuffer command_buffer)
@@ -340,6 +501,21 @@ void RendererVK::recordCommandBuffer(VkCommandBuffer command_buffer)
          VK_PIPELINE_BIND_POINT_GRAPHICS,
          Shader->getGraphicsPipeline()
       );
+
+      VkViewport viewport{};
+      viewport.x = 0.0f;
+      viewport.y = 0.0f;
+      viewport.width = static_cast<float>(FrameWidth);
+      viewport.height = static_cast<float>(FrameHeight);
+      viewport.minDepth = 0.0f;
+      viewport.maxDepth = 1.0f;
+      vkCmdSetViewport( command_buffer, 0, 1, &viewport );
+
+      VkRect2D scissor{};
+      scissor.offset = { 0, 0 };
+      scissor.extent = { FrameWidth, FrameHeight };
+      vkCmdSetScissor( command_buffer, 0, 1, &scissor );
+
       const std::array<VkBuffer, 1> vertex_buffers = { VertexBuffer };
       constexpr std::array<VkDeviceSize, 1> offsets = { 0 };
       vkCmdBindVertexBuffers(
@@ -360,6 +536,11 @@ void RendererVK::recordCommandBuffer(VkCommandBuffer command_buffer)
          1, 0, 0
       );
 
+      vkCmdBindPipeline(
+         command_buffer,
+         VK_PIPELINE_BIND_POINT_GRAPHICS,
+         UnlitPipeline
+      );
       vkCmdBindDescriptorSets(
          command_buffer,
          VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -373,27 +554,23 @@ void RendererVK::recordCommandBuffer(VkCommandBuffer command_buffer)
          1, 0, 0
       );
    vkCmdEndRenderPass( command_buffer );
+   recordReadback( command_buffer );
 
    if (vkEndCommandBuffer( command_buffer ) != VK_SUCCESS) {
       throw std::runtime_error( "failed to record command buffer!");
    }
 }
 
-void RendererVK::drawFrame()
+void RendererVK::drawFrame(uint32_t frame_index)
 {
-   vkWaitForFences(
-      CommonVK::getDevice(),
-      1,
-      &Fence,
-      VK_TRUE,
-      UINT64_MAX
-   );
+   // The command buffer and the uniform buffers are reused, so the previous frame has to be complete.
+   Common->wait( LastSubmission );
 
    const glm::mat4 lower_world =
       glm::translate( glm::mat4(1.0f), glm::vec3(-0.25f, 0.0f, 0.0f) ) *
       glm::rotate(
          glm::mat4(1.0f),
-         glm::radians( static_cast<float>(FrameIndex) * 5.0f ),
+         glm::radians( static_cast<float>(frame_index) * 5.0f ),
          glm::vec3(0.0f, 1.0f, 0.0f)
       ) * glm::translate( glm::mat4(1.0f), glm::vec3(-0.5f, -0.5f, 0.0f) );
    const glm::mat4 upper_world =
@@ -401,7 +578,6 @@ void RendererVK::drawFrame()
    LowerSquareObject->updateUniformBuffer( { FrameWidth, FrameHeight }, lower_world );
    UpperSquareObject->updateUniformBuffer( { FrameWidth, FrameHeight }, upper_world );
 
-   vkResetFences( CommonVK::getDevice(), 1, &Fence );
    vkResetCommandBuffer( CommandBuffer, 0 );
    recordCommandBuffer( CommandBuffer );
 
@@ -410,272 +586,187 @@ void RendererVK::drawFrame()
    submit_info.commandBufferCount = 1;
    submit_info.pCommandBuffers = &CommandBuffer;
 
-   const VkResult result = vkQueueSubmit(
-      CommonVK::getGraphicsQueue(),
-      1,
-      &submit_info,
-      Fence
-   );
-   if (result != VK_SUCCESS) throw std::runtime_error("failed to submit draw command buffer!");
+   LastSubmission = Common->submit( submit_info );
 }
 
-std::vector<const char*> RendererVK::getRequiredExtensions()
+std::vector<VkRect2D> RendererVK::collectDamageRegions() const
 {
-   std::vector<const char*> extensions;
-#ifdef _DEBUG
-   extensions.push_back( VK_EXT_DEBUG_UTILS_EXTENSION_NAME );
-#endif
-   return extensions;
-}
-
-void RendererVK::createInstance()
-{
-#ifdef _DEBUG
-   if (!CommonVK::checkValidationLayerSupport()) {
-      throw std::runtime_error("validation layers requested, but not available!");
-   }
-#endif
-
-   VkApplicationInfo application_info{};
-   application_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-   application_info.pApplicationName = "Hello Vulkan";
-   application_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
-   application_info.pEngineName = "No Engine";
-   application_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-   application_info.apiVersion = VK_API_VERSION_1_0;
-
-   VkInstanceCreateInfo create_info{};
-   create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-   create_info.pApplicationInfo = &application_info;
-
-   std::vector<const char*> extensions = getRequiredExtensions();
-   create_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
-   create_info.ppEnabledExtensionNames = extensions.data();
-
-#ifdef NDEBUG
-   create_info.enabledLayerCount = 0;
-   create_info.pNext = nullptr;
-#else
-   create_info.enabledLayerCount = CommonVK::getValidationLayerSize();
-   create_info.ppEnabledLayerNames = CommonVK::getValidationLayerNames();
-
-   VkDebugUtilsMessengerCreateInfoEXT debug_create_info{};
-   populateDebugMessengerCreateInfo( debug_create_info );
-   create_info.pNext = static_cast<VkDebugUtilsMessengerCreateInfoEXT*>(&debug_create_info);
-#endif
-
-   if (vkCreateInstance( &create_info, nullptr, &Instance ) != VK_SUCCESS) {
-      throw std::runtime_error("failed to create Instance!");
+   if (FullReadbackNeeded) return { VkRect2D{ { 0, 0 }, { FrameWidth, FrameHeight } } };
+
+   std::vector<VkRect2D> regions;
+   for (const auto& object : { LowerSquareObject, UpperSquareObject }) {
+      VkRect2D region = object->getDamageRegion();
+      if (CommonVK::isRectEmpty( region )) continue;
+
+      // Overlapping regions are merged, so that no pixel is copied twice and the copies stay few.
+      bool merged = true;
+      while (merged) {
+         merged = false;
+         for (auto it = regions.begin(); it != regions.end(); ++it) {
+            if (CommonVK::areRectsOverlapping( *it, region )) {
+               region = CommonVK::uniteRects( *it, region );
+               regions.erase( it );
+               merged = true;
+               break;
+            }
+         }
+      }
+      regions.emplace_back( region );
    }
+   return regions;
 }
 
-void RendererVK::writeFrame()
+void RendererVK::recordReadback(VkCommandBuffer command_buffer)
 {
-   VkImage dst_image;
-   VkDeviceMemory dst_image_memory;
-   CommonVK::createImage(
-      FrameWidth, FrameHeight,
-      ColorFormat,
-      VK_IMAGE_TILING_LINEAR,
-      VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-      dst_image,
-      dst_image_memory
-   );
-
-   VkCommandBuffer copy_command = CommonVK::createCommandBuffer( VK_COMMAND_BUFFER_LEVEL_PRIMARY );
-
-   CommonVK::insertImageMemoryBarrier(
-      copy_command,
-      dst_image,
-      0,
-      VK_ACCESS_TRANSFER_WRITE_BIT,
-      VK_IMAGE_LAYOUT_UNDEFINED,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-   );
-
-   VkImageCopy image_copy_region{};
-   image_copy_region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   image_copy_region.srcSubresource.layerCount = 1;
-   image_copy_region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   image_copy_region.dstSubresource.layerCount = 1;
-   image_copy_region.extent.width = FrameWidth;
-   image_copy_region.extent.height = FrameHeight;
-   image_copy_region.extent.depth = 1;
+   // The render pass clears the background to the same color every frame, so a pixel changes only where an object
+   // was or is now. Everything else in the readback image is still the previous frame.
+   const std::vector<VkRect2D> regions = collectDamageRegions();
+   if (regions.empty()) return;
+
+   std::vector<VkImageCopy> image_copy_regions(regions.size());
+   for (size_t i = 0; i < regions.size(); ++i) {
+      VkImageCopy& image_copy_region = image_copy_regions[i];
+      image_copy_region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      image_copy_region.srcSubresource.layerCount = 1;
+      image_copy_region.srcOffset = { regions[i].offset.x, regions[i].offset.y, 0 };
+      image_copy_region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+      image_copy_region.dstSubresource.layerCount = 1;
+      image_copy_region.dstOffset = image_copy_region.srcOffset;
+      image_copy_region.extent.width = regions[i].extent.width;
+      image_copy_region.extent.height = regions[i].extent.height;
+      image_copy_region.extent.depth = 1;
+      ReadbackBytes += static_cast<uint64_t>(regions[i].extent.width) * regions[i].extent.height * 4;
+   }
 
+   // The render pass makes the color attachment available to the copy, and the host is done with the readback
+   // image before the frame is submitted, so the only barrier needed is the one handing the copy to the host.
    vkCmdCopyImage(
-      copy_command,
+      command_buffer,
       ColorAttachment.Image,
       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-      dst_image,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      1,
-      &image_copy_region
+      Readback.Image,
+      VK_IMAGE_LAYOUT_GENERAL,
+      static_cast<uint32_t>(image_copy_regions.size()),
+      image_copy_regions.data()
    );
 
    CommonVK::insertImageMemoryBarrier(
-      copy_command,
-      dst_image,
+      command_buffer,
+      Readback.Image,
       VK_ACCESS_TRANSFER_WRITE_BIT,
-      VK_ACCESS_MEMORY_READ_BIT,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      VK_ACCESS_HOST_READ_BIT,
+      VK_IMAGE_LAYOUT_GENERAL,
       VK_IMAGE_LAYOUT_GENERAL,
       VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_HOST_BIT,
       VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
    );
+   FullReadbackNeeded = false;
+}
 
-   CommonVK::flushCommandBuffer( copy_command );
-
-   VkImageSubresource subresource{};
-   subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   VkSubresourceLayout subresource_layout;
-   vkGetImageSubresourceLayout(
-      CommonVK::getDevice(),
-      dst_image,
-      &subresource,
-      &subresource_layout
-   );
+void RendererVK::readbackFrame()
+{
+   // The copy is part of the frame submission, so the readback image is ready once the frame is complete.
+   Common->wait( LastSubmission );
+}
 
-   uint8_t* image_data;
-   vkMapMemory(
-      CommonVK::getDevice(),
-      dst_image_memory,
-      0,
-      VK_WHOLE_SIZE,
-      0,
-      (void**)&image_data
-   );
-   image_data += subresource_layout.offset;
+void RendererVK::writeFrame(uint32_t frame_index)
+{
+   readbackFrame();
 
-   uint8_t* inverted_data = image_data;
+   uint8_t* inverted_data = Readback.Data;
    for (int32_t y = 0; y < FrameHeight; ++y) {
       auto* row = (unsigned int*)inverted_data;
       for (int32_t x = 0; x < FrameWidth; ++x) {
          std::swap( *(char*)row, *((char*)row + 2) );
          row++;
       }
-      inverted_data += subresource_layout.rowPitch;
+      inverted_data += Readback.Layout.rowPitch;
    }
 
    const std::string file_name =
-      std::string(CMAKE_SOURCE_DIR) + "/frame[" + std::to_string( FrameIndex ) + "].png";
+      std::string(CMAKE_SOURCE_DIR) + "/frame[" + std::to_string( frame_index ) + "].png";
    FIBITMAP* image = FreeImage_ConvertFromRawBits(
-      image_data,
+      Readback.Data,
       static_cast<int>(FrameWidth),
       static_cast<int>(FrameHeight),
-      static_cast<int>(FrameWidth) * 4,
+      static_cast<int>(Readback.Layout.rowPitch),
       32,
       FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, true
    );
    FreeImage_Save( FIF_PNG, image, file_name.c_str() );
    FreeImage_Unload( image );
 
-   vkUnmapMemory( CommonVK::getDevice(), dst_image_memory );
-   vkFreeMemory( CommonVK::getDevice(), dst_image_memory, nullptr );
-   vkDestroyImage( CommonVK::getDevice(), dst_image, nullptr );
+   // The channels were swapped in place, so the next frame cannot build on this one.
+   FullReadbackNeeded = true;
 }
 
-void RendererVK::writeVideo()
+FrameHints RendererVK::getFrameHints(uint32_t frame_index) const
 {
-   VkImage dst_image;
-   VkDeviceMemory dst_image_memory;
-   CommonVK::createImage(
-      FrameWidth, FrameHeight,
-      ColorFormat,
-      VK_IMAGE_TILING_LINEAR,
-      VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-      dst_image,
-      dst_image_memory
-   );
-
-   VkCommandBuffer copy_command = CommonVK::createCommandBuffer( VK_COMMAND_BUFFER_LEVEL_PRIMARY );
-
-   CommonVK::insertImageMemoryBarrier(
-      copy_command,
-      dst_image,
-      0,
-      VK_ACCESS_TRANSFER_WRITE_BIT,
-      VK_IMAGE_LAYOUT_UNDEFINED,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-   );
-
-   VkImageCopy image_copy_region{};
-   image_copy_region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   image_copy_region.srcSubresource.layerCount = 1;
-   image_copy_region.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   image_copy_region.dstSubresource.layerCount = 1;
-   image_copy_region.extent.width = FrameWidth;
-   image_copy_region.extent.height = FrameHeight;
-   image_copy_region.extent.depth = 1;
-
-   vkCmdCopyImage(
-      copy_command,
-      ColorAttachment.Image,
-      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-      dst_image,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      1,
-      &image_copy_region
-   );
-
-   CommonVK::insertImageMemoryBarrier(
-      copy_command,
-      dst_image,
-      VK_ACCESS_TRANSFER_WRITE_BIT,
-      VK_ACCESS_MEMORY_READ_BIT,
-      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-      VK_IMAGE_LAYOUT_GENERAL,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VK_PIPELINE_STAGE_TRANSFER_BIT,
-      VkImageSubresourceRange{ VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 }
-   );
-
-   CommonVK::flushCommandBuffer( copy_command );
+   FrameHints hints;
+   hints.Keyframe = SceneCuts.find( frame_index ) != SceneCuts.end();
+   // The upper square is drawn last, so it comes first where the squares overlap.
+   for (const auto& object : { UpperSquareObject, LowerSquareObject }) {
+      const VkRect2D bounds = object->getScreenBounds();
+      if (object->getPriority() == 0.0f || CommonVK::isRectEmpty( bounds )) continue;
+
+      hints.Regions.push_back(
+         {
+            bounds.offset.x, bounds.offset.y,
+            static_cast<int>(bounds.extent.width), static_cast<int>(bounds.extent.height),
+            object->getPriority()
+         }
+      );
+   }
+   return hints;
+}
 
-   VkImageSubresource subresource{};
-   subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-   VkSubresourceLayout subresource_layout;
-   vkGetImageSubresourceLayout(
-      CommonVK::getDevice(),
-      dst_image,
-      &subresource,
-      &subresource_layout
-   );
+void RendererVK::writeVideo(uint32_t frame_index)
+{
+   readbackFrame();
 
-   uint8_t* image_data;
-   vkMapMemory(
-      CommonVK::getDevice(),
-      dst_image_memory,
-      0,
-      VK_WHOLE_SIZE,
-      0,
-      (void**)&image_data
-   );
-   image_data += subresource_layout.offset;
+   const FrameHints hints = getFrameHints( frame_index );
+   if (Ladder != nullptr) Ladder->writeVideo( Readback.Data, hints );
+   else if (ChunkedRecorder != nullptr) ChunkedRecorder->writeVideo( Readback.Data, hints );
+   else Recorder->writeVideo( Readback.Data, hints );
+}
 
-   Recorder->writeVideo( image_data );
+FrameHints RendererVK::renderFrame(uint32_t frame_index, uint8_t* frame)
+{
+   if (CommandBuffer == VK_NULL_HANDLE) initializeVulkan();
 
-   vkUnmapMemory( CommonVK::getDevice(), dst_image_memory );
-   vkFreeMemory( CommonVK::getDevice(), dst_image_memory, nullptr );
-   vkDestroyImage( CommonVK::getDevice(), dst_image, nullptr );
+   drawFrame( frame_index );
+   readbackFrame();
+   const size_t row_size = static_cast<size_t>(FrameWidth) * 4;
+   for (uint32_t y = 0; y < FrameHeight; ++y) {
+      std::memcpy( frame + y * row_size, Readback.Data + y * Readback.Layout.rowPitch, row_size );
+   }
+   return getFrameHints( frame_index );
 }
 
 void RendererVK::play()
 {
-   initializeVulkan();
-   while (FrameIndex < 150) {
-      drawFrame();
-      writeVideo();
-      FrameIndex++;
+   if (CommandBuffer == VK_NULL_HANDLE) initializeVulkan();
+   // The renderer thread only reads back and hands the frames over while it plays. It gets its cores back afterwards,
+   // and a renderer driven by renderFrame() stays on the cores its caller chose.
+   const CoreBudget::ScopedBinding binding(Budget.get(), CoreBudget::Stage::IO);
+
+   FullReadbackNeeded = true;
+   ReadbackBytes = 0;
+   const CoreBudget::Sample start = Budget != nullptr ? CoreBudget::sample() : CoreBudget::Sample{};
+   createRecorder();
+   for (uint32_t i = 0; i < FrameCount; ++i) {
+      drawFrame( FirstFrame + i );
+      writeVideo( FirstFrame + i );
+      if (Progress) Progress( i + 1, FrameCount );
    }
-   Recorder->close();
-   vkDeviceWaitIdle( CommonVK::getDevice() );
+   closeRecorder();
+   Common->wait( LastSubmission );
+
+   const uint64_t full_bytes = static_cast<uint64_t>(FrameWidth) * FrameHeight * 4 * FrameCount;
+   std::cerr << "readback: " << ReadbackBytes / (1024 * 1024) << " MiB of " << full_bytes / (1024 * 1024)
+      << " MiB (" << std::fixed << std::setprecision( 1 )
+      << (full_bytes > 0 ? 100.0 * static_cast<double>(ReadbackBytes) / static_cast<double>(full_bytes) : 0.0)
+      << "%)\n";
+   if (Budget != nullptr) Budget->printUtilization( start, std::cerr );
 }
\ No newline at end of file
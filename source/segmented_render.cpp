@@ -0,0 +1,274 @@
+#include "segmented_render.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace
+{
+   // A single write to a file opened with O_APPEND is not interleaved with the writes of other processes.
+   bool appendLine(const std::filesystem::path& file_path, const std::string& line, int flags)
+   {
+      const int file_descriptor = ::open( file_path.c_str(), O_WRONLY | O_CLOEXEC | flags, 0644 );
+      if (file_descriptor < 0) return false;
+
+      const std::string data = line + "\n";
+      const bool written = ::write( file_descriptor, data.data(), data.size() ) == static_cast<ssize_t>(data.size());
+      const bool synced = fsync( file_descriptor ) == 0;
+      ::close( file_descriptor );
+      return written && synced;
+   }
+
+   bool syncFile(const std::filesystem::path& file_path)
+   {
+      const int file_descriptor = ::open( file_path.c_str(), O_RDONLY | O_CLOEXEC );
+      if (file_descriptor < 0) return false;
+
+      const bool synced = fsync( file_descriptor ) == 0;
+      ::close( file_descriptor );
+      return synced;
+   }
+}
+
+RenderManifest::RenderManifest(std::filesystem::path manifest_path, const RenderJob& job) :
+   ManifestPath( std::move( manifest_path ) )
+{
+   if (job.SegmentFrames == 0) throw std::runtime_error("a segmented job needs a segment length");
+
+   // Segments of another range, size or length would not fit together, so the header has to match to resume.
+   Header = "offscreen-vulkan-manifest 1 frames " + std::to_string( job.FirstFrame ) + "+" +
+      std::to_string( job.FrameCount ) + " segment " + std::to_string( job.SegmentFrames ) + " size " +
+      std::to_string( job.Width ) + "x" + std::to_string( job.Height );
+   // Segments encoded at another size or bitrate would not fit together either.
+   if (!job.Outputs.empty() && (job.Outputs.front().Width > 0 || job.Outputs.front().Bitrate > 0)) {
+      const RenderOutput& output = job.Outputs.front();
+      Header += " output " + std::to_string( output.Width ) + "x" + std::to_string( output.Height ) + "@" +
+         std::to_string( output.Bitrate );
+   }
+   if (job.Codec != "h264") Header += " codec " + job.Codec;
+   for (uint32_t offset = 0; offset < job.FrameCount; offset += job.SegmentFrames) {
+      Segments.push_back( { job.FirstFrame + offset, std::min( job.SegmentFrames, job.FrameCount - offset ) } );
+   }
+}
+
+void RenderManifest::load()
+{
+   std::filesystem::create_directories( std::filesystem::path(ManifestPath).replace_extension( ".segments" ) );
+   if (!std::filesystem::exists( ManifestPath ) && !appendLine( ManifestPath, Header, O_CREAT | O_EXCL )) {
+      throw std::runtime_error("could not create " + ManifestPath.string());
+   }
+
+   std::ifstream file(ManifestPath);
+   std::string line;
+   if (!std::getline( file, line ) || line != Header) {
+      throw std::runtime_error(ManifestPath.string() + " was written for another job");
+   }
+
+   CompletedSegments.clear();
+   while (std::getline( file, line )) {
+      std::istringstream stream(line);
+      std::string tag;
+      uint32_t first_frame = 0, frame_count = 0;
+      if (!(stream >> tag >> first_frame >> frame_count) || tag != "done") continue;
+
+      // A line cut short by a crash does not match any planned segment and is ignored.
+      const auto segment = std::find_if(
+         Segments.begin(), Segments.end(),
+         [first_frame](const Segment& s) { return s.FirstFrame == first_frame; }
+      );
+      if (segment != Segments.end() && segment->FrameCount == frame_count) CompletedSegments.insert( first_frame );
+   }
+}
+
+std::vector<RenderManifest::Segment> RenderManifest::getPendingSegments() const
+{
+   std::vector<Segment> pending;
+   for (const auto& segment : Segments) {
+      if (CompletedSegments.find( segment.FirstFrame ) == CompletedSegments.end()) pending.push_back( segment );
+   }
+   return pending;
+}
+
+void RenderManifest::markComplete(const Segment& segment)
+{
+   // The segment is flushed first, so that a segment listed in the manifest also survives a power loss.
+   const std::filesystem::path segment_path = getSegmentPath( segment );
+   if (!syncFile( segment_path )) throw std::runtime_error("could not flush " + segment_path.string());
+
+   const std::string line =
+      "done " + std::to_string( segment.FirstFrame ) + " " + std::to_string( segment.FrameCount );
+   if (!appendLine( ManifestPath, line, O_APPEND )) {
+      throw std::runtime_error("could not update " + ManifestPath.string());
+   }
+   CompletedSegments.insert( segment.FirstFrame );
+}
+
+std::filesystem::path RenderManifest::getSegmentPath(const Segment& segment) const
+{
+   std::ostringstream name;
+   name << std::setw( 10 ) << std::setfill( '0' ) << segment.FirstFrame << ".mp4";
+   return std::filesystem::path(ManifestPath).replace_extension( ".segments" ) / name.str();
+}
+
+SegmentedRender::SegmentedRender(RenderJob job) :
+   Job( std::move( job ) ),
+   Manifest( (Job.Outputs.empty() ? std::filesystem::path() : Job.Outputs.front().Path).concat( ".manifest" ), Job ),
+   SegmentOptions( Job.getEncoderOptions() )
+{
+   if (Job.Outputs.size() != 1) throw std::runtime_error("a segmented job has a single output");
+}
+
+bool SegmentedRender::renderSegments(RendererVK& renderer, int worker_index, int worker_count)
+{
+   try {
+      Manifest.load();
+      const std::vector<RenderManifest::Segment> pending = Manifest.getPendingSegments();
+      renderer.resize( Job.Width, Job.Height );
+      if (!Job.Scene.empty()) renderer.setTexture( Job.Scene );
+      renderer.setRenditions( {} );
+      renderer.setEncoderOptions( SegmentOptions );
+      renderer.setChunkEncoders( Job.ChunkEncoders );
+      // The segments are plain files, which stitch() muxes into the layout of the job.
+      renderer.setMuxerOptions( MuxerOptions{} );
+      renderer.setCodec( Job.getCodecID() );
+      for (size_t i = static_cast<size_t>(worker_index); i < pending.size(); i += static_cast<size_t>(worker_count)) {
+         renderer.setFrameRange( pending[i].FirstFrame, pending[i].FrameCount );
+         renderer.setOutputPath( Manifest.getSegmentPath( pending[i] ) );
+         renderer.play();
+         Manifest.markComplete( pending[i] );
+      }
+   }
+   catch (const std::exception& exception) {
+      std::cerr << exception.what() << "\n";
+      return false;
+   }
+   return true;
+}
+
+bool SegmentedRender::run(int worker_count)
+{
+   // The workers run on shares of the budget, which may differ by a core. The encoders of all of them and the one
+   // of the stitch get the threads of the first share, so that they are opened with the same options.
+   const std::shared_ptr<const CoreBudget> budget = CoreBudget::getProcessBudget();
+   if (budget != nullptr && SegmentOptions.ThreadCount == 0) {
+      SegmentOptions.ThreadCount =
+         budget->split( std::max( worker_count, 1 ), 0 )->getThreadCount( CoreBudget::Stage::Encoding );
+   }
+   try {
+      Manifest.load();
+      runWorkers( worker_count );
+      Manifest.load();
+   }
+   catch (const std::exception& exception) {
+      std::cerr << exception.what() << "\n";
+      return false;
+   }
+
+   const size_t missing_count = Manifest.getPendingSegments().size();
+   if (missing_count > 0) {
+      std::cerr << missing_count << " of " << Manifest.getSegments().size()
+         << " segments are missing, run the job again to resume\n";
+      return false;
+   }
+   // The coordinator never plays, so this renderer only provides the settings the workers encoded with.
+   RendererVK renderer;
+   renderer.setEncoderOptions( SegmentOptions );
+   return stitch( renderer );
+}
+
+void SegmentedRender::runWorkers(int worker_count)
+{
+   const size_t pending_count = Manifest.getPendingSegments().size();
+   worker_count = static_cast<int>(std::min( static_cast<size_t>(std::max( worker_count, 1 )), pending_count ));
+   std::vector<pid_t> workers;
+   std::cout.flush();
+   std::cerr.flush();
+   for (int i = 0; i < worker_count; ++i) {
+      const pid_t process_id = fork();
+      if (process_id == 0) {
+         // The worker starts without any Vulkan or encoder state of the coordinator and creates its own. The workers
+         // render side by side, so each one gets its own share of the cores.
+         const std::shared_ptr<const CoreBudget> budget = CoreBudget::getProcessBudget();
+         if (budget != nullptr) CoreBudget::setProcessBudget( budget->split( worker_count, i ) );
+         RendererVK renderer;
+         const bool result = renderSegments( renderer, i, worker_count );
+         std::cout.flush();
+         std::cerr.flush();
+         _exit( result ? EXIT_SUCCESS : EXIT_FAILURE );
+      }
+      if (process_id < 0) {
+         std::cerr << "could not start worker " << i << "\n";
+         break;
+      }
+      workers.push_back( process_id );
+   }
+   for (const pid_t process_id : workers) {
+      int status = 0;
+      while (waitpid( process_id, &status, 0 ) < 0 && errno == EINTR) {}
+   }
+}
+
+bool SegmentedRender::appendSegment(
+   const VideoWriter& writer,
+   const std::filesystem::path& segment_path,
+   int64_t frame_offset,
+   AVRational frame_time_base
+)
+{
+   AVFormatContext* input = nullptr;
+   if (avformat_open_input( &input, segment_path.c_str(), nullptr, nullptr ) < 0) return false;
+
+   const int stream_index = avformat_find_stream_info( input, nullptr ) >= 0 ?
+      av_find_best_stream( input, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0 ) : -1;
+   bool succeeded = stream_index >= 0;
+   AVPacket* packet = av_packet_alloc();
+   while (succeeded && av_read_frame( input, packet ) >= 0) {
+      if (packet->stream_index == stream_index) {
+         // VideoWriter takes packets in the codec time base, which is one frame, like the ones of its own encoder.
+         av_packet_rescale_ts( packet, input->streams[stream_index]->time_base, frame_time_base );
+         if (packet->pts != AV_NOPTS_VALUE) packet->pts += frame_offset;
+         if (packet->dts != AV_NOPTS_VALUE) packet->dts += frame_offset;
+         succeeded = writer.writePacket( packet );
+      }
+      av_packet_unref( packet );
+   }
+   av_packet_free( &packet );
+   avformat_close_input( &input );
+   return succeeded;
+}
+
+bool SegmentedRender::stitch(const RendererVK& renderer)
+{
+   if (!Manifest.getPendingSegments().empty()) return false;
+
+   // The writer only contributes the stream parameters, which match the ones of the segments because they were
+   // encoded with the same options. It never encodes a frame itself.
+   VideoWriter writer;
+   const bool opened = writer.open(
+      Job.Outputs.front().Path,
+      static_cast<int>(Job.Width),
+      static_cast<int>(Job.Height),
+      renderer.getFramerate(),
+      Job.getCodecID(),
+      renderer.getEncoderOptions(),
+      Job.Muxer
+   );
+   if (!opened) return false;
+
+   const AVRational frame_time_base = av_inv_q( av_d2q( renderer.getFramerate(), 1000 ) );
+   bool succeeded = true;
+   for (const auto& segment : Manifest.getSegments()) {
+      succeeded = appendSegment(
+         writer,
+         Manifest.getSegmentPath( segment ),
+         static_cast<int64_t>(segment.FirstFrame - Job.FirstFrame),
+         frame_time_base
+      );
+      if (!succeeded) {
+         std::cerr << "Could not append " << Manifest.getSegmentPath( segment ).string() << "\n";
+         break;
+      }
+   }
+   writer.close();
+   return succeeded;
+}
\ No newline at end of file
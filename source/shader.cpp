@@ -1,16 +1,28 @@
 #include <shader.h>
 
-ShaderVK::ShaderVK(CommonVK* common) :
-   Common( common ), RenderPass{}, DescriptorSetLayout{}, PipelineLayout{}, GraphicsPipeline{}
+#include <unistd.h>
+
+ShaderVK::ShaderVK(CommonVK* common, const AssetBundle* assets) :
+   Common( common ), Assets( assets ), UsePipelineLibraries( Common->isGraphicsPipelineLibrarySupported() ),
+   RenderPass{}, DescriptorSetLayout{}, PipelineLayout{}, GraphicsPipeline{}, PipelineCache{}, VertexShaderModule{},
+   VertexInputLibrary{}, PreRasterizationLibrary{}, FragmentShaderLibrary{}, FragmentOutputLibrary{}
 {
 }
 
 ShaderVK::~ShaderVK()
 {
-   VkDevice device = CommonVK::getDevice();
+   VkDevice device = Common->getDevice();
    vkDestroyRenderPass( device, RenderPass, nullptr );
    vkDestroyDescriptorSetLayout( device, DescriptorSetLayout, nullptr);
+   for (VkPipeline variant : Variants) vkDestroyPipeline( device, variant, nullptr );
+   for (VkPipeline library : FragmentShaderLibraryVariants) vkDestroyPipeline( device, library, nullptr );
    vkDestroyPipeline( device, GraphicsPipeline, nullptr );
+   vkDestroyPipeline( device, VertexInputLibrary, nullptr );
+   vkDestroyPipeline( device, PreRasterizationLibrary, nullptr );
+   vkDestroyPipeline( device, FragmentShaderLibrary, nullptr );
+   vkDestroyPipeline( device, FragmentOutputLibrary, nullptr );
+   vkDestroyShaderModule( device, VertexShaderModule, nullptr );
+   vkDestroyPipelineCache( device, PipelineCache, nullptr );
    vkDestroyPipelineLayout( device, PipelineLayout, nullptr );
 }
 
@@ -27,7 +39,7 @@ void ShaderVK::createRenderPass(VkFormat color_format)
    color_attachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
    VkAttachmentDescription depth_attachment{};
-   depth_attachment.format = CommonVK::findDepthFormat();
+   depth_attachment.format = Common->findDepthFormat();
    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
@@ -50,13 +62,24 @@ void ShaderVK::createRenderPass(VkFormat color_format)
    subpass.pColorAttachments = &color_attachment_ref;
    subpass.pDepthStencilAttachment = &depth_attachment_ref;
 
-   VkSubpassDependency dependency{};
-   dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-   dependency.dstSubpass = 0;
-   dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-   dependency.srcAccessMask = 0;
-   dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-   dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+   // The readback copy of the previous frame reads the color attachment before it is cleared again, and the copy of
+   // this frame reads it right after the render pass, in the same command buffer.
+   std::array<VkSubpassDependency, 2> dependencies{};
+   dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+   dependencies[0].dstSubpass = 0;
+   dependencies[0].srcStageMask =
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+      VK_PIPELINE_STAGE_TRANSFER_BIT;
+   dependencies[0].srcAccessMask = 0;
+   dependencies[0].dstStageMask =
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+   dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+   dependencies[1].srcSubpass = 0;
+   dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+   dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+   dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+   dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+   dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
 
    std::array<VkAttachmentDescription, 2> attachments = { color_attachment, depth_attachment };
    VkRenderPassCreateInfo render_pass_info{};
@@ -65,11 +88,11 @@ void ShaderVK::createRenderPass(VkFormat color_format)
    render_pass_info.pAttachments = attachments.data();
    render_pass_info.subpassCount = 1;
    render_pass_info.pSubpasses = &subpass;
-   render_pass_info.dependencyCount = 1;
-   render_pass_info.pDependencies = &dependency;
+   render_pass_info.dependencyCount = static_cast<uint32_t>(dependencies.size());
+   render_pass_info.pDependencies = dependencies.data();
 
    const VkResult result = vkCreateRenderPass(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &render_pass_info,
       nullptr,
       &RenderPass
@@ -119,7 +142,7 @@ void ShaderVK::createDescriptorSetLayout()
    layoutInfo.pBindings = bindings.data();
 
    const VkResult result = vkCreateDescriptorSetLayout(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &layoutInfo,
       nullptr,
       &DescriptorSetLayout
@@ -141,16 +164,16 @@ std::vector<char> ShaderVK::readFile(const std::string& filename)
    return buffer;
 }
 
-VkShaderModule ShaderVK::createShaderModule(const std::vector<char>& code)
+VkShaderModule ShaderVK::createShaderModule(const uint32_t* code, size_t code_size) const
 {
    VkShaderModuleCreateInfo create_info{};
    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-   create_info.codeSize = code.size();
-   create_info.pCode = reinterpret_cast<const uint32_t*>(code.data());
+   create_info.codeSize = code_size;
+   create_info.pCode = code;
 
    VkShaderModule shader_module;
    const VkResult result = vkCreateShaderModule(
-      CommonVK::getDevice(),
+      Common->getDevice(),
       &create_info,
       nullptr,
       &shader_module
@@ -159,67 +182,113 @@ VkShaderModule ShaderVK::createShaderModule(const std::vector<char>& code)
    return shader_module;
 }
 
-void ShaderVK::createGraphicsPipeline(
-   const std::string& vertex_shader_path,
-   const std::string& fragment_shader_path,
-   const VkVertexInputBindingDescription& binding_description,
-   const  std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions,
-   const VkExtent2D& extent
-)
+VkShaderModule ShaderVK::createShaderModule(const std::string& shader_path) const
 {
-   std::vector<char> vert_shader_code = readFile( vertex_shader_path );
-   std::vector<char> frag_shader_code = readFile( fragment_shader_path );
+   // SPIR-V in the mapped asset bundle is used in place; the file is only read when the bundle does not have it.
+   if (Assets != nullptr) {
+      const std::optional<AssetBundle::Asset> asset =
+         Assets->find( std::filesystem::path(shader_path).filename().string() );
+      if (asset.has_value() && asset->Type == AssetBundle::EntryType::SPIRV) {
+         return createShaderModule( reinterpret_cast<const uint32_t*>(asset->Data), asset->Size );
+      }
+   }
+
+   const std::vector<char> code = readFile( shader_path );
+   return createShaderModule( reinterpret_cast<const uint32_t*>(code.data()), code.size() );
+}
 
-   VkShaderModule vert_shader_module = createShaderModule( vert_shader_code );
-   VkShaderModule frag_shader_module = createShaderModule( frag_shader_code );
+void ShaderVK::createPipelineCache()
+{
+   VkPipelineCacheCreateInfo cache_info{};
+   cache_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+   if (Assets != nullptr) {
+      const std::optional<AssetBundle::Asset> asset = Assets->find( "pipeline.cache" );
+      if (asset.has_value() && asset->Type == AssetBundle::EntryType::PipelineCache) {
+         // The driver validates the header and ignores the data if it comes from another device or driver.
+         cache_info.initialDataSize = asset->Size;
+         cache_info.pInitialData = asset->Data;
+      }
+   }
+
+   const VkResult result = vkCreatePipelineCache(
+      Common->getDevice(),
+      &cache_info,
+      nullptr,
+      &PipelineCache
+   );
+   if (result != VK_SUCCESS) throw std::runtime_error("failed to create pipeline cache!");
+}
 
-   VkPipelineShaderStageCreateInfo vert_shader_stage_info{};
-   vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-   vert_shader_stage_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-   vert_shader_stage_info.module = vert_shader_module;
-   vert_shader_stage_info.pName = "main";
+void ShaderVK::savePipelineCache(const std::filesystem::path& cache_file_path) const
+{
+   if (PipelineCache == VK_NULL_HANDLE) return;
+
+   size_t data_size = 0;
+   vkGetPipelineCacheData( Common->getDevice(), PipelineCache, &data_size, nullptr );
+   std::vector<char> data(data_size);
+   if (vkGetPipelineCacheData( Common->getDevice(), PipelineCache, &data_size, data.data() ) != VK_SUCCESS) return;
+
+   // Renderers on other threads or in other processes may save at the same time, so each one writes a file of its own
+   // and renames it over the cache, which replaces the cache at once.
+   std::ostringstream temporary_name;
+   temporary_name << cache_file_path.filename().string() << "." << getpid() << "." << std::this_thread::get_id();
+   const std::filesystem::path temporary_path = cache_file_path.parent_path() / temporary_name.str();
+   bool written;
+   {
+      std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+      written = static_cast<bool>(file.write( data.data(), static_cast<std::streamsize>(data_size) ));
+   }
+
+   std::error_code error;
+   if (written) std::filesystem::rename( temporary_path, cache_file_path, error );
+   if (!written || error) std::filesystem::remove( temporary_path, error );
+}
 
-   VkPipelineShaderStageCreateInfo frag_shader_stage_info{};
-   frag_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-   frag_shader_stage_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-   frag_shader_stage_info.module = frag_shader_module;
-   frag_shader_stage_info.pName = "main";
+VkPipelineShaderStageCreateInfo ShaderVK::getShaderStageInfo(VkShaderStageFlagBits stage, VkShaderModule module)
+{
+   VkPipelineShaderStageCreateInfo shader_stage_info{};
+   shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+   shader_stage_info.stage = stage;
+   shader_stage_info.module = module;
+   shader_stage_info.pName = "main";
+   return shader_stage_info;
+}
 
-   VkPipelineVertexInputStateCreateInfo vertex_input_info{};
-   vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-   vertex_input_info.vertexBindingDescriptionCount = 0;
-   vertex_input_info.vertexAttributeDescriptionCount = 0;
+void ShaderVK::initializePipelineStates(
+   const VkVertexInputBindingDescription& binding_description,
+   const std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions
+)
+{
+   States = std::make_unique<PipelineStates>();
+   States->BindingDescription = binding_description;
+   States->AttributeDescriptions = attribute_descriptions;
 
+   VkPipelineVertexInputStateCreateInfo& vertex_input_info = States->VertexInput;
+   vertex_input_info = {};
+   vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
    vertex_input_info.vertexBindingDescriptionCount = 1;
-   vertex_input_info.pVertexBindingDescriptions = &binding_description;
-   vertex_input_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(attribute_descriptions.size());
-   vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions.data();
+   vertex_input_info.pVertexBindingDescriptions = &States->BindingDescription;
+   vertex_input_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(States->AttributeDescriptions.size());
+   vertex_input_info.pVertexAttributeDescriptions = States->AttributeDescriptions.data();
 
-   VkPipelineInputAssemblyStateCreateInfo input_assembly{};
+   VkPipelineInputAssemblyStateCreateInfo& input_assembly = States->InputAssembly;
+   input_assembly = {};
    input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
    input_assembly.primitiveRestartEnable = VK_FALSE;
 
-   VkViewport viewport{};
-   viewport.x = 0.0f;
-   viewport.y = 0.0f;
-   viewport.width = static_cast<float>(extent.width);
-   viewport.height = static_cast<float>(extent.height);
-   viewport.minDepth = 0.0f;
-   viewport.maxDepth = 1.0f;
-
-   VkRect2D scissor{};
-   scissor.offset = { 0, 0 };
-   scissor.extent = extent;
-
-   VkPipelineViewportStateCreateInfo viewport_state{};
+   // The viewport and scissor are set when recording the command buffer, so the pipeline does not depend on
+   // the render target size.
+   VkPipelineViewportStateCreateInfo& viewport_state = States->ViewportState;
+   viewport_state = {};
    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
    viewport_state.viewportCount = 1;
-   viewport_state.pViewports = &viewport;
+   viewport_state.pViewports = nullptr;
    viewport_state.scissorCount = 1;
-   viewport_state.pScissors = &scissor;
+   viewport_state.pScissors = nullptr;
 
-   VkPipelineRasterizationStateCreateInfo rasterizer{};
+   VkPipelineRasterizationStateCreateInfo& rasterizer = States->Rasterizer;
+   rasterizer = {};
    rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
    rasterizer.depthClampEnable = VK_FALSE;
    rasterizer.rasterizerDiscardEnable = VK_FALSE;
@@ -229,12 +298,14 @@ void ShaderVK::createGraphicsPipeline(
    rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
    rasterizer.depthBiasEnable = VK_FALSE;
 
-   VkPipelineMultisampleStateCreateInfo multisampling{};
+   VkPipelineMultisampleStateCreateInfo& multisampling = States->Multisampling;
+   multisampling = {};
    multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
    multisampling.sampleShadingEnable = VK_FALSE;
    multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
-   VkPipelineDepthStencilStateCreateInfo depth_stencil{};
+   VkPipelineDepthStencilStateCreateInfo& depth_stencil = States->DepthStencil;
+   depth_stencil = {};
    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
    depth_stencil.depthTestEnable = VK_TRUE;
    depth_stencil.depthWriteEnable = VK_TRUE;
@@ -242,62 +313,233 @@ void ShaderVK::createGraphicsPipeline(
    depth_stencil.depthBoundsTestEnable = VK_FALSE;
    depth_stencil.stencilTestEnable = VK_FALSE;
 
-   VkPipelineColorBlendAttachmentState color_blend_attachment{};
+   VkPipelineColorBlendAttachmentState& color_blend_attachment = States->ColorBlendAttachment;
+   color_blend_attachment = {};
    color_blend_attachment.colorWriteMask =
       VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
    color_blend_attachment.blendEnable = VK_FALSE;
 
-   VkPipelineColorBlendStateCreateInfo color_blending{};
+   VkPipelineColorBlendStateCreateInfo& color_blending = States->ColorBlending;
+   color_blending = {};
    color_blending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
    color_blending.logicOpEnable = VK_FALSE;
    color_blending.logicOp = VK_LOGIC_OP_COPY;
    color_blending.attachmentCount = 1;
-   color_blending.pAttachments = &color_blend_attachment;
+   color_blending.pAttachments = &States->ColorBlendAttachment;
    color_blending.blendConstants[0] = 0.0f;
    color_blending.blendConstants[1] = 0.0f;
    color_blending.blendConstants[2] = 0.0f;
    color_blending.blendConstants[3] = 0.0f;
 
+   States->DynamicStates = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+   VkPipelineDynamicStateCreateInfo& dynamic_state = States->DynamicState;
+   dynamic_state = {};
+   dynamic_state.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+   dynamic_state.dynamicStateCount = static_cast<uint32_t>(States->DynamicStates.size());
+   dynamic_state.pDynamicStates = States->DynamicStates.data();
+}
+
+void ShaderVK::createPipelineLayout()
+{
    VkPipelineLayoutCreateInfo pipeline_layout_info{};
    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
    pipeline_layout_info.setLayoutCount = 1;
    pipeline_layout_info.pSetLayouts = &DescriptorSetLayout;
 
-   VkResult result = vkCreatePipelineLayout(
-      CommonVK::getDevice(),
+   const VkResult result = vkCreatePipelineLayout(
+      Common->getDevice(),
       &pipeline_layout_info,
       nullptr,
       &PipelineLayout
    );
    if (result != VK_SUCCESS) throw std::runtime_error("failed to create pipeline layout!");
+}
+
+VkPipeline ShaderVK::createPipelineLibrary(
+   VkGraphicsPipelineLibraryFlagsEXT library_flags,
+   VkGraphicsPipelineCreateInfo& pipeline_info
+) const
+{
+   VkGraphicsPipelineLibraryCreateInfoEXT library_info{};
+   library_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+   library_info.flags = library_flags;
+
+   pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+   pipeline_info.pNext = &library_info;
+   pipeline_info.flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR;
+   pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+
+   VkPipeline library;
+   const VkResult result = vkCreateGraphicsPipelines(
+      Common->getDevice(),
+      PipelineCache,
+      1,
+      &pipeline_info,
+      nullptr,
+      &library
+   );
+   if (result != VK_SUCCESS) throw std::runtime_error("failed to create graphics pipeline library!");
+   return library;
+}
 
-   std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages = { vert_shader_stage_info, frag_shader_stage_info };
+VkPipeline ShaderVK::createVertexInputLibrary() const
+{
+   VkGraphicsPipelineCreateInfo pipeline_info{};
+   pipeline_info.pVertexInputState = &States->VertexInput;
+   pipeline_info.pInputAssemblyState = &States->InputAssembly;
+   return createPipelineLibrary( VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT, pipeline_info );
+}
+
+VkPipeline ShaderVK::createPreRasterizationLibrary() const
+{
+   const VkPipelineShaderStageCreateInfo vert_shader_stage_info =
+      getShaderStageInfo( VK_SHADER_STAGE_VERTEX_BIT, VertexShaderModule );
+
+   VkGraphicsPipelineCreateInfo pipeline_info{};
+   pipeline_info.stageCount = 1;
+   pipeline_info.pStages = &vert_shader_stage_info;
+   pipeline_info.pViewportState = &States->ViewportState;
+   pipeline_info.pRasterizationState = &States->Rasterizer;
+   pipeline_info.pDynamicState = &States->DynamicState;
+   pipeline_info.layout = PipelineLayout;
+   pipeline_info.renderPass = RenderPass;
+   pipeline_info.subpass = 0;
+   return createPipelineLibrary( VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT, pipeline_info );
+}
+
+VkPipeline ShaderVK::createFragmentShaderLibrary(VkShaderModule fragment_shader_module) const
+{
+   const VkPipelineShaderStageCreateInfo frag_shader_stage_info =
+      getShaderStageInfo( VK_SHADER_STAGE_FRAGMENT_BIT, fragment_shader_module );
+
+   VkGraphicsPipelineCreateInfo pipeline_info{};
+   pipeline_info.stageCount = 1;
+   pipeline_info.pStages = &frag_shader_stage_info;
+   pipeline_info.pMultisampleState = &States->Multisampling;
+   pipeline_info.pDepthStencilState = &States->DepthStencil;
+   pipeline_info.layout = PipelineLayout;
+   pipeline_info.renderPass = RenderPass;
+   pipeline_info.subpass = 0;
+   return createPipelineLibrary( VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT, pipeline_info );
+}
+
+VkPipeline ShaderVK::createFragmentOutputLibrary() const
+{
+   VkGraphicsPipelineCreateInfo pipeline_info{};
+   pipeline_info.pMultisampleState = &States->Multisampling;
+   pipeline_info.pColorBlendState = &States->ColorBlending;
+   pipeline_info.renderPass = RenderPass;
+   pipeline_info.subpass = 0;
+   return createPipelineLibrary( VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT, pipeline_info );
+}
+
+VkPipeline ShaderVK::linkPipelineLibraries(VkPipeline fragment_shader_library) const
+{
+   const std::array<VkPipeline, 4> libraries = {
+      VertexInputLibrary,
+      PreRasterizationLibrary,
+      fragment_shader_library,
+      FragmentOutputLibrary
+   };
+   VkPipelineLibraryCreateInfoKHR linking_info{};
+   linking_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+   linking_info.libraryCount = static_cast<uint32_t>(libraries.size());
+   linking_info.pLibraries = libraries.data();
+
+   // No link time optimization is requested, so linking only stitches the precompiled libraries together.
+   VkGraphicsPipelineCreateInfo pipeline_info{};
+   pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+   pipeline_info.pNext = &linking_info;
+   pipeline_info.layout = PipelineLayout;
+   pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+
+   VkPipeline pipeline;
+   const VkResult result = vkCreateGraphicsPipelines(
+      Common->getDevice(),
+      PipelineCache,
+      1,
+      &pipeline_info,
+      nullptr,
+      &pipeline
+   );
+   if (result != VK_SUCCESS) throw std::runtime_error("failed to link graphics pipeline libraries!");
+   return pipeline;
+}
+
+VkPipeline ShaderVK::createMonolithicPipeline(VkShaderModule fragment_shader_module) const
+{
+   const std::array<VkPipelineShaderStageCreateInfo, 2> shader_stages = {
+      getShaderStageInfo( VK_SHADER_STAGE_VERTEX_BIT, VertexShaderModule ),
+      getShaderStageInfo( VK_SHADER_STAGE_FRAGMENT_BIT, fragment_shader_module )
+   };
    VkGraphicsPipelineCreateInfo pipeline_info{};
    pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-   pipeline_info.stageCount = shader_stages.size();
+   pipeline_info.stageCount = static_cast<uint32_t>(shader_stages.size());
    pipeline_info.pStages = shader_stages.data();
-   pipeline_info.pVertexInputState = &vertex_input_info;
-   pipeline_info.pInputAssemblyState = &input_assembly;
-   pipeline_info.pViewportState = &viewport_state;
-   pipeline_info.pRasterizationState = &rasterizer;
-   pipeline_info.pMultisampleState = &multisampling;
-   pipeline_info.pDepthStencilState = &depth_stencil;
-   pipeline_info.pColorBlendState = &color_blending;
+   pipeline_info.pVertexInputState = &States->VertexInput;
+   pipeline_info.pInputAssemblyState = &States->InputAssembly;
+   pipeline_info.pViewportState = &States->ViewportState;
+   pipeline_info.pRasterizationState = &States->Rasterizer;
+   pipeline_info.pMultisampleState = &States->Multisampling;
+   pipeline_info.pDepthStencilState = &States->DepthStencil;
+   pipeline_info.pColorBlendState = &States->ColorBlending;
+   pipeline_info.pDynamicState = &States->DynamicState;
    pipeline_info.layout = PipelineLayout;
    pipeline_info.renderPass = RenderPass;
    pipeline_info.subpass = 0;
    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
 
-   result = vkCreateGraphicsPipelines(
-      CommonVK::getDevice(),
-      VK_NULL_HANDLE,
+   VkPipeline pipeline;
+   const VkResult result = vkCreateGraphicsPipelines(
+      Common->getDevice(),
+      PipelineCache,
       1,
       &pipeline_info,
       nullptr,
-      &GraphicsPipeline
+      &pipeline
    );
    if (result != VK_SUCCESS) throw std::runtime_error("failed to create graphics pipeline!");
+   return pipeline;
+}
 
-   vkDestroyShaderModule( CommonVK::getDevice(), frag_shader_module, nullptr );
-   vkDestroyShaderModule( CommonVK::getDevice(), vert_shader_module, nullptr );
+void ShaderVK::createGraphicsPipeline(
+   const std::string& vertex_shader_path,
+   const std::string& fragment_shader_path,
+   const VkVertexInputBindingDescription& binding_description,
+   const  std::array<VkVertexInputAttributeDescription, 3>& attribute_descriptions
+)
+{
+   initializePipelineStates( binding_description, attribute_descriptions );
+   createPipelineLayout();
+   createPipelineCache();
+
+   VertexShaderModule = createShaderModule( vertex_shader_path );
+   VkShaderModule frag_shader_module = createShaderModule( fragment_shader_path );
+   if (UsePipelineLibraries) {
+      VertexInputLibrary = createVertexInputLibrary();
+      PreRasterizationLibrary = createPreRasterizationLibrary();
+      FragmentShaderLibrary = createFragmentShaderLibrary( frag_shader_module );
+      FragmentOutputLibrary = createFragmentOutputLibrary();
+      GraphicsPipeline = linkPipelineLibraries( FragmentShaderLibrary );
+   }
+   else GraphicsPipeline = createMonolithicPipeline( frag_shader_module );
+   vkDestroyShaderModule( Common->getDevice(), frag_shader_module, nullptr );
+}
+
+VkPipeline ShaderVK::createFragmentVariant(const std::string& fragment_shader_path)
+{
+   if (States == nullptr) throw std::runtime_error("base graphics pipeline must be created before its variants!");
+
+   VkShaderModule frag_shader_module = createShaderModule( fragment_shader_path );
+   VkPipeline variant;
+   if (UsePipelineLibraries) {
+      VkPipeline fragment_shader_library = createFragmentShaderLibrary( frag_shader_module );
+      FragmentShaderLibraryVariants.emplace_back( fragment_shader_library );
+      variant = linkPipelineLibraries( fragment_shader_library );
+   }
+   else variant = createMonolithicPipeline( frag_shader_module );
+   vkDestroyShaderModule( Common->getDevice(), frag_shader_module, nullptr );
+
+   Variants.emplace_back( variant );
+   return variant;
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "asset_bundle.h"
+
+// usage: bundle_assets <output bundle> <asset file>...
+// Every asset is stored under its file name. Images are decoded here, so that the renderer can upload them as they are.
+// Missing and empty inputs are skipped, which allows optional assets such as a pipeline cache of a previous run.
+
+struct BundleInput
+{
+   AssetBundle::IndexEntry Entry;
+   std::vector<uint8_t> Payload;
+};
+
+static std::vector<uint8_t> readFile(const std::filesystem::path& file_path)
+{
+   std::ifstream file(file_path, std::ios::ate | std::ios::binary);
+   if (!file.is_open()) throw std::runtime_error("failed to open " + file_path.string());
+
+   const auto file_size = static_cast<size_t>(file.tellg());
+   std::vector<uint8_t> buffer(file_size);
+   file.seekg( 0 );
+   file.read( reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(file_size) );
+   return buffer;
+}
+
+static void decodeTexture(const std::filesystem::path& file_path, BundleInput& input)
+{
+   const FREE_IMAGE_FORMAT format = FreeImage_GetFileType( file_path.c_str(), 0 );
+   FIBITMAP* texture = FreeImage_Load( format, file_path.c_str() );
+   if (texture == nullptr) throw std::runtime_error("failed to decode " + file_path.string());
+
+   constexpr uint n_bits = 32;
+   const uint n_bits_per_pixel = FreeImage_GetBPP( texture );
+   FIBITMAP* texture_converted = n_bits_per_pixel == n_bits ? texture : FreeImage_ConvertTo32Bits( texture );
+
+   // The pixels are stored exactly as ObjectVK would get them from FreeImage, so the upload stays a plain copy.
+   const uint width = FreeImage_GetWidth( texture_converted );
+   const uint height = FreeImage_GetHeight( texture_converted );
+   const auto* pixels = static_cast<const uint8_t*>(FreeImage_GetBits( texture_converted ));
+   input.Entry.Type = AssetBundle::EntryType::TextureRGBA8;
+   input.Entry.Width = width;
+   input.Entry.Height = height;
+   input.Payload.assign( pixels, pixels + static_cast<size_t>(width) * height * 4 );
+
+   FreeImage_Unload( texture_converted );
+   if (n_bits_per_pixel != n_bits) FreeImage_Unload( texture );
+}
+
+static BundleInput loadInput(const std::filesystem::path& file_path)
+{
+   BundleInput input{};
+   const std::string name = file_path.filename().string();
+   if (name.size() >= input.Entry.Name.size()) throw std::runtime_error("asset name is too long: " + name);
+   std::copy( name.begin(), name.end(), input.Entry.Name.begin() );
+
+   const std::string extension = file_path.extension().string();
+   if (extension == ".png" || extension == ".jpg" || extension == ".jpeg") decodeTexture( file_path, input );
+   else {
+      input.Payload = readFile( file_path );
+      if (extension == ".spv") input.Entry.Type = AssetBundle::EntryType::SPIRV;
+      else if (extension == ".cache") input.Entry.Type = AssetBundle::EntryType::PipelineCache;
+      else input.Entry.Type = AssetBundle::EntryType::Binary;
+   }
+   input.Entry.Size = input.Payload.size();
+   return input;
+}
+
+int main(int argc, char** argv)
+{
+   if (argc < 2) {
+      std::cerr << "usage: " << argv[0] << " <output bundle> <asset file>...\n";
+      return 1;
+   }
+
+   FreeImage_Initialise();
+   std::vector<BundleInput> inputs;
+   for (int i = 2; i < argc; ++i) {
+      const std::filesystem::path file_path(argv[i]);
+      if (!std::filesystem::exists( file_path )) {
+         std::cout << "skipping missing asset " << file_path.string() << "\n";
+         continue;
+      }
+      if (std::filesystem::file_size( file_path ) == 0) {
+         std::cout << "skipping empty asset " << file_path.string() << "\n";
+         continue;
+      }
+      inputs.emplace_back( loadInput( file_path ) );
+   }
+   FreeImage_DeInitialise();
+
+   AssetBundle::Header header{};
+   header.Magic = AssetBundle::Magic;
+   header.Version = AssetBundle::Version;
+   header.EntryCount = static_cast<uint32_t>(inputs.size());
+
+   uint64_t offset = AssetBundle::align( sizeof( header ) + inputs.size() * sizeof( AssetBundle::IndexEntry ) );
+   for (auto& input : inputs) {
+      input.Entry.Offset = offset;
+      offset = AssetBundle::align( offset + input.Entry.Size );
+   }
+
+   std::ofstream file(argv[1], std::ios::binary | std::ios::trunc);
+   if (!file.is_open()) {
+      std::cerr << "failed to create " << argv[1] << "\n";
+      return 1;
+   }
+   file.write( reinterpret_cast<const char*>(&header), sizeof( header ) );
+   for (const auto& input : inputs) {
+      file.write( reinterpret_cast<const char*>(&input.Entry), sizeof( input.Entry ) );
+   }
+   for (const auto& input : inputs) {
+      const std::vector<char> padding(input.Entry.Offset - static_cast<uint64_t>(file.tellp()), 0);
+      file.write( padding.data(), static_cast<std::streamsize>(padding.size()) );
+      file.write( reinterpret_cast<const char*>(input.Payload.data()), static_cast<std::streamsize>(input.Payload.size()) );
+   }
+   return file.good() ? 0 : 1;
+}
\ No newline at end of file